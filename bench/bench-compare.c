@@ -0,0 +1,463 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Comparison of benchmark results with a baseline
+ *
+ * Both files are JSON arrays of flat objects as written by bench and by
+ * stress-captures; nested objects are flattened to "outer.inner". Results are
+ * matched by their identity fields, and each metric with a tolerance is
+ * compared. Larger values are worse for every metric.
+ *
+ * The tolerances are a JSON object mapping a metric to [relative, absolute];
+ * a metric regresses if it exceeds the baseline by both. Metrics without a
+ * tolerance are not compared. A result of the baseline missing from the
+ * results, or a compared metric it has and the results lack, fails the
+ * comparison like a regression. A metric that is null in the results cannot
+ * be measured on this host, such as the cycles without a cycle counter, and
+ * is skipped.
+ *
+ * usage: bench-compare tolerances baseline results
+ *
+ * exit status: 0 without regression, 1 with a regression or a missing result
+ * or metric, 2 on error
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+
+/* fields telling which case a result is */
+static const char *identity_fields[] = {
+	"bench", "format", "channels", "rate", "variant", "captures",
+};
+
+struct field {
+	char *name;
+	char *string;
+	double number;
+	bool is_string;
+	bool is_null;
+};
+
+struct result {
+	DARRAY(struct field) fields;
+	char *id;
+};
+
+struct result_list {
+	DARRAY(struct result) results;
+};
+
+struct tolerance {
+	char *metric;
+	double relative;
+	double absolute;
+};
+
+struct tolerance_list {
+	DARRAY(struct tolerance) tolerances;
+};
+
+struct parser {
+	const char *p;
+	const char *path;
+	bool error;
+};
+
+static void parse_error(struct parser *ps, const char *what)
+{
+	if (!ps->error)
+		fprintf(stderr, "%s: %s near '%.20s'\n", ps->path, what,
+			ps->p);
+	ps->error = true;
+}
+
+static void skip_space(struct parser *ps)
+{
+	while (isspace((unsigned char)*ps->p))
+		ps->p++;
+}
+
+static bool expect(struct parser *ps, char c)
+{
+	skip_space(ps);
+	if (*ps->p != c) {
+		char what[32];
+		snprintf(what, sizeof(what), "expected '%c'", c);
+		parse_error(ps, what);
+		return false;
+	}
+	ps->p++;
+	return true;
+}
+
+static char *parse_string(struct parser *ps)
+{
+	if (!expect(ps, '"'))
+		return NULL;
+
+	struct dstr s = {0};
+	dstr_copy(&s, "");
+	while (*ps->p && *ps->p != '"') {
+		char c = *ps->p++;
+		if (c == '\\' && *ps->p) {
+			c = *ps->p++;
+			if (c == 'n')
+				c = '\n';
+			else if (c == 't')
+				c = '\t';
+		}
+		dstr_cat_ch(&s, c);
+	}
+	if (!expect(ps, '"')) {
+		dstr_free(&s);
+		return NULL;
+	}
+
+	return s.array;
+}
+
+static void add_field(struct result *r, const char *prefix, const char *key,
+		      const char *string, double number)
+{
+	struct field f = {0};
+	struct dstr name = {0};
+
+	if (prefix)
+		dstr_printf(&name, "%s.%s", prefix, key);
+	else
+		dstr_copy(&name, key);
+
+	f.name = name.array;
+	f.string = string ? bstrdup(string) : NULL;
+	f.is_string = string != NULL;
+	f.number = number;
+	da_push_back(r->fields, &f);
+}
+
+static void parse_object(struct parser *ps, struct result *r,
+			 const char *prefix);
+
+static void parse_value(struct parser *ps, struct result *r,
+			const char *prefix, const char *key)
+{
+	skip_space(ps);
+
+	if (*ps->p == '"') {
+		char *s = parse_string(ps);
+		if (s)
+			add_field(r, prefix, key, s, 0.0);
+		bfree(s);
+	} else if (*ps->p == '{') {
+		struct dstr nested = {0};
+		if (prefix)
+			dstr_printf(&nested, "%s.%s", prefix, key);
+		else
+			dstr_copy(&nested, key);
+		parse_object(ps, r, nested.array);
+		dstr_free(&nested);
+	} else if (strncmp(ps->p, "null", 4) == 0) {
+		/* a metric not measured on this host */
+		ps->p += 4;
+		add_field(r, prefix, key, NULL, 0.0);
+		r->fields.array[r->fields.num - 1].is_null = true;
+	} else if (strncmp(ps->p, "true", 4) == 0) {
+		ps->p += 4;
+		add_field(r, prefix, key, NULL, 1.0);
+	} else if (strncmp(ps->p, "false", 5) == 0) {
+		ps->p += 5;
+		add_field(r, prefix, key, NULL, 0.0);
+	} else {
+		char *end;
+		double v = strtod(ps->p, &end);
+		if (end == ps->p) {
+			parse_error(ps, "unexpected value");
+			return;
+		}
+		ps->p = end;
+		add_field(r, prefix, key, NULL, v);
+	}
+}
+
+static void parse_object(struct parser *ps, struct result *r,
+			 const char *prefix)
+{
+	if (!expect(ps, '{'))
+		return;
+
+	skip_space(ps);
+	if (*ps->p == '}') {
+		ps->p++;
+		return;
+	}
+
+	while (!ps->error) {
+		char *key = parse_string(ps);
+		if (!key || !expect(ps, ':')) {
+			bfree(key);
+			return;
+		}
+		parse_value(ps, r, prefix, key);
+		bfree(key);
+
+		skip_space(ps);
+		if (*ps->p == ',') {
+			ps->p++;
+			continue;
+		}
+		expect(ps, '}');
+		return;
+	}
+}
+
+static const struct field *find_field(const struct result *r,
+				      const char *name)
+{
+	for (size_t i = 0; i < r->fields.num; i++) {
+		if (strcmp(r->fields.array[i].name, name) == 0)
+			return &r->fields.array[i];
+	}
+	return NULL;
+}
+
+static char *result_id(const struct result *r)
+{
+	struct dstr id = {0};
+	dstr_copy(&id, "");
+
+	for (size_t i = 0; i < sizeof(identity_fields) / sizeof(char *); i++) {
+		const struct field *f = find_field(r, identity_fields[i]);
+		if (!f)
+			continue;
+		if (id.len)
+			dstr_cat_ch(&id, ' ');
+		if (f->is_string)
+			dstr_catf(&id, "%s=%s", f->name, f->string);
+		else
+			dstr_catf(&id, "%s=%g", f->name, f->number);
+	}
+
+	return id.array;
+}
+
+static void free_result(struct result *r)
+{
+	for (size_t i = 0; i < r->fields.num; i++) {
+		bfree(r->fields.array[i].name);
+		bfree(r->fields.array[i].string);
+	}
+	da_free(r->fields);
+	bfree(r->id);
+}
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Unable to open '%s'\n", path);
+		return NULL;
+	}
+
+	struct dstr s = {0};
+	char buf[4096];
+	size_t n;
+	dstr_copy(&s, "");
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		dstr_ncat(&s, buf, n);
+	fclose(f);
+
+	return s.array;
+}
+
+static bool load_results(const char *path, struct result_list *list)
+{
+	char *text = read_file(path);
+	if (!text)
+		return false;
+
+	struct parser ps = {text, path, false};
+	if (expect(&ps, '[')) {
+		skip_space(&ps);
+		while (!ps.error && *ps.p != ']') {
+			struct result r = {0};
+			parse_object(&ps, &r, NULL);
+			r.id = result_id(&r);
+			da_push_back(list->results, &r);
+
+			skip_space(&ps);
+			if (*ps.p == ',')
+				ps.p++;
+			else
+				break;
+			skip_space(&ps);
+		}
+		expect(&ps, ']');
+	}
+
+	bfree(text);
+	return !ps.error;
+}
+
+static bool load_tolerances(const char *path, struct tolerance_list *list)
+{
+	char *text = read_file(path);
+	if (!text)
+		return false;
+
+	struct parser ps = {text, path, false};
+	if (expect(&ps, '{')) {
+		while (!ps.error) {
+			struct tolerance t = {0};
+			t.metric = parse_string(&ps);
+			if (!t.metric || !expect(&ps, ':') ||
+			    !expect(&ps, '[')) {
+				bfree(t.metric);
+				break;
+			}
+			char *end;
+			skip_space(&ps);
+			t.relative = strtod(ps.p, &end);
+			ps.p = end;
+			if (!expect(&ps, ','))
+				break;
+			skip_space(&ps);
+			t.absolute = strtod(ps.p, &end);
+			ps.p = end;
+			if (!expect(&ps, ']')) {
+				bfree(t.metric);
+				break;
+			}
+			da_push_back(list->tolerances, &t);
+
+			skip_space(&ps);
+			if (*ps.p == ',') {
+				ps.p++;
+				continue;
+			}
+			expect(&ps, '}');
+			break;
+		}
+	}
+
+	bfree(text);
+	return !ps.error;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s tolerances baseline results\n",
+			argv[0]);
+		return 2;
+	}
+
+	struct tolerance_list tl = {0};
+	struct result_list bl = {0};
+	struct result_list cl = {0};
+	int ret = 2;
+
+	if (!load_tolerances(argv[1], &tl) || !load_results(argv[2], &bl) ||
+	    !load_results(argv[3], &cl))
+		goto exit;
+
+	size_t compared = 0, regressions = 0, improvements = 0, missing = 0;
+	size_t skipped = 0;
+
+	for (size_t i = 0; i < bl.results.num; i++) {
+		const struct result *b = &bl.results.array[i];
+		const struct result *c = NULL;
+		for (size_t j = 0; j < cl.results.num; j++) {
+			if (strcmp(b->id, cl.results.array[j].id) == 0) {
+				c = &cl.results.array[j];
+				break;
+			}
+		}
+		if (!c) {
+			printf("MISSING     %s\n", b->id);
+			missing++;
+			continue;
+		}
+
+		for (size_t k = 0; k < tl.tolerances.num; k++) {
+			const struct tolerance *t = &tl.tolerances.array[k];
+			const struct field *fb = find_field(b, t->metric);
+			const struct field *fc = find_field(c, t->metric);
+			if (!fb || fb->is_string || fb->is_null)
+				continue;
+
+			if (fc && fc->is_null) {
+				skipped++;
+				continue;
+			}
+
+			/* not measured, a regression could go unnoticed */
+			if (!fc || fc->is_string) {
+				printf("MISSING     %s: %s\n", b->id, t->metric);
+				missing++;
+				continue;
+			}
+
+			const double diff = fc->number - fb->number;
+			const double limit = fmax(
+				fabs(fb->number) * t->relative, t->absolute);
+			const double percent =
+				fb->number != 0.0
+					? 100.0 * diff / fabs(fb->number)
+					: 0.0;
+			compared++;
+
+			if (diff > limit) {
+				printf("REGRESSION  %s: %s %g -> %g "
+				       "(%+.1f%%, tolerance %+.0f%% or %+g)\n",
+				       b->id, t->metric, fb->number,
+				       fc->number, percent,
+				       100.0 * t->relative, t->absolute);
+				regressions++;
+			} else if (-diff > limit && limit > 0.0) {
+				printf("IMPROVEMENT %s: %s %g -> %g (%+.1f%%)\n",
+				       b->id, t->metric, fb->number,
+				       fc->number, percent);
+				improvements++;
+			}
+		}
+	}
+
+	printf("%zu metrics compared, %zu regressions, %zu improvements, "
+	       "%zu results or metrics missing, %zu not measurable here\n",
+	       compared, regressions, improvements, missing, skipped);
+	ret = regressions || missing ? 1 : 0;
+
+exit:
+	for (size_t i = 0; i < tl.tolerances.num; i++)
+		bfree(tl.tolerances.array[i].metric);
+	da_free(tl.tolerances);
+	for (size_t i = 0; i < bl.results.num; i++)
+		free_result(&bl.results.array[i]);
+	da_free(bl.results);
+	for (size_t i = 0; i < cl.results.num; i++)
+		free_result(&cl.results.array[i]);
+	da_free(cl.results);
+
+	return ret;
+}
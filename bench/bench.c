@@ -0,0 +1,421 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark of the per-packet processing of the captured frames
+ *
+ * Synthetic interleaved packets of 25 ms, the fragment size requested from
+ * the server, are fed through the processing kernels without OBS running.
+ * The read path case replays them through the capture as a trace would, so
+ * no server is needed either. The properties case builds the properties of
+ * both sources as the dialog does when it opens, listing the devices of the
+ * running server if there is one.
+ * The results are written to stdout as a JSON array, the log goes to stderr.
+ *
+ * usage: bench [min-ms-per-case]
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <obs-module.h>
+
+#include "channel-remap.h"
+#include "device-timeline.h"
+#include "event-log.h"
+#include "pulse-capture.h"
+#include "pulse-wrapper.h"
+#include "shm-tap.h"
+
+#define FRAGMENT_MS 25
+
+struct bench_case {
+	const char *name;
+	pa_sample_format_t format;
+	uint32_t channels;
+	uint32_t rate;
+	const char *variant;
+};
+
+struct bench_result {
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t ns;
+	uint64_t cycles;
+};
+
+typedef void (*bench_packet_t)(void *ctx, const uint8_t *data,
+			       uint32_t frames, uint64_t ts);
+
+static const pa_sample_format_t formats[] = {
+	PA_SAMPLE_U8,
+	PA_SAMPLE_S16LE,
+	PA_SAMPLE_S32LE,
+	PA_SAMPLE_FLOAT32LE,
+};
+
+static const uint32_t rates[] = {44100, 48000, 96000, 192000};
+
+static uint64_t min_ns = 200000000;
+static bool first_result = true;
+
+extern struct obs_source_info pulse_input_capture;
+extern struct obs_source_info pulse_output_capture;
+
+/* the module is not loaded, the properties show the keys of the locale */
+const char *obs_module_text(const char *lookup)
+{
+	return lookup;
+}
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(level);
+	UNUSED_PARAMETER(param);
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static inline uint64_t read_cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static uint8_t *make_packet(const pa_sample_spec *spec, uint32_t frames)
+{
+	size_t size = pa_frame_size(spec) * frames;
+	uint8_t *data = bmalloc(size);
+
+	/* any pattern works since the kernels don't branch on the values */
+	for (size_t i = 0; i < size; i++)
+		data[i] = (uint8_t)(i * 97 + 13);
+
+	if (spec->format == PA_SAMPLE_FLOAT32LE) {
+		float *f = (float *)data;
+		for (size_t i = 0; i < size / sizeof(float); i++)
+			f[i] = (float)((i * 97 + 13) % 2001) / 1000.0f - 1.0f;
+	}
+
+	return data;
+}
+
+static void run_case(const struct bench_case *c, bench_packet_t packet,
+		     void *ctx)
+{
+	const pa_sample_spec spec = {c->format, c->rate, (uint8_t)c->channels};
+	const uint32_t frames = c->rate * FRAGMENT_MS / 1000;
+	uint8_t *data = make_packet(&spec, frames);
+	struct bench_result r = {0};
+
+	/* warm up the caches and the buffers of the kernels */
+	packet(ctx, data, frames, 0);
+
+	const uint64_t start = os_gettime_ns();
+	const uint64_t start_cycles = read_cycles();
+	uint64_t ts = 0;
+	do {
+		for (int i = 0; i < 16; i++) {
+			ts += (uint64_t)FRAGMENT_MS * 1000000;
+			packet(ctx, data, frames, ts);
+			r.packets++;
+			r.frames += frames;
+		}
+		r.ns = os_gettime_ns() - start;
+	} while (r.ns < min_ns);
+	r.cycles = read_cycles() - start_cycles;
+
+	bfree(data);
+
+	const double ns_per_frame = (double)r.ns / (double)r.frames;
+	const uint64_t samples = r.frames * c->channels;
+
+	printf("%s\n  {\"bench\": \"%s\", \"format\": \"%s\", "
+	       "\"channels\": %" PRIu32 ", \"rate\": %" PRIu32 ", ",
+	       first_result ? "" : ",", c->name,
+	       pa_sample_format_to_string(c->format), c->channels, c->rate);
+	if (c->variant)
+		printf("\"variant\": \"%s\", ", c->variant);
+	printf("\"frames_per_packet\": %" PRIu32 ", \"packets\": %" PRIu64
+	       ", \"ns_per_frame\": %.4f, \"frames_per_sec\": %.0f, ",
+	       frames, r.packets, ns_per_frame, 1e9 / ns_per_frame);
+#ifdef HAVE_RDTSC
+	printf("\"cycles_per_sample\": %.4f}",
+	       (double)r.cycles / (double)samples);
+#else
+	UNUSED_PARAMETER(samples);
+	printf("\"cycles_per_sample\": null}");
+#endif
+	fflush(stdout);
+	first_result = false;
+}
+
+static void remap_packet(void *ctx, const uint8_t *data, uint32_t frames,
+			 uint64_t ts)
+{
+	UNUSED_PARAMETER(ts);
+	const uint8_t *planes[MAX_AUDIO_CHANNELS];
+
+	channel_remap_process(ctx, data, frames, planes);
+}
+
+/* the frames of a layout OBS represents are handed over as they are */
+static void passthrough_packet(void *ctx, const uint8_t *data, uint32_t frames,
+			       uint64_t ts)
+{
+	UNUSED_PARAMETER(frames);
+	UNUSED_PARAMETER(ts);
+	const uint8_t **planes = ctx;
+
+	planes[0] = data;
+}
+
+static void bench_layout_adapter(pa_sample_format_t format, uint32_t channels,
+				 enum channel_remap_mode mode)
+{
+	static const char *modes[] = {"pad", "fold"};
+	const bool native = pulse_channels_to_obs_speakers(channels) !=
+			    SPEAKERS_UNKNOWN;
+
+	/* both modes pass a native layout through, report it once */
+	if (native && mode != CHANNEL_REMAP_PAD)
+		return;
+
+	for (size_t r = 0; r < sizeof(rates) / sizeof(*rates); r++) {
+		if (native) {
+			const uint8_t *planes[MAX_AUDIO_CHANNELS];
+			struct bench_case c = {"layout_adapter", format,
+					       channels, rates[r],
+					       "passthrough"};
+			run_case(&c, passthrough_packet, (void *)planes);
+			continue;
+		}
+
+		struct channel_remap *remap =
+			channel_remap_create(format, channels, mode, 0.7f);
+		if (!remap) {
+			blog(LOG_ERROR,
+			     "No layout adapter for %s %" PRIu32 " channels",
+			     pa_sample_format_to_string(format), channels);
+			return;
+		}
+
+		struct bench_case c = {"layout_adapter", format, channels,
+				       rates[r], modes[mode]};
+		run_case(&c, remap_packet, remap);
+		channel_remap_destroy(remap);
+	}
+}
+
+static void shm_tap_packet(void *ctx, const uint8_t *data, uint32_t frames,
+			   uint64_t ts)
+{
+	shm_tap_write(ctx, data, frames, ts);
+}
+
+static void bench_shm_tap(pa_sample_format_t format, uint32_t channels)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "obs-pulse-mc-bench-%d", (int)getpid());
+
+	for (size_t r = 0; r < sizeof(rates) / sizeof(*rates); r++) {
+		const pa_sample_spec spec = {format, rates[r],
+					     (uint8_t)channels};
+		struct shm_tap *tap = shm_tap_create(name, &spec, rates[r]);
+		if (!tap)
+			return;
+
+		struct bench_case c = {"shm_tap", format, channels, rates[r],
+				       NULL};
+		run_case(&c, shm_tap_packet, tap);
+		shm_tap_destroy(tap);
+	}
+}
+
+static void timeline_packet(void *ctx, const uint8_t *data, uint32_t frames,
+			    uint64_t ts)
+{
+	UNUSED_PARAMETER(data);
+
+	timeline_cursor_stamp(ctx, ts, frames);
+}
+
+struct read_path {
+	struct pulse_capture *cap;
+	struct channel_remap *remap;
+	uint32_t bytes_per_frame;
+	const uint8_t *planes[MAX_AUDIO_CHANNELS];
+};
+
+/* what the source does with each packet before obs_source_output_audio() */
+static void read_path_audio(void *param,
+			    const struct pulse_capture_packet *packet)
+{
+	struct read_path *rp = param;
+
+	if (rp->remap)
+		channel_remap_process(rp->remap, packet->data, packet->frames,
+				      rp->planes);
+	else
+		rp->planes[0] = packet->data;
+}
+
+static void read_path_packet(void *ctx, const uint8_t *data, uint32_t frames,
+			     uint64_t ts)
+{
+	struct read_path *rp = ctx;
+	const struct capture_trace_record rec = {
+		.type = CAPTURE_TRACE_PACKET,
+		.bytes = frames * rp->bytes_per_frame,
+		.time = ts,
+		.latency = 0,
+	};
+
+	pulse_capture_replay(rp->cap, &rec, data);
+}
+
+/**
+ * Packets read from the stream through the timestamps, the dispatch to the
+ * callbacks and the conversion done by the source
+ */
+static void bench_read_path(pa_sample_format_t format, uint32_t channels)
+{
+	for (size_t r = 0; r < sizeof(rates) / sizeof(*rates); r++) {
+		const pa_sample_spec spec = {format, rates[r],
+					     (uint8_t)channels};
+		const struct capture_trace_header hdr = {
+			.magic = CAPTURE_TRACE_MAGIC,
+			.version = CAPTURE_TRACE_VERSION,
+			.format = format,
+			.samples_per_sec = rates[r],
+			.channels = channels,
+			.bytes_per_frame = (uint32_t)pa_frame_size(&spec),
+		};
+
+		struct read_path rp = {0};
+		rp.bytes_per_frame = hdr.bytes_per_frame;
+		rp.remap = channel_remap_create(format, channels,
+						CHANNEL_REMAP_FOLD, 0.7f);
+		rp.cap = pulse_capture_open_replay("bench", &hdr);
+		pulse_capture_add_callback(rp.cap, read_path_audio, &rp);
+
+		/* the read path runs with the mainloop locked */
+		struct bench_case c = {"read_path", format, channels, rates[r],
+				       NULL};
+		pulse_lock();
+		run_case(&c, read_path_packet, &rp);
+		pulse_unlock();
+
+		pulse_capture_remove_callback(rp.cap, read_path_audio, &rp);
+		pulse_capture_release(rp.cap);
+		channel_remap_destroy(rp.remap);
+	}
+}
+
+/**
+ * Build the properties and apply the settings as the dialog does
+ */
+static void bench_properties(const struct obs_source_info *info,
+			     const char *variant)
+{
+	obs_data_t *settings = obs_data_create();
+	info->get_defaults(settings);
+
+	/* warm up, the first build lists the devices of the server */
+	obs_properties_destroy(info->get_properties(NULL));
+
+	uint64_t builds = 0, ns;
+	const uint64_t start = os_gettime_ns();
+	do {
+		obs_properties_t *props = info->get_properties(NULL);
+		obs_properties_apply_settings(props, settings);
+		obs_properties_destroy(props);
+		builds++;
+		ns = os_gettime_ns() - start;
+	} while (ns < min_ns);
+
+	obs_data_release(settings);
+
+	printf("%s\n  {\"bench\": \"properties\", \"variant\": \"%s\", "
+	       "\"builds\": %" PRIu64 ", \"ms_per_build\": %.4f}",
+	       first_result ? "" : ",", variant, builds,
+	       (double)ns / 1e6 / (double)builds);
+	fflush(stdout);
+	first_result = false;
+}
+
+static void bench_timeline(void)
+{
+	for (size_t r = 0; r < sizeof(rates) / sizeof(*rates); r++) {
+		struct device_timeline *tl =
+			device_timeline_get("bench", rates[r]);
+		struct timeline_cursor cur;
+		timeline_cursor_init(&cur, tl);
+
+		struct bench_case c = {"timeline", PA_SAMPLE_FLOAT32LE, 1,
+				       rates[r], NULL};
+		run_case(&c, timeline_packet, &cur);
+
+		device_timeline_release(tl);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		min_ns = strtoull(argv[1], NULL, 10) * 1000000;
+
+	base_set_log_handler(log_to_stderr, NULL);
+	pulse_init();
+	event_log_start();
+
+	printf("[");
+	for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); f++) {
+		for (uint32_t ch = 1; ch <= PA_CHANNELS_MAX; ch++) {
+			bench_layout_adapter(formats[f], ch, CHANNEL_REMAP_PAD);
+			bench_layout_adapter(formats[f], ch,
+					     CHANNEL_REMAP_FOLD);
+			bench_shm_tap(formats[f], ch);
+			bench_read_path(formats[f], ch);
+		}
+	}
+	bench_timeline();
+	bench_properties(&pulse_input_capture, "input");
+	bench_properties(&pulse_output_capture, "output");
+	printf("\n]\n");
+
+	event_log_stop();
+	pulse_unref();
+
+	return 0;
+}
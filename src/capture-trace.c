@@ -0,0 +1,262 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "capture-trace.h"
+
+#define WRITE_INTERVAL_MS 100
+
+/* records beyond this are dropped until the thread caught up with the disk,
+ * allocated once so that the mainloop never reallocates */
+#define RING_SIZE (64 * 1024 * 1024)
+
+struct capture_trace {
+	FILE *file;
+	bool payload;
+
+	/* reading */
+	uint8_t *buffer;
+	size_t buffer_size;
+
+	/* writing, the records are appended to the ring from the mainloop and
+	 * written to the file by the thread so that the mainloop never waits
+	 * for the disk. The mutex only guards the positions, which count the
+	 * bytes since the start; the thread writes [tail, head) without it. */
+	pthread_mutex_t mutex;
+	uint8_t *ring;
+	uint64_t head;
+	uint64_t tail;
+
+	/* records dropped on a full ring, and their frames, which are written
+	 * as a hole before the next record that fits */
+	uint32_t dropped;
+	uint32_t dropped_bytes;
+	uint32_t holes;
+
+	bool writing;
+	pthread_t thread;
+	os_event_t *stop_event;
+};
+
+/* called with the mutex held, the space was checked by the caller */
+static void ring_append(struct capture_trace *trace, const void *data,
+			size_t size)
+{
+	const size_t offset = trace->head % RING_SIZE;
+	const size_t first = size < RING_SIZE - offset ? size
+						       : RING_SIZE - offset;
+
+	memcpy(trace->ring + offset, data, first);
+	memcpy(trace->ring, (const uint8_t *)data + first, size - first);
+	trace->head += size;
+}
+
+static void *trace_writer_thread(void *data)
+{
+	struct capture_trace *trace = data;
+	bool stop;
+
+	os_set_thread_name("pulse-mc-trace");
+
+	do {
+		stop = os_event_timedwait(trace->stop_event,
+					  WRITE_INTERVAL_MS) != ETIMEDOUT;
+
+		/* the records appended since the last write, the mainloop
+		 * does not touch them until the tail moves */
+		pthread_mutex_lock(&trace->mutex);
+		const uint64_t head = trace->head;
+		const uint64_t tail = trace->tail;
+		pthread_mutex_unlock(&trace->mutex);
+
+		const size_t offset = tail % RING_SIZE;
+		const size_t size = head - tail;
+		const size_t first = size < RING_SIZE - offset
+					     ? size
+					     : RING_SIZE - offset;
+		fwrite(trace->ring + offset, 1, first, trace->file);
+		fwrite(trace->ring, 1, size - first, trace->file);
+
+		pthread_mutex_lock(&trace->mutex);
+		trace->tail = head;
+		pthread_mutex_unlock(&trace->mutex);
+	} while (!stop);
+
+	return NULL;
+}
+
+struct capture_trace *
+capture_trace_create(const char *path, const struct capture_trace_header *hdr)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		blog(LOG_ERROR, "Unable to create trace '%s'", path);
+		return NULL;
+	}
+
+	struct capture_trace *trace = bzalloc(sizeof(struct capture_trace));
+	trace->file = file;
+	trace->payload = (hdr->flags & CAPTURE_TRACE_PAYLOAD) != 0;
+
+	struct capture_trace_header h = *hdr;
+	h.magic = CAPTURE_TRACE_MAGIC;
+	h.version = CAPTURE_TRACE_VERSION;
+	fwrite(&h, sizeof(h), 1, file);
+
+	trace->ring = bmalloc(RING_SIZE);
+	pthread_mutex_init(&trace->mutex, NULL);
+	if (os_event_init(&trace->stop_event, OS_EVENT_TYPE_MANUAL) != 0 ||
+	    pthread_create(&trace->thread, NULL, trace_writer_thread, trace) !=
+		    0) {
+		blog(LOG_ERROR, "Unable to start the writer of trace '%s'",
+		     path);
+		os_event_destroy(trace->stop_event);
+		pthread_mutex_destroy(&trace->mutex);
+		fclose(file);
+		bfree(trace->ring);
+		bfree(trace);
+		return NULL;
+	}
+	trace->writing = true;
+
+	blog(LOG_INFO, "Tracing the capture to '%s'", path);
+
+	return trace;
+}
+
+struct capture_trace *capture_trace_open(const char *path,
+					 struct capture_trace_header *hdr)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		blog(LOG_ERROR, "Unable to open trace '%s'", path);
+		return NULL;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, file) != 1 ||
+	    hdr->magic != CAPTURE_TRACE_MAGIC ||
+	    hdr->version != CAPTURE_TRACE_VERSION ||
+	    !hdr->bytes_per_frame) {
+		blog(LOG_ERROR, "'%s' is not a capture trace", path);
+		fclose(file);
+		return NULL;
+	}
+
+	struct capture_trace *trace = bzalloc(sizeof(struct capture_trace));
+	trace->file = file;
+	trace->payload = (hdr->flags & CAPTURE_TRACE_PAYLOAD) != 0;
+
+	return trace;
+}
+
+void capture_trace_close(struct capture_trace *trace)
+{
+	if (!trace)
+		return;
+
+	if (trace->writing) {
+		os_event_signal(trace->stop_event);
+		pthread_join(trace->thread, NULL);
+		os_event_destroy(trace->stop_event);
+		pthread_mutex_destroy(&trace->mutex);
+		bfree(trace->ring);
+
+		if (trace->dropped)
+			blog(LOG_WARNING,
+			     "Dropped %" PRIu32 " trace records while the disk "
+			     "was busy, written as %" PRIu32 " holes",
+			     trace->dropped, trace->holes);
+	}
+
+	fclose(trace->file);
+	bfree(trace->buffer);
+	bfree(trace);
+}
+
+void capture_trace_write(struct capture_trace *trace,
+			 const struct capture_trace_record *rec,
+			 const void *payload)
+{
+	const bool frames = rec->type == CAPTURE_TRACE_PACKET ||
+			    rec->type == CAPTURE_TRACE_HOLE;
+	const bool with_payload = trace->payload &&
+				  rec->type == CAPTURE_TRACE_PACKET;
+	const size_t size = sizeof(*rec) + (with_payload ? rec->bytes : 0);
+
+	pthread_mutex_lock(&trace->mutex);
+	const size_t hole = trace->dropped_bytes ? sizeof(*rec) : 0;
+	if (trace->head - trace->tail + hole + size > RING_SIZE) {
+		trace->dropped++;
+		if (frames)
+			trace->dropped_bytes =
+				rec->bytes > UINT32_MAX - trace->dropped_bytes
+					? UINT32_MAX
+					: trace->dropped_bytes + rec->bytes;
+	} else {
+		/* so that the replay sees the gap instead of joining the
+		 * frames from either side of it */
+		if (hole) {
+			const struct capture_trace_record h = {
+				.type = CAPTURE_TRACE_HOLE,
+				.bytes = trace->dropped_bytes,
+				.time = rec->time,
+				.latency = rec->latency,
+			};
+			ring_append(trace, &h, sizeof(h));
+			trace->dropped_bytes = 0;
+			trace->holes++;
+		}
+		ring_append(trace, rec, sizeof(*rec));
+		if (with_payload)
+			ring_append(trace, payload, rec->bytes);
+	}
+	pthread_mutex_unlock(&trace->mutex);
+}
+
+bool capture_trace_read(struct capture_trace *trace,
+			struct capture_trace_record *rec, const void **payload)
+{
+	*payload = NULL;
+
+	if (fread(rec, sizeof(*rec), 1, trace->file) != 1)
+		return false;
+
+	if (!trace->payload || rec->type != CAPTURE_TRACE_PACKET)
+		return true;
+
+	if (trace->buffer_size < rec->bytes) {
+		bfree(trace->buffer);
+		trace->buffer = bmalloc(rec->bytes);
+		trace->buffer_size = rec->bytes;
+	}
+
+	if (fread(trace->buffer, 1, rec->bytes, trace->file) != rec->bytes)
+		return false;
+
+	*payload = trace->buffer;
+	return true;
+}
@@ -0,0 +1,121 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#pragma once
+
+/**
+ * Trace of the events seen by a capture stream
+ *
+ * The file starts with `struct capture_trace_header` followed by records.
+ * A packet record is followed by its payload of `bytes` bytes if the header
+ * has `CAPTURE_TRACE_PAYLOAD` and the packet is not a hole. All fields are in
+ * the byte order of the recording host.
+ *
+ * Replaying the records through the read path gives the same timestamps as
+ * the recording since the timestamps only depend on the recorded times.
+ */
+#define CAPTURE_TRACE_MAGIC 0x5443504fU /* "OPCT" */
+#define CAPTURE_TRACE_VERSION 1
+
+#define CAPTURE_TRACE_PAYLOAD 1
+
+struct capture_trace_header {
+	uint32_t magic;
+	uint32_t version;
+
+	/* pa_sample_format_t of the frames */
+	uint32_t format;
+	uint32_t samples_per_sec;
+	uint32_t channels;
+	uint32_t bytes_per_frame;
+
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+enum capture_trace_type {
+	CAPTURE_TRACE_PACKET,
+	CAPTURE_TRACE_HOLE,
+	CAPTURE_TRACE_SUSPEND,
+	CAPTURE_TRACE_RESUME,
+	CAPTURE_TRACE_CORK,
+	CAPTURE_TRACE_UNCORK,
+	CAPTURE_TRACE_FLUSHED,
+};
+
+struct capture_trace_record {
+	uint32_t type;
+
+	/* bytes of a packet or a hole */
+	uint32_t bytes;
+
+	/* arrival of the callback in os_gettime_ns() */
+	uint64_t time;
+
+	/* latency of the stream in nanoseconds, negative if not known yet */
+	int64_t latency;
+};
+
+struct capture_trace;
+
+/**
+ * Create a trace file and write the header
+ *
+ * @return NULL on error
+ */
+struct capture_trace *
+capture_trace_create(const char *path, const struct capture_trace_header *hdr);
+
+/**
+ * Open a trace file and read the header
+ *
+ * @return NULL on error or if the file is not a trace
+ */
+struct capture_trace *capture_trace_open(const char *path,
+					 struct capture_trace_header *hdr);
+
+void capture_trace_close(struct capture_trace *trace);
+
+/**
+ * Append a record
+ *
+ * The record is copied to a ring allocated with the trace and written to the
+ * file by a thread, so that the mainloop neither waits for the disk nor
+ * allocates. Records are dropped, and counted in the log when the trace is
+ * closed, if the disk falls too far behind. The frames of the dropped
+ * packets and holes are written as a hole before the next record, so that
+ * the replay sees the gap.
+ *
+ * @param payload frames of a packet, ignored unless the payload is recorded
+ */
+void capture_trace_write(struct capture_trace *trace,
+			 const struct capture_trace_record *rec,
+			 const void *payload);
+
+/**
+ * Read the next record
+ *
+ * @param payload set to the frames of a packet, valid until the next call,
+ *                or NULL if the payload was not recorded
+ *
+ * @return false at the end of the trace
+ */
+bool capture_trace_read(struct capture_trace *trace,
+			struct capture_trace_record *rec, const void **payload);
@@ -0,0 +1,223 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include <util/bmem.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "channel-remap.h"
+
+typedef void (*remap_kernel_t)(float *restrict dst, const uint8_t *src,
+			       uint32_t stride, uint32_t frames, float gain);
+
+struct remap_tap {
+	uint32_t input;
+	float gain;
+};
+
+struct channel_remap {
+	uint32_t in_channels;
+	uint32_t out_channels;
+	enum speaker_layout speakers;
+	size_t sample_size;
+
+	remap_kernel_t copy;
+	remap_kernel_t add;
+
+	uint32_t n_taps[MAX_AUDIO_CHANNELS];
+	struct remap_tap taps[MAX_AUDIO_CHANNELS][PA_CHANNELS_MAX];
+
+	float *buffer;
+	uint32_t capacity;
+};
+
+/*
+ * The kernels read one input channel with a constant stride and write one
+ * contiguous plane. The strided reads are not vectorized, the loops only
+ * avoid a branch per sample.
+ */
+#define DEFINE_KERNELS(name, type, scale, bias)                               \
+	static void name##_copy(float *restrict dst, const uint8_t *src_,     \
+				uint32_t stride, uint32_t frames, float gain) \
+	{                                                                     \
+		const type *src = (const type *)src_;                         \
+		gain *= (scale);                                              \
+		for (uint32_t i = 0; i < frames; i++)                         \
+			dst[i] = ((float)src[i * stride] + (bias)) * gain;    \
+	}                                                                     \
+	static void name##_add(float *restrict dst, const uint8_t *src_,      \
+			       uint32_t stride, uint32_t frames, float gain)  \
+	{                                                                     \
+		const type *src = (const type *)src_;                         \
+		gain *= (scale);                                              \
+		for (uint32_t i = 0; i < frames; i++)                         \
+			dst[i] += ((float)src[i * stride] + (bias)) * gain;   \
+	}
+
+DEFINE_KERNELS(u8, uint8_t, 1.0f / 128.0f, -128.0f)
+DEFINE_KERNELS(s16, int16_t, 1.0f / 32768.0f, 0.0f)
+DEFINE_KERNELS(s32, int32_t, 1.0f / 2147483648.0f, 0.0f)
+DEFINE_KERNELS(f32, float, 1.0f, 0.0f)
+
+#define MAX_LAYOUT_CHANNELS 8
+
+static uint32_t adapted_channels(uint32_t channels,
+				 enum channel_remap_mode mode)
+{
+	if (mode == CHANNEL_REMAP_PAD) {
+		for (uint32_t n = channels; n <= MAX_LAYOUT_CHANNELS; n++) {
+			if (pulse_channels_to_obs_speakers(n) !=
+			    SPEAKERS_UNKNOWN)
+				return n;
+		}
+		blog(LOG_WARNING,
+		     "Unable to pad %" PRIu32 " channels, folding them instead",
+		     channels);
+	}
+
+	uint32_t n = channels < MAX_LAYOUT_CHANNELS ? channels
+						    : MAX_LAYOUT_CHANNELS;
+	while (n > 0 && pulse_channels_to_obs_speakers(n) == SPEAKERS_UNKNOWN)
+		n--;
+	return n;
+}
+
+/* index of the LFE channel in the OBS layout, UINT32_MAX without one */
+static uint32_t lfe_channel(enum speaker_layout speakers)
+{
+	switch (speakers) {
+	case SPEAKERS_2POINT1:
+		return 2;
+	case SPEAKERS_4POINT1:
+	case SPEAKERS_5POINT1:
+	case SPEAKERS_7POINT1:
+		return 3;
+	default:
+		return UINT32_MAX;
+	}
+}
+
+struct channel_remap *channel_remap_create(pa_sample_format_t format,
+					   uint32_t channels,
+					   enum channel_remap_mode mode,
+					   float fold_gain)
+{
+	if (!channels || channels > PA_CHANNELS_MAX)
+		return NULL;
+	if (pulse_channels_to_obs_speakers(channels) != SPEAKERS_UNKNOWN)
+		return NULL;
+
+	struct channel_remap *remap = bzalloc(sizeof(struct channel_remap));
+
+	switch (format) {
+	case PA_SAMPLE_U8:
+		remap->copy = u8_copy;
+		remap->add = u8_add;
+		break;
+	case PA_SAMPLE_S16LE:
+		remap->copy = s16_copy;
+		remap->add = s16_add;
+		break;
+	case PA_SAMPLE_S32LE:
+		remap->copy = s32_copy;
+		remap->add = s32_add;
+		break;
+	case PA_SAMPLE_FLOAT32LE:
+		remap->copy = f32_copy;
+		remap->add = f32_add;
+		break;
+	default:
+		bfree(remap);
+		return NULL;
+	}
+
+	pa_sample_spec spec = {.format = format, .rate = 1, .channels = 1};
+	remap->sample_size = pa_sample_size(&spec);
+	remap->in_channels = channels;
+	remap->out_channels = adapted_channels(channels, mode);
+	remap->speakers = pulse_channels_to_obs_speakers(remap->out_channels);
+
+	/* Channels that fit are passed through, the rest are folded in turn
+	 * into the output channels but the LFE, which OBS low-passes or drops
+	 * in a downmix. */
+	const uint32_t lfe = lfe_channel(remap->speakers);
+	const uint32_t targets = remap->out_channels -
+				 (lfe < remap->out_channels ? 1 : 0);
+	for (uint32_t i = 0; i < channels; i++) {
+		uint32_t o = i;
+		if (i >= remap->out_channels) {
+			o = (i - remap->out_channels) % targets;
+			if (o >= lfe)
+				o++;
+		}
+		struct remap_tap *tap = &remap->taps[o][remap->n_taps[o]++];
+		tap->input = i;
+		tap->gain = i < remap->out_channels ? 1.0f : fold_gain;
+	}
+
+	blog(LOG_INFO, "Adapting %" PRIu32 " channels to %" PRIu32 " channels",
+	     remap->in_channels, remap->out_channels);
+
+	return remap;
+}
+
+void channel_remap_destroy(struct channel_remap *remap)
+{
+	if (!remap)
+		return;
+
+	bfree(remap->buffer);
+	bfree(remap);
+}
+
+enum speaker_layout channel_remap_get_speakers(const struct channel_remap *remap)
+{
+	return remap->speakers;
+}
+
+uint32_t channel_remap_process(struct channel_remap *remap, const uint8_t *data,
+			       uint32_t frames, const uint8_t **planes)
+{
+	if (remap->capacity < frames) {
+		bfree(remap->buffer);
+		remap->buffer = bmalloc(sizeof(float) * frames *
+					remap->out_channels);
+		remap->capacity = frames;
+	}
+
+	for (uint32_t o = 0; o < remap->out_channels; o++) {
+		float *dst = remap->buffer + (size_t)o * remap->capacity;
+		planes[o] = (const uint8_t *)dst;
+
+		if (!remap->n_taps[o]) {
+			memset(dst, 0, sizeof(float) * frames);
+			continue;
+		}
+
+		for (uint32_t t = 0; t < remap->n_taps[o]; t++) {
+			const struct remap_tap *tap = &remap->taps[o][t];
+			const uint8_t *src =
+				data + tap->input * remap->sample_size;
+			remap_kernel_t kernel = t ? remap->add : remap->copy;
+			kernel(dst, src, remap->in_channels, frames, tap->gain);
+		}
+	}
+
+	return remap->out_channels;
+}
@@ -0,0 +1,105 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <pulse/sample.h>
+#include <media-io/audio-io.h>
+
+#pragma once
+
+/**
+ * Get obs speaker layout from number of channels
+ *
+ * @param channels number of channels reported by pulseaudio
+ *
+ * @return obs speaker_layout id
+ *
+ * @note This *might* not work for some rather unusual setups, but should work
+ *       fine for the majority of cases.
+ */
+static inline enum speaker_layout
+pulse_channels_to_obs_speakers(uint_fast32_t channels)
+{
+	switch (channels) {
+	case 1:
+		return SPEAKERS_MONO;
+	case 2:
+		return SPEAKERS_STEREO;
+	case 3:
+		return SPEAKERS_2POINT1;
+	case 4:
+		return SPEAKERS_4POINT0;
+	case 5:
+		return SPEAKERS_4POINT1;
+	case 6:
+		return SPEAKERS_5POINT1;
+	case 8:
+		return SPEAKERS_7POINT1;
+	}
+
+	return SPEAKERS_UNKNOWN;
+}
+
+/**
+ * Remap interleaved frames to float planes
+ *
+ * Each output channel is the weighted sum of a few input channels. The sums
+ * are resolved into a table when the remap is created so that the per-packet
+ * work is a branch-free loop over each plane.
+ */
+struct channel_remap;
+
+enum channel_remap_mode {
+	/* pad to the next layout with silent channels */
+	CHANNEL_REMAP_PAD = 0,
+	/* fold the extra channels into the previous layout but its LFE */
+	CHANNEL_REMAP_FOLD = 1,
+};
+
+/**
+ * Create a remap adapting the channel count to a layout OBS can represent
+ *
+ * @param format sample format of the input frames
+ * @param channels number of input channels
+ * @param mode how to adapt the channel count. Padding cannot go beyond 8
+ *             channels, so with more channels the extra ones are folded as in
+ *             CHANNEL_REMAP_FOLD and a warning is logged.
+ * @param fold_gain gain applied to the channels folded into another channel
+ *
+ * @return NULL if the channel count needs no adapter
+ */
+struct channel_remap *channel_remap_create(pa_sample_format_t format,
+					   uint32_t channels,
+					   enum channel_remap_mode mode,
+					   float fold_gain);
+
+void channel_remap_destroy(struct channel_remap *remap);
+
+/**
+ * Speaker layout of the output
+ */
+enum speaker_layout channel_remap_get_speakers(const struct channel_remap *remap);
+
+/**
+ * Remap the frames
+ *
+ * @param planes receives the output planes, valid until the next call
+ *
+ * @return number of output planes
+ */
+uint32_t channel_remap_process(struct channel_remap *remap, const uint8_t *data,
+			       uint32_t frames, const uint8_t **planes);
@@ -0,0 +1,247 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "device-timeline.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+/* interval to follow the drift of the device clock */
+#define WINDOW_NS (1000 * NSEC_PER_MSEC)
+
+/* period to refine the offset of a new stream */
+#define SETTLE_NS (2000 * NSEC_PER_MSEC)
+
+/* error considered as a discontinuity of the stream */
+#define DISCONTINUITY_NS (100 * NSEC_PER_MSEC)
+
+struct timeline_anchor {
+	int64_t index;
+	int64_t ts;
+};
+
+struct device_timeline {
+	char *device;
+	uint32_t rate;
+	long refs;
+
+	bool anchored;
+
+	/* `prev` applies to the indices before `cur.index` */
+	struct timeline_anchor cur;
+	struct timeline_anchor prev;
+
+	/* end of the latest frames stamped by any stream */
+	int64_t end_index;
+
+	/* least error seen in the current window */
+	int64_t window_end;
+	int64_t window_err;
+	bool window_valid;
+};
+
+static pthread_mutex_t timelines_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DARRAY(struct device_timeline *) timelines;
+
+struct device_timeline *device_timeline_get(const char *device, uint32_t rate)
+{
+	struct device_timeline *tl = NULL;
+
+	pthread_mutex_lock(&timelines_mutex);
+
+	for (size_t i = 0; i < timelines.num; i++) {
+		struct device_timeline *t = timelines.array[i];
+		if (t->rate == rate && strcmp(t->device, device) == 0) {
+			tl = t;
+			tl->refs++;
+			goto unlock;
+		}
+	}
+
+	tl = bzalloc(sizeof(struct device_timeline));
+	tl->device = bstrdup(device);
+	tl->rate = rate;
+	tl->refs = 1;
+	da_push_back(timelines, &tl);
+
+unlock:
+	pthread_mutex_unlock(&timelines_mutex);
+	return tl;
+}
+
+void device_timeline_release(struct device_timeline *tl)
+{
+	if (!tl)
+		return;
+
+	pthread_mutex_lock(&timelines_mutex);
+	bool destroy = --tl->refs == 0;
+	if (destroy) {
+		da_erase_item(timelines, &tl);
+		if (!timelines.num)
+			da_free(timelines);
+	}
+	pthread_mutex_unlock(&timelines_mutex);
+
+	if (destroy) {
+		bfree(tl->device);
+		bfree(tl);
+	}
+}
+
+static inline int64_t frames_to_ns(int64_t frames, uint32_t rate)
+{
+	/* split to avoid overflow of frames * NSEC_PER_SEC */
+	return frames / rate * NSEC_PER_SEC +
+	       frames % rate * NSEC_PER_SEC / rate;
+}
+
+static inline int64_t ns_to_frames(int64_t ns, uint32_t rate)
+{
+	if (ns < 0)
+		return -ns_to_frames(-ns, rate);
+
+	return ns / NSEC_PER_SEC * rate +
+	       (ns % NSEC_PER_SEC * rate + NSEC_PER_SEC / 2) / NSEC_PER_SEC;
+}
+
+static int64_t timeline_predict(const struct device_timeline *tl,
+				int64_t index)
+{
+	const struct timeline_anchor *a = index >= tl->cur.index ? &tl->cur
+								 : &tl->prev;
+	return a->ts + frames_to_ns(index - a->index, tl->rate);
+}
+
+static int64_t timeline_estimate_index(const struct device_timeline *tl,
+				       int64_t ts)
+{
+	return tl->cur.index + ns_to_frames(ts - tl->cur.ts, tl->rate);
+}
+
+/**
+ * Move the anchor by the error of the least delayed packet in the window
+ *
+ * The new anchor applies to the frames that no stream has stamped yet so
+ * that the frames already stamped keep their timestamps.
+ */
+static void timeline_follow(struct device_timeline *tl, int64_t ts)
+{
+	if (ts < tl->window_end)
+		return;
+
+	if (tl->window_valid && tl->end_index >= tl->cur.index) {
+		struct timeline_anchor next;
+		next.index = tl->end_index;
+		next.ts = timeline_predict(tl, next.index) + tl->window_err / 2;
+		tl->prev = tl->cur;
+		tl->cur = next;
+	}
+
+	tl->window_end = ts + WINDOW_NS;
+	tl->window_valid = false;
+}
+
+void timeline_cursor_init(struct timeline_cursor *cur,
+			  struct device_timeline *tl)
+{
+	cur->timeline = tl;
+	timeline_cursor_reset(cur);
+}
+
+void timeline_cursor_reset(struct timeline_cursor *cur)
+{
+	cur->started = false;
+	cur->position = 0;
+	cur->offset = 0;
+	cur->settle_until = 0;
+}
+
+static void cursor_start(struct timeline_cursor *cur, int64_t ts)
+{
+	struct device_timeline *tl = cur->timeline;
+
+	cur->offset = timeline_estimate_index(tl, ts) - (int64_t)cur->position;
+	cur->settle_until = ts + SETTLE_NS;
+	cur->started = true;
+}
+
+uint64_t timeline_cursor_stamp(struct timeline_cursor *cur, uint64_t ts_u,
+			       uint32_t frames)
+{
+	struct device_timeline *tl = cur->timeline;
+	const int64_t ts = (int64_t)ts_u;
+
+	if (!tl)
+		return ts_u;
+
+	if (!tl->anchored) {
+		tl->cur.index = 0;
+		tl->cur.ts = ts;
+		tl->prev = tl->cur;
+		tl->window_end = ts + WINDOW_NS;
+		tl->anchored = true;
+	}
+
+	if (!cur->started)
+		cursor_start(cur, ts);
+
+	int64_t index = cur->offset + (int64_t)cur->position;
+	int64_t err = ts - timeline_predict(tl, index);
+
+	if (err > DISCONTINUITY_NS || err < -DISCONTINUITY_NS) {
+		event_log_post(EVENT_TIMELINE_JUMP, tl->device, err);
+		cursor_start(cur, ts);
+		index = cur->offset + (int64_t)cur->position;
+		err = 0;
+	} else if (err < 0 && ts < (int64_t)cur->settle_until) {
+		/* This packet was less delayed than the ones seen so far. */
+		cur->offset += ns_to_frames(err, tl->rate);
+		index = cur->offset + (int64_t)cur->position;
+		err = 0;
+	}
+
+	if (ts >= (int64_t)cur->settle_until &&
+	    (!tl->window_valid || err < tl->window_err)) {
+		tl->window_err = err;
+		tl->window_valid = true;
+	}
+
+	const uint64_t stamp = (uint64_t)timeline_predict(tl, index);
+
+	cur->position += frames;
+	if (index + frames > tl->end_index)
+		tl->end_index = index + frames;
+
+	timeline_follow(tl, ts);
+
+	return stamp;
+}
+
+void timeline_cursor_skip(struct timeline_cursor *cur, uint32_t frames)
+{
+	cur->position += frames;
+}
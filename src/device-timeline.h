@@ -0,0 +1,93 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#pragma once
+
+/**
+ * Timeline shared by all streams recording the same device
+ *
+ * The timeline maps a device sample index to a timestamp. Each stream keeps a
+ * cursor that knows the device index of its own frames, so that frames
+ * captured at the same device sample index get identical timestamps whichever
+ * stream they were read from.
+ *
+ * The callback time is only used to estimate the device index of a stream's
+ * first frame and to follow the drift between the device and the system
+ * clock. Since the callbacks are delayed by a varying amount, the estimate
+ * converges to the least delayed callbacks.
+ *
+ * @note Timelines and cursors are accessed from the mainloop thread only.
+ */
+struct device_timeline;
+
+struct timeline_cursor {
+	struct device_timeline *timeline;
+	bool started;
+
+	/* frames read by the stream */
+	uint64_t position;
+
+	/* device index of the stream's first frame */
+	int64_t offset;
+
+	/* the offset is still refined until then */
+	uint64_t settle_until;
+};
+
+/**
+ * Get the timeline of the device, creating it if needed
+ *
+ * @warning call without active locks
+ */
+struct device_timeline *device_timeline_get(const char *device, uint32_t rate);
+
+/**
+ * Release the timeline
+ *
+ * @warning call without active locks
+ */
+void device_timeline_release(struct device_timeline *tl);
+
+/**
+ * Attach a cursor to the timeline and reset it
+ */
+void timeline_cursor_init(struct timeline_cursor *cur,
+			  struct device_timeline *tl);
+
+/**
+ * Forget the position so that the next packet estimates the offset again
+ */
+void timeline_cursor_reset(struct timeline_cursor *cur);
+
+/**
+ * Get the timestamp of the next frames and advance the cursor
+ *
+ * @param ts timestamp of the first frame estimated from the callback time
+ * @param frames number of frames in the packet
+ *
+ * @return timestamp of the first frame on the device's timeline
+ */
+uint64_t timeline_cursor_stamp(struct timeline_cursor *cur, uint64_t ts,
+			       uint32_t frames);
+
+/**
+ * Advance the cursor over frames that are lost
+ */
+void timeline_cursor_skip(struct timeline_cursor *cur, uint32_t frames);
@@ -0,0 +1,278 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <util/platform.h>
+#include <util/darray.h>
+#include <util/threading.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+/* number of slots, has to be a power of 2 */
+#define QUEUE_SIZE 256
+#define QUEUE_MASK (QUEUE_SIZE - 1)
+
+#define DEVICE_LENGTH 128
+#define DRAIN_INTERVAL_MS 100
+#define REPORT_INTERVAL_SEC 10
+
+struct event {
+	enum event_log_type type;
+	int64_t value;
+	char device[DEVICE_LENGTH];
+};
+
+/* bounded multi-producer queue, the sequence tells whether the slot is
+ * written or read */
+struct event_slot {
+	uint32_t sequence;
+	struct event event;
+};
+
+struct event_stats {
+	enum event_log_type type;
+	char device[DEVICE_LENGTH];
+
+	/* events before then are counted instead of logged */
+	uint64_t next_report;
+	uint32_t count;
+	int64_t sum;
+};
+
+static struct event_slot queue[QUEUE_SIZE];
+static uint32_t queue_head;
+static uint32_t queue_tail;
+static uint32_t dropped;
+
+static bool running;
+static pthread_t thread;
+static os_event_t *stop_event;
+
+/* accessed from the thread only */
+static DARRAY(struct event_stats) stats;
+
+static void log_event(const struct event *ev)
+{
+	switch (ev->type) {
+	case EVENT_AUDIO_HOLE:
+		blog(LOG_ERROR, "Got audio hole of %" PRId64 " bytes from '%s'",
+		     ev->value, ev->device);
+		break;
+	case EVENT_TIMELINE_JUMP:
+		blog(LOG_INFO,
+		     "Timeline of '%s' jumped by %" PRId64 " ms, re-anchoring",
+		     ev->device, ev->value / NSEC_PER_MSEC);
+		break;
+	case EVENT_LOG_TYPE_COUNT:
+		break;
+	}
+}
+
+static void log_summary(const struct event_stats *st)
+{
+	switch (st->type) {
+	case EVENT_AUDIO_HOLE:
+		blog(LOG_ERROR,
+		     "Got %" PRIu32 " more audio holes of %" PRId64
+		     " bytes in total from '%s' in the last %d s",
+		     st->count, st->sum, st->device, REPORT_INTERVAL_SEC);
+		break;
+	case EVENT_TIMELINE_JUMP:
+		blog(LOG_INFO,
+		     "Timeline of '%s' jumped %" PRIu32
+		     " more times in the last %d s",
+		     st->device, st->count, REPORT_INTERVAL_SEC);
+		break;
+	case EVENT_LOG_TYPE_COUNT:
+		break;
+	}
+}
+
+static bool queue_pop(struct event *ev)
+{
+	struct event_slot *slot = &queue[queue_tail & QUEUE_MASK];
+	uint32_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if ((int32_t)(seq - (queue_tail + 1)) < 0)
+		return false;
+
+	*ev = slot->event;
+	__atomic_store_n(&slot->sequence, queue_tail + QUEUE_SIZE,
+			 __ATOMIC_RELEASE);
+	queue_tail++;
+	return true;
+}
+
+static struct event_stats *find_stats(const struct event *ev)
+{
+	for (size_t i = 0; i < stats.num; i++) {
+		struct event_stats *st = &stats.array[i];
+		if (st->type == ev->type && strcmp(st->device, ev->device) == 0)
+			return st;
+	}
+
+	struct event_stats *st = da_push_back_new(stats);
+	st->type = ev->type;
+	strcpy(st->device, ev->device);
+	return st;
+}
+
+static void drain(uint64_t now)
+{
+	struct event ev;
+
+	while (queue_pop(&ev)) {
+		struct event_stats *st = find_stats(&ev);
+		if (now >= st->next_report) {
+			log_event(&ev);
+			st->next_report =
+				now + REPORT_INTERVAL_SEC * NSEC_PER_SEC;
+		} else {
+			st->count++;
+			st->sum += ev.value;
+		}
+	}
+}
+
+static void report(uint64_t now, bool final)
+{
+	for (size_t i = stats.num; i > 0; i--) {
+		struct event_stats *st = &stats.array[i - 1];
+		if (now < st->next_report && !final)
+			continue;
+
+		if (!st->count) {
+			da_erase(stats, i - 1);
+			continue;
+		}
+
+		log_summary(st);
+		st->count = 0;
+		st->sum = 0;
+		st->next_report = now + REPORT_INTERVAL_SEC * NSEC_PER_SEC;
+	}
+
+	uint32_t n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if (n)
+		blog(LOG_WARNING, "Dropped %" PRIu32 " diagnostic events", n);
+}
+
+static void *event_log_thread(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+
+	os_set_thread_name("pulse-mc-event-log");
+
+#ifdef SCHED_IDLE
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+	do {
+		uint64_t now = os_gettime_ns();
+		drain(now);
+		report(now, false);
+	} while (os_event_timedwait(stop_event, DRAIN_INTERVAL_MS) ==
+		 ETIMEDOUT);
+
+	drain(os_gettime_ns());
+	report(os_gettime_ns(), true);
+	da_free(stats);
+
+	return NULL;
+}
+
+void event_log_start(void)
+{
+	if (running)
+		return;
+
+	for (uint32_t i = 0; i < QUEUE_SIZE; i++)
+		queue[i].sequence = i;
+	queue_head = 0;
+	queue_tail = 0;
+
+	if (os_event_init(&stop_event, OS_EVENT_TYPE_MANUAL) != 0)
+		return;
+
+	if (pthread_create(&thread, NULL, event_log_thread, NULL) != 0) {
+		blog(LOG_ERROR, "Unable to start the event log thread");
+		os_event_destroy(stop_event);
+		stop_event = NULL;
+		return;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+}
+
+void event_log_stop(void)
+{
+	if (!running)
+		return;
+
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	os_event_signal(stop_event);
+	pthread_join(thread, NULL);
+	os_event_destroy(stop_event);
+	stop_event = NULL;
+}
+
+void event_log_post(enum event_log_type type, const char *device,
+		    int64_t value)
+{
+	struct event_slot *slot;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	uint32_t pos = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue[pos & QUEUE_MASK];
+		uint32_t seq =
+			__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue_head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->event.type = type;
+	slot->event.value = value;
+	snprintf(slot->event.device, sizeof(slot->event.device), "%s", device);
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
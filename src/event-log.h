@@ -0,0 +1,57 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+
+#pragma once
+
+/**
+ * Diagnostics posted from the audio callbacks
+ *
+ * Posting only copies the event into a lock-free queue. A low priority thread
+ * writes the events to the log. The first event of each type and device is
+ * logged immediately, the following ones are counted and summarized once per
+ * interval.
+ */
+enum event_log_type {
+	/** value: lost bytes */
+	EVENT_AUDIO_HOLE,
+	/** value: error in nanoseconds */
+	EVENT_TIMELINE_JUMP,
+
+	EVENT_LOG_TYPE_COUNT,
+};
+
+/**
+ * Start the thread writing the events
+ */
+void event_log_start(void);
+
+/**
+ * Write the pending events and stop the thread
+ */
+void event_log_stop(void);
+
+/**
+ * Queue an event without blocking
+ *
+ * The event is dropped and counted if the queue is full or the thread is not
+ * running. The count is logged by the thread. Nothing is logged from the
+ * caller, so this is safe to call from the mainloop.
+ */
+void event_log_post(enum event_log_type type, const char *device,
+		    int64_t value);
@@ -0,0 +1,371 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "flight-recorder.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+#define DUMP_INTERVAL_NS (10 * NSEC_PER_SEC)
+#define DUMP_SUFFIX ".flight.csv"
+
+struct flight_dump {
+	char *dir;
+	char *path;
+	char *device;
+	char *reason;
+	uint32_t skipped;
+
+	struct flight_event *events;
+	size_t num;
+
+	/* order of the dump in the queue of the writer */
+	uint64_t seq;
+};
+
+struct flight_recorder {
+	char *device;
+	char *dir;
+
+	struct flight_event events[FLIGHT_RECORDER_EVENTS];
+	uint64_t head;
+
+	uint64_t last_dump;
+	uint32_t skipped;
+
+	/* seq of the latest dump, written once written_seq reaches it */
+	uint64_t dump_seq;
+};
+
+/* The dumps of every recorder are written by one thread in their order. The
+ * thread is started with the first recorder and joined with the last one,
+ * both under writer_life_mutex, which the mainloop never takes. The queue has
+ * its own mutex, held only to push or pop a dump; the mainloop only tries it
+ * and drops the dump if the writer holds it. */
+static pthread_mutex_t writer_life_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long recorders;
+static bool writer_running;
+static pthread_t writer;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DARRAY(struct flight_dump *) queue;
+static os_event_t *queue_event;
+static bool writer_stop;
+static uint64_t next_seq;
+
+static uint64_t written_seq;
+
+static void *writer_thread(void *data);
+
+struct flight_recorder *flight_recorder_create(const char *device)
+{
+	const char *dir = getenv("OBS_PULSE_MC_FLIGHT_DIR");
+	if (!dir || !*dir)
+		return NULL;
+
+	pthread_mutex_lock(&writer_life_mutex);
+	if (!writer_running) {
+		os_event_init(&queue_event, OS_EVENT_TYPE_AUTO);
+		writer_running =
+			pthread_create(&writer, NULL, writer_thread, NULL) == 0;
+		if (!writer_running) {
+			os_event_destroy(queue_event);
+			queue_event = NULL;
+		}
+	}
+	const bool running = writer_running;
+	if (running)
+		recorders++;
+	pthread_mutex_unlock(&writer_life_mutex);
+
+	if (!running) {
+		blog(LOG_ERROR, "Unable to start the flight recorder of '%s'",
+		     device);
+		return NULL;
+	}
+
+	struct flight_recorder *fr = bzalloc(sizeof(struct flight_recorder));
+	fr->device = bstrdup(device);
+	fr->dir = bstrdup(dir);
+
+	return fr;
+}
+
+static void stop_writer(void)
+{
+	pthread_mutex_lock(&queue_mutex);
+	writer_stop = true;
+	pthread_mutex_unlock(&queue_mutex);
+	os_event_signal(queue_event);
+
+	pthread_join(writer, NULL);
+
+	da_free(queue);
+	os_event_destroy(queue_event);
+	queue_event = NULL;
+	writer_stop = false;
+	writer_running = false;
+}
+
+void flight_recorder_destroy(struct flight_recorder *fr)
+{
+	if (!fr)
+		return;
+
+	/* the last one waits for the queued dumps, a recorder created
+	 * meanwhile starts a new writer once this one is joined */
+	pthread_mutex_lock(&writer_life_mutex);
+	if (--recorders == 0)
+		stop_writer();
+	pthread_mutex_unlock(&writer_life_mutex);
+
+	bfree(fr->dir);
+	bfree(fr->device);
+	bfree(fr);
+}
+
+void flight_recorder_record(struct flight_recorder *fr,
+			    const struct flight_event *ev)
+{
+	if (!fr)
+		return;
+
+	fr->events[fr->head % FLIGHT_RECORDER_EVENTS] = *ev;
+	fr->head++;
+}
+
+static void write_flags(FILE *file, uint32_t flags)
+{
+	if (!flags)
+		fputc('-', file);
+	if (flags & FLIGHT_EVENT_HOLE)
+		fputc('H', file);
+	if (flags & FLIGHT_EVENT_OVERFLOW)
+		fputc('O', file);
+	if (flags & FLIGHT_EVENT_SUSPEND)
+		fputc('S', file);
+	if (flags & FLIGHT_EVENT_JUMP)
+		fputc('J', file);
+}
+
+static void write_dump(const struct flight_dump *dump)
+{
+	os_mkdirs(dump->dir);
+
+	FILE *file = fopen(dump->path, "w");
+	if (!file) {
+		blog(LOG_ERROR, "Unable to create '%s'", dump->path);
+		return;
+	}
+
+	fprintf(file, "# device: %s\n", dump->device);
+	fprintf(file, "# reason: %s\n", dump->reason);
+	fprintf(file, "# skipped dumps: %" PRIu32 "\n", dump->skipped);
+	fprintf(file, "time_ns,bytes,latency_ns,timestamp_ns,flags\n");
+	for (size_t i = 0; i < dump->num; i++) {
+		const struct flight_event *ev = &dump->events[i];
+		fprintf(file, "%" PRIu64 ",%" PRIu32 ",%" PRId64 ",%" PRIu64 ",",
+			ev->time, ev->bytes, ev->latency, ev->timestamp);
+		write_flags(file, ev->flags);
+		fputc('\n', file);
+	}
+	fclose(file);
+
+	blog(LOG_WARNING, "Wrote the last %zu callbacks of '%s' to '%s' (%s)",
+	     dump->num, dump->device, dump->path, dump->reason);
+}
+
+struct dump_file {
+	char *path;
+	struct timespec mtime;
+};
+
+static int compare_dump_files(const void *a, const void *b)
+{
+	const struct dump_file *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return strcmp(fa->path, fb->path);
+}
+
+/**
+ * Delete the oldest dumps of the directory beyond the latest
+ * FLIGHT_RECORDER_KEEP, whichever device they are of
+ */
+static void prune_dumps(const char *dir)
+{
+	os_dir_t *d = os_opendir(dir);
+	if (!d)
+		return;
+
+	DARRAY(struct dump_file) files = {0};
+	const size_t suffix_len = strlen(DUMP_SUFFIX);
+	struct os_dirent *ent;
+	while ((ent = os_readdir(d)) != NULL) {
+		const size_t len = strlen(ent->d_name);
+		if (ent->directory || len <= suffix_len ||
+		    strcmp(ent->d_name + len - suffix_len, DUMP_SUFFIX) != 0)
+			continue;
+
+		struct dstr path = {0};
+		struct stat st;
+		dstr_printf(&path, "%s/%s", dir, ent->d_name);
+		if (stat(path.array, &st) != 0) {
+			dstr_free(&path);
+			continue;
+		}
+
+		struct dump_file *f = da_push_back_new(files);
+		f->path = path.array;
+		f->mtime = st.st_mtim;
+	}
+	os_closedir(d);
+
+	if (files.num > FLIGHT_RECORDER_KEEP) {
+		qsort(files.array, files.num, sizeof(*files.array),
+		      compare_dump_files);
+		for (size_t i = 0; i < files.num - FLIGHT_RECORDER_KEEP; i++)
+			os_unlink(files.array[i].path);
+	}
+
+	for (size_t i = 0; i < files.num; i++)
+		bfree(files.array[i].path);
+	da_free(files);
+}
+
+static void free_dump(struct flight_dump *dump)
+{
+	bfree(dump->events);
+	bfree(dump->reason);
+	bfree(dump->device);
+	bfree(dump->path);
+	bfree(dump->dir);
+	bfree(dump);
+}
+
+static void *writer_thread(void *data)
+{
+	UNUSED_PARAMETER(data);
+
+	os_set_thread_name("pulse-mc-flight");
+
+	for (;;) {
+		pthread_mutex_lock(&queue_mutex);
+		struct flight_dump *dump = NULL;
+		if (queue.num) {
+			dump = queue.array[0];
+			da_erase(queue, 0);
+		}
+		const bool stop = writer_stop;
+		pthread_mutex_unlock(&queue_mutex);
+
+		if (!dump) {
+			if (stop)
+				break;
+			os_event_wait(queue_event);
+			continue;
+		}
+
+		write_dump(dump);
+		prune_dumps(dump->dir);
+		__atomic_store_n(&written_seq, dump->seq, __ATOMIC_RELEASE);
+		free_dump(dump);
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue a dump for the writer, which runs as long as a recorder exists
+ *
+ * @return seq of the dump, which the writer may already have freed, or 0 if
+ *         the writer holds the queue, the mainloop does not wait
+ */
+static uint64_t queue_dump(struct flight_dump *dump)
+{
+	if (pthread_mutex_trylock(&queue_mutex) != 0)
+		return 0;
+	const uint64_t seq = dump->seq = ++next_seq;
+	da_push_back(queue, &dump);
+	pthread_mutex_unlock(&queue_mutex);
+
+	os_event_signal(queue_event);
+	return seq;
+}
+
+void flight_recorder_dump(struct flight_recorder *fr, const char *reason,
+			  bool force)
+{
+	if (!fr || !fr->head)
+		return;
+
+	const uint64_t now = os_gettime_ns();
+	const bool recent = fr->last_dump &&
+			    now - fr->last_dump < DUMP_INTERVAL_NS;
+	const bool pending =
+		__atomic_load_n(&written_seq, __ATOMIC_ACQUIRE) < fr->dump_seq;
+	if (pending || (recent && !force)) {
+		fr->skipped++;
+		return;
+	}
+
+	struct flight_dump *dump = bzalloc(sizeof(struct flight_dump));
+	dump->dir = bstrdup(fr->dir);
+	dump->device = bstrdup(fr->device);
+	dump->reason = bstrdup(reason);
+	dump->skipped = fr->skipped;
+
+	struct dstr path = {0};
+	dstr_printf(&path, "%s/%s-%" PRIu64 DUMP_SUFFIX, fr->dir, fr->device,
+		    now);
+	dump->path = path.array;
+
+	/* oldest first */
+	dump->num = fr->head < FLIGHT_RECORDER_EVENTS ? (size_t)fr->head
+						      : FLIGHT_RECORDER_EVENTS;
+	dump->events = bmalloc(sizeof(struct flight_event) * dump->num);
+	for (size_t i = 0; i < dump->num; i++)
+		dump->events[i] = fr->events[(fr->head - dump->num + i) %
+					     FLIGHT_RECORDER_EVENTS];
+
+	const uint64_t seq = queue_dump(dump);
+	if (!seq) {
+		free_dump(dump);
+		fr->skipped++;
+		return;
+	}
+
+	fr->dump_seq = seq;
+	fr->last_dump = now;
+	fr->skipped = 0;
+}
@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#pragma once
+
+/**
+ * Ring of the latest callbacks of a stream, written to a file on a glitch
+ *
+ * Recording only copies the event into the ring. Dumping copies the ring and
+ * queues it for a writer thread shared by the recorders, so neither blocks
+ * the mainloop on the disk. The recorder is written and dumped from one
+ * thread at a time, the mainloop or a caller holding the mainloop lock.
+ */
+#define FLIGHT_RECORDER_EVENTS 4096
+
+/* dumps kept in the directory, the oldest are deleted after each dump */
+#define FLIGHT_RECORDER_KEEP 32
+
+enum flight_event_flags {
+	FLIGHT_EVENT_HOLE = 1,
+	FLIGHT_EVENT_OVERFLOW = 2,
+	FLIGHT_EVENT_SUSPEND = 4,
+	FLIGHT_EVENT_JUMP = 8,
+};
+
+struct flight_event {
+	/* arrival of the callback in os_gettime_ns() */
+	uint64_t time;
+
+	/* timestamp given to the sources, 0 if the frames were not emitted */
+	uint64_t timestamp;
+
+	/* latency of the stream in nanoseconds, negative if not known */
+	int64_t latency;
+
+	uint32_t bytes;
+	uint32_t flags;
+};
+
+struct flight_recorder;
+
+/**
+ * Create a recorder for a device, starting the writer with the first one
+ *
+ * @return NULL unless the environment variable OBS_PULSE_MC_FLIGHT_DIR names
+ *         the directory of the dumps, the other functions accept NULL
+ */
+struct flight_recorder *flight_recorder_create(const char *device);
+
+/**
+ * Free the recorder, the last one waits for the queued dumps
+ *
+ * Not to be called from the mainloop, the writer may be writing to the disk.
+ */
+void flight_recorder_destroy(struct flight_recorder *fr);
+
+void flight_recorder_record(struct flight_recorder *fr,
+			    const struct flight_event *ev);
+
+/**
+ * Write the ring to a file in the background
+ *
+ * A dump is skipped if the previous one was less than 10 s ago or is still
+ * being written, unless `force` is set, and if the writer is holding the
+ * queue. Skipped dumps are counted in the next one.
+ *
+ * @param reason written in the header of the file
+ */
+void flight_recorder_dump(struct flight_recorder *fr, const char *reason,
+			  bool force);
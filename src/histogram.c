@@ -0,0 +1,140 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#include <util/base.h>
+#include <util/dstr.h>
+
+#include "histogram.h"
+
+#define NSEC_PER_MSEC 1000000.0
+
+static inline uint64_t load(const uint64_t *v)
+{
+	return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+/* only the owner writes, so the increment itself needs no atomic add */
+static inline void store(uint64_t *v, uint64_t value)
+{
+	__atomic_store_n(v, value, __ATOMIC_RELAXED);
+}
+
+static size_t value_to_bin(uint64_t value)
+{
+	if (value < (1ULL << HISTOGRAM_MIN_SHIFT))
+		return 0;
+
+	const int msb = 63 - __builtin_clzll(value);
+	const size_t sub = (size_t)(value >> (msb - HISTOGRAM_SUB_BITS)) &
+			   (HISTOGRAM_SUB_BINS - 1);
+	const size_t bin =
+		(size_t)(msb - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BINS + sub;
+
+	return bin < HISTOGRAM_BINS ? bin : HISTOGRAM_BINS - 1;
+}
+
+static uint64_t bin_upper_bound(size_t bin)
+{
+	const int msb = (int)(bin / HISTOGRAM_SUB_BINS) + HISTOGRAM_MIN_SHIFT;
+	const uint64_t sub = bin % HISTOGRAM_SUB_BINS;
+
+	return (1ULL << msb) + ((sub + 1) << (msb - HISTOGRAM_SUB_BITS));
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	const size_t bin = value_to_bin(value);
+
+	store(&h->bins[bin], h->bins[bin] + 1);
+	store(&h->sum, h->sum + value);
+	if (value > h->max)
+		store(&h->max, value);
+	store(&h->count, h->count + 1);
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < HISTOGRAM_BINS; i++)
+		total += load(&h->bins[i]);
+	if (!total)
+		return 0;
+
+	const uint64_t rank = (uint64_t)(p * (double)(total - 1)) + 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTOGRAM_BINS; i++) {
+		seen += load(&h->bins[i]);
+		if (seen >= rank) {
+			const uint64_t max = load(&h->max);
+			const uint64_t bound = bin_upper_bound(i);
+			return bound < max ? bound : max;
+		}
+	}
+
+	return load(&h->max);
+}
+
+uint64_t histogram_count(const struct histogram *h)
+{
+	return load(&h->count);
+}
+
+uint64_t histogram_mean(const struct histogram *h)
+{
+	const uint64_t count = load(&h->count);
+
+	return count ? load(&h->sum) / count : 0;
+}
+
+void histogram_reset(struct histogram *h)
+{
+	store(&h->count, 0);
+	for (size_t i = 0; i < HISTOGRAM_BINS; i++)
+		store(&h->bins[i], 0);
+	store(&h->sum, 0);
+	store(&h->max, 0);
+}
+
+void histogram_log(const struct histogram *h, int log_level, const char *name)
+{
+	const uint64_t count = histogram_count(h);
+	if (!count)
+		return;
+
+	blog(log_level,
+	     "%s: %" PRIu64 " values, mean %.3f ms, p50 %.3f ms, p90 %.3f ms"
+	     ", p99 %.3f ms, p99.9 %.3f ms, max %.3f ms",
+	     name, count, (double)histogram_mean(h) / NSEC_PER_MSEC,
+	     (double)histogram_percentile(h, 0.5) / NSEC_PER_MSEC,
+	     (double)histogram_percentile(h, 0.9) / NSEC_PER_MSEC,
+	     (double)histogram_percentile(h, 0.99) / NSEC_PER_MSEC,
+	     (double)histogram_percentile(h, 0.999) / NSEC_PER_MSEC,
+	     (double)load(&h->max) / NSEC_PER_MSEC);
+
+	struct dstr bins = {0};
+	for (size_t i = 0; i < HISTOGRAM_BINS; i++) {
+		const uint64_t n = load(&h->bins[i]);
+		if (n)
+			dstr_catf(&bins, " <%.3f:%" PRIu64,
+				  (double)bin_upper_bound(i) / NSEC_PER_MSEC,
+				  n);
+	}
+	blog(log_level, "%s bins:%s", name, bins.array);
+	dstr_free(&bins);
+}
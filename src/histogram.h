@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+
+#pragma once
+
+/**
+ * Log-scale histogram of durations in nanoseconds
+ *
+ * Each power of two is split into HISTOGRAM_SUB_BINS bins, so a percentile is
+ * accurate to about 1/HISTOGRAM_SUB_BINS of its value. Values below 1 us share
+ * the first bin and values above about 70 s the last one.
+ *
+ * One thread records and any thread reads without locks; a reader sees each
+ * bin either before or after a concurrent update.
+ */
+#define HISTOGRAM_MIN_SHIFT 10
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BINS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BINS ((36 - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BINS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bins[HISTOGRAM_BINS];
+};
+
+/**
+ * Add a value, from the thread owning the histogram
+ */
+void histogram_record(struct histogram *h, uint64_t value);
+
+/**
+ * Value below which a fraction `p` of the recorded values fall
+ *
+ * @return the upper bound of the bin holding the percentile, 0 if empty
+ */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+uint64_t histogram_count(const struct histogram *h);
+
+/**
+ * Mean of the recorded values, 0 if empty
+ */
+uint64_t histogram_mean(const struct histogram *h);
+
+/**
+ * Clear the values, from the thread owning the histogram or once it stopped
+ * recording
+ */
+void histogram_reset(struct histogram *h);
+
+/**
+ * Log the percentiles and the non-empty bins in milliseconds
+ *
+ * @param name prefix of the lines
+ */
+void histogram_log(const struct histogram *h, int log_level, const char *name);
@@ -19,15 +19,19 @@
 
 #include <obs-module.h>
 #include "plugin-macros.generated.h"
+#include "event-log.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE(PLUGIN_NAME, "en-US")
 
 extern const struct obs_source_info pulse_input_capture;
 extern const struct obs_source_info pulse_output_capture;
+extern void pulse_free_device_lists(void);
 
 bool obs_module_load(void)
 {
+	event_log_start();
+
 	obs_register_source(&pulse_input_capture);
 	obs_register_source(&pulse_output_capture);
 	blog(LOG_INFO, "plugin loaded (version %s)", PLUGIN_VERSION);
@@ -36,5 +40,7 @@ bool obs_module_load(void)
 
 void obs_module_unload()
 {
+	pulse_free_device_lists();
+	event_log_stop();
 	blog(LOG_INFO, "plugin unloaded");
 }
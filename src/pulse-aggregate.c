@@ -0,0 +1,454 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/circlebuf.h>
+#include <util/profiler.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "pulse-wrapper.h"
+#include "pulse-aggregate.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+/* the reference device is delayed so that the others have arrived */
+#define AGGREGATE_DELAY_NS (50 * NSEC_PER_MSEC)
+
+/* misalignment to give up following and align again */
+#define RESYNC_NS (100 * NSEC_PER_MSEC)
+
+/* frames a member keeps while the reference device does not read them */
+#define MEMBER_MAX_NS (AGGREGATE_DELAY_NS + RESYNC_NS)
+
+/* gap between packets considered as lost frames */
+#define GAP_NS (2 * NSEC_PER_MSEC)
+
+#define REPORT_INTERVAL_NS (10000 * NSEC_PER_MSEC)
+
+/* gains of the drift controller, the error is in seconds */
+#define DRIFT_KP 0.5
+#define DRIFT_KI 0.05
+#define DRIFT_MAX_ADJ 0.002
+
+static const char *convert_name = "aggregate_convert";
+static const char *process_name = "aggregate_process";
+
+struct aggregate_member {
+	struct pulse_aggregate *agg;
+	struct pulse_capture *cap;
+	bool primary;
+
+	uint32_t channels;
+	uint32_t channel_offset;
+	uint32_t rate;
+
+	/* float frames */
+	struct circlebuf buf;
+	uint64_t end_ts;
+
+	/* resampler */
+	bool aligned;
+	double frac;
+	double integral;
+
+	/* last correction of the ratio, proportional and integral terms */
+	double adj_ppm;
+
+	/* statistics */
+	uint32_t underruns;
+	uint32_t resyncs;
+};
+
+struct pulse_aggregate {
+	struct aggregate_member members[AGGREGATE_MAX_DEVICES];
+	size_t num_members;
+
+	uint32_t channels;
+	uint32_t rate;
+
+	pulse_capture_cb cb;
+	void *param;
+
+	float *out;
+	size_t out_size;
+	float *scratch;
+	size_t scratch_size;
+
+	uint64_t next_report;
+};
+
+static inline size_t member_frame_size(const struct aggregate_member *m)
+{
+	return sizeof(float) * m->channels;
+}
+
+static inline size_t member_fill(const struct aggregate_member *m)
+{
+	return m->buf.size / member_frame_size(m);
+}
+
+/**
+ * Timestamp of the frame at the read position of the member
+ */
+static inline int64_t member_front_ts(const struct aggregate_member *m)
+{
+	double frames = (double)member_fill(m) - m->frac;
+	return (int64_t)m->end_ts -
+	       (int64_t)(frames * NSEC_PER_SEC / m->rate);
+}
+
+static float *ensure_buffer(float **buf, size_t *size, size_t n)
+{
+	if (*size < n) {
+		bfree(*buf);
+		*buf = bmalloc(sizeof(float) * n);
+		*size = n;
+	}
+	return *buf;
+}
+
+static void to_float(float *dst, const uint8_t *src, pa_sample_format_t format,
+		     size_t n)
+{
+	switch (format) {
+	case PA_SAMPLE_U8:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = ((float)src[i] - 128.0f) / 128.0f;
+		break;
+	case PA_SAMPLE_S16LE:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = (float)((const int16_t *)src)[i] / 32768.0f;
+		break;
+	case PA_SAMPLE_S32LE:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = (float)((const int32_t *)src)[i] /
+				 2147483648.0f;
+		break;
+	case PA_SAMPLE_FLOAT32LE:
+		memcpy(dst, src, sizeof(float) * n);
+		break;
+	default:
+		memset(dst, 0, sizeof(float) * n);
+	}
+}
+
+static void member_silence(struct pulse_aggregate *agg,
+			   const struct aggregate_member *m, float *out,
+			   uint32_t frames)
+{
+	for (uint32_t j = 0; j < frames; j++)
+		memset(out + j * agg->channels + m->channel_offset, 0,
+		       member_frame_size(m));
+}
+
+/**
+ * Resample the frames of a member starting at `ts` into the combined frames
+ *
+ * The ratio is adjusted so that the read position of the member follows the
+ * timeline of the reference device.
+ */
+static void member_read(struct pulse_aggregate *agg, struct aggregate_member *m,
+			uint64_t ts, float *out, uint32_t frames)
+{
+	const double base = (double)m->rate / agg->rate;
+	size_t fill = member_fill(m);
+
+	if (!m->aligned) {
+		int64_t err = (int64_t)ts - member_front_ts(m);
+		int64_t skip = err * m->rate / NSEC_PER_SEC;
+		size_t need = (size_t)(frames * base) + 2;
+		if (err < 0 || (size_t)skip + need > fill) {
+			member_silence(agg, m, out, frames);
+			return;
+		}
+		circlebuf_pop_front(&m->buf, NULL,
+				    (size_t)skip * member_frame_size(m));
+		fill -= (size_t)skip;
+		m->aligned = true;
+		m->frac = 0.0;
+		m->integral = 0.0;
+	}
+
+	int64_t err_ns = (int64_t)ts - member_front_ts(m);
+	if (err_ns > RESYNC_NS || err_ns < -RESYNC_NS) {
+		m->resyncs++;
+		m->aligned = false;
+		member_silence(agg, m, out, frames);
+		return;
+	}
+
+	const double err = (double)err_ns / NSEC_PER_SEC;
+	m->integral += err * frames / agg->rate;
+	double adj = DRIFT_KP * err + DRIFT_KI * m->integral;
+	if (adj > DRIFT_MAX_ADJ)
+		adj = DRIFT_MAX_ADJ;
+	else if (adj < -DRIFT_MAX_ADJ)
+		adj = -DRIFT_MAX_ADJ;
+	m->adj_ppm = adj * 1e6;
+
+	const double ratio = base * (1.0 + adj);
+	const double end = m->frac + frames * ratio;
+	const size_t consume = (size_t)end;
+	const size_t need = consume + 2;
+	if (fill < need) {
+		m->underruns++;
+		m->aligned = false;
+		member_silence(agg, m, out, frames);
+		return;
+	}
+
+	float *s = ensure_buffer(&agg->scratch, &agg->scratch_size,
+				 need * m->channels);
+	circlebuf_peek_front(&m->buf, s, need * member_frame_size(m));
+
+	for (uint32_t j = 0; j < frames; j++) {
+		double p = m->frac + j * ratio;
+		size_t i = (size_t)p;
+		float t = (float)(p - (double)i);
+		const float *s0 = s + i * m->channels;
+		const float *s1 = s0 + m->channels;
+		float *d = out + j * agg->channels + m->channel_offset;
+		for (uint32_t c = 0; c < m->channels; c++)
+			d[c] = s0[c] + (s1[c] - s0[c]) * t;
+	}
+
+	circlebuf_pop_front(&m->buf, NULL, consume * member_frame_size(m));
+	m->frac = end - (double)consume;
+}
+
+static void aggregate_report(struct pulse_aggregate *agg, uint64_t ts)
+{
+	if (ts < agg->next_report)
+		return;
+	agg->next_report = ts + REPORT_INTERVAL_NS;
+
+	for (size_t i = 1; i < agg->num_members; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		blog(LOG_INFO,
+		     "Aggregate '%s': ratio adjusted by %+.1f ppm, %" PRIu32
+		     " underruns, %" PRIu32 " resyncs",
+		     pulse_capture_get_device(m->cap), m->adj_ppm,
+		     m->underruns, m->resyncs);
+	}
+}
+
+/**
+ * Emit the frames of the reference device that are older than the delay
+ */
+static void aggregate_process(struct pulse_aggregate *agg)
+{
+	struct aggregate_member *p = &agg->members[0];
+	const size_t delay = (size_t)(agg->rate * AGGREGATE_DELAY_NS /
+				      NSEC_PER_SEC);
+	const size_t fill = member_fill(p);
+	if (fill <= delay)
+		return;
+
+	profile_start(process_name);
+
+	const uint32_t frames = (uint32_t)(fill - delay);
+	const uint64_t ts = (uint64_t)member_front_ts(p);
+
+	float *out = ensure_buffer(&agg->out, &agg->out_size,
+				   (size_t)frames * agg->channels);
+
+	float *s = ensure_buffer(&agg->scratch, &agg->scratch_size,
+				 (size_t)frames * p->channels);
+	circlebuf_pop_front(&p->buf, s, frames * member_frame_size(p));
+	for (uint32_t j = 0; j < frames; j++)
+		memcpy(out + j * agg->channels, s + j * p->channels,
+		       member_frame_size(p));
+
+	for (size_t i = 1; i < agg->num_members; i++)
+		member_read(agg, &agg->members[i], ts, out, frames);
+
+	profile_end(process_name);
+
+	struct pulse_capture_packet packet;
+	packet.data = (const uint8_t *)out;
+	packet.frames = frames;
+	packet.timestamp = ts;
+	packet.format = PA_SAMPLE_FLOAT32LE;
+	packet.samples_per_sec = agg->rate;
+	packet.channels = agg->channels;
+	packet.bytes_per_frame = sizeof(float) * agg->channels;
+	agg->cb(agg->param, &packet);
+
+	aggregate_report(agg, ts);
+}
+
+static void aggregate_member_packet(void *param,
+				    const struct pulse_capture_packet *packet)
+{
+	struct aggregate_member *m = param;
+	struct pulse_aggregate *agg = m->agg;
+
+	if (packet->channels != m->channels)
+		return;
+
+	/* Frames are lost, the read position has to be aligned again. */
+	if (m->buf.size) {
+		int64_t gap = (int64_t)packet->timestamp - (int64_t)m->end_ts;
+		if (gap > GAP_NS || gap < -GAP_NS) {
+			circlebuf_pop_front(&m->buf, NULL, m->buf.size);
+			m->aligned = false;
+		}
+	}
+
+	profile_start(convert_name);
+	const size_t n = (size_t)packet->frames * m->channels;
+	float *f = ensure_buffer(&agg->scratch, &agg->scratch_size, n);
+	to_float(f, packet->data, packet->format, n);
+	circlebuf_push_back(&m->buf, f, n * sizeof(float));
+	profile_end(convert_name);
+
+	m->end_ts = packet->timestamp +
+		    (uint64_t)packet->frames * NSEC_PER_SEC / m->rate;
+
+	/* The reference device is not reading, e.g. it is suspended. */
+	const size_t max_frames = (size_t)(m->rate * MEMBER_MAX_NS /
+					   NSEC_PER_SEC);
+	if (!m->primary && member_fill(m) > max_frames) {
+		circlebuf_pop_front(&m->buf, NULL,
+				    (member_fill(m) - max_frames) *
+					    member_frame_size(m));
+		if (m->aligned)
+			m->resyncs++;
+		m->aligned = false;
+	}
+
+	if (m->primary)
+		aggregate_process(agg);
+}
+
+struct pulse_aggregate *pulse_aggregate_create(const char *const *devices,
+					       size_t num_devices, bool input,
+					       pulse_capture_cb cb, void *param)
+{
+	if (!num_devices || num_devices > AGGREGATE_MAX_DEVICES)
+		return NULL;
+
+	struct pulse_aggregate *agg = bzalloc(sizeof(struct pulse_aggregate));
+	agg->cb = cb;
+	agg->param = param;
+
+	for (size_t i = 0; i < num_devices; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		struct pulse_capture_info info = {
+			.name = devices[i],
+			.device = devices[i],
+			.input = input,
+			.channel_map = NULL,
+		};
+
+		m->cap = pulse_capture_open(&info, true);
+		if (!m->cap) {
+			blog(LOG_ERROR, "Unable to open '%s' for aggregate",
+			     devices[i]);
+			pulse_aggregate_destroy(agg);
+			return NULL;
+		}
+		agg->num_members++;
+
+		pa_sample_spec spec;
+		pulse_capture_get_sample_spec(m->cap, &spec);
+
+		if (agg->channels + spec.channels > PA_CHANNELS_MAX) {
+			blog(LOG_ERROR,
+			     "Aggregate exceeds %d channels at '%s'",
+			     (int)PA_CHANNELS_MAX, devices[i]);
+			pulse_aggregate_destroy(agg);
+			return NULL;
+		}
+
+		m->agg = agg;
+		m->primary = i == 0;
+		m->channels = spec.channels;
+		m->channel_offset = agg->channels;
+		m->rate = spec.rate;
+		circlebuf_init(&m->buf);
+
+		agg->channels += spec.channels;
+		if (m->primary)
+			agg->rate = spec.rate;
+	}
+
+	for (size_t i = 0; i < agg->num_members; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		pulse_capture_add_callback(m->cap, aggregate_member_packet, m);
+	}
+
+	blog(LOG_INFO, "Aggregate of %zu devices, %" PRIu32 " channels",
+	     agg->num_members, agg->channels);
+
+	return agg;
+}
+
+void pulse_aggregate_destroy(struct pulse_aggregate *agg)
+{
+	if (!agg)
+		return;
+
+	for (size_t i = 0; i < agg->num_members; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		pulse_capture_remove_callback(m->cap, aggregate_member_packet,
+					      m);
+	}
+
+	for (size_t i = 0; i < agg->num_members; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		if (i > 0)
+			blog(LOG_INFO,
+			     "Aggregate '%s': ratio adjusted by %+.1f ppm"
+			     ", %" PRIu32 " underruns, %" PRIu32 " resyncs",
+			     pulse_capture_get_device(m->cap), m->adj_ppm,
+			     m->underruns, m->resyncs);
+		pulse_capture_release(m->cap);
+		circlebuf_free(&m->buf);
+	}
+
+	bfree(agg->out);
+	bfree(agg->scratch);
+	bfree(agg);
+}
+
+void pulse_aggregate_set_active(struct pulse_aggregate *agg, bool active)
+{
+	for (size_t i = 0; i < agg->num_members; i++) {
+		struct aggregate_member *m = &agg->members[i];
+		pulse_capture_set_callback_active(m->cap,
+						  aggregate_member_packet, m,
+						  active);
+	}
+}
+
+void pulse_aggregate_get_sample_spec(const struct pulse_aggregate *agg,
+				     pa_sample_spec *spec)
+{
+	spec->format = PA_SAMPLE_FLOAT32LE;
+	spec->rate = agg->rate;
+	spec->channels = (uint8_t)agg->channels;
+}
+
+uint64_t pulse_aggregate_get_latency(const struct pulse_aggregate *agg)
+{
+	return pulse_capture_get_latency(agg->members[0].cap);
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pulse-capture.h"
+
+#pragma once
+
+#define AGGREGATE_MAX_DEVICES 4
+
+/**
+ * Several devices combined into one multi-channel capture
+ *
+ * The first device is the clock reference. The frames of the other devices
+ * are resampled so that they follow the timeline of the first device, and
+ * the channels of all devices are combined in order into float frames.
+ */
+struct pulse_aggregate;
+
+/**
+ * Open the devices and start combining them
+ *
+ * @param devices device names, the first one is the clock reference
+ * @param num_devices number of devices
+ * @param input whether the devices are inputs or monitors of outputs
+ * @param cb called from the mainloop with the combined frames
+ *
+ * @return NULL on error
+ *
+ * @warning call without active locks
+ */
+struct pulse_aggregate *pulse_aggregate_create(const char *const *devices,
+					       size_t num_devices, bool input,
+					       pulse_capture_cb cb,
+					       void *param);
+
+/**
+ * Stop and free the aggregate, the callback won't be called after return
+ *
+ * @warning call without active locks
+ */
+void pulse_aggregate_destroy(struct pulse_aggregate *agg);
+
+/**
+ * Pause or resume reading the devices while nobody needs the frames
+ *
+ * @warning call without active locks
+ */
+void pulse_aggregate_set_active(struct pulse_aggregate *agg, bool active);
+
+/**
+ * Sample spec of the combined frames
+ */
+void pulse_aggregate_get_sample_spec(const struct pulse_aggregate *agg,
+				     pa_sample_spec *spec);
+
+/**
+ * Latency of the reference device
+ *
+ * @warning call without active locks
+ */
+uint64_t pulse_aggregate_get_latency(const struct pulse_aggregate *agg);
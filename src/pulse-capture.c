@@ -0,0 +1,1190 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+Copyright (C) 2014 by Leonhard Oelke <leonhard@in-verted.de>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/platform.h>
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/profiler.h>
+#include <util/threading.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "device-timeline.h"
+#include "pulse-aggregate.h"
+#include "event-log.h"
+#include "capture-trace.h"
+#include "flight-recorder.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define STARTUP_TIMEOUT_NS (500 * NSEC_PER_MSEC)
+
+/* distance from the end of the previous packet to dump the flight recorder,
+ * above the corrections of the timeline while it settles */
+#define JUMP_NS (10 * NSEC_PER_MSEC)
+
+static const char *start_name = "pulse_capture_start";
+static const char *stop_name = "pulse_capture_stop";
+static const char *read_name = "pulse_stream_read";
+
+struct capture_callback {
+	pulse_capture_cb cb;
+	void *param;
+	bool active;
+};
+
+struct pulse_capture {
+	pa_stream *stream;
+	struct pulse_aggregate *aggregate;
+	long refs;
+	char *key;
+
+	/* settings */
+	char *name;
+	char *device;
+	bool is_default;
+	bool input;
+	bool native_map;
+	pa_channel_map channel_map;
+	uint32_t fragsize_ms;
+	uint32_t maxlength_ms;
+
+	/* server info */
+	pa_sample_format_t format;
+	uint_fast32_t samples_per_sec;
+	uint_fast32_t bytes_per_frame;
+
+	/* the packets until first_ts are held back, none after the first one
+	 * went through even if a timestamp steps back */
+	uint64_t first_ts;
+	bool dispatching;
+
+	struct device_timeline *timeline;
+	struct timeline_cursor cursor;
+
+	/* frames read until then were recorded before a suspend or a cork */
+	bool suspended;
+	bool corked;
+	bool flushing;
+
+	/* bytes of a frame split across packets, and the packet made whole */
+	uint8_t partial[PA_CHANNELS_MAX * sizeof(float)];
+	size_t partial_bytes;
+	uint8_t *align_buffer;
+	size_t align_buffer_size;
+
+	DARRAY(struct capture_callback) callbacks;
+
+	struct capture_trace *trace;
+
+	/* frames of a replayed packet whose payload was not recorded */
+	uint8_t *replay_buffer;
+	size_t replay_buffer_size;
+
+	/* statistics, written from the mainloop and read from any thread */
+	struct pulse_capture_stats stats;
+	uint_fast32_t misaligned;
+	uint64_t connect_time;
+	uint64_t next_ts;
+
+	/* "pulse_stream_read(device)" in the profiler name store */
+	const char *profile_read;
+
+	struct histogram read_time;
+
+	struct flight_recorder *flight;
+
+	/* end of the previous packet, 0 after the timeline is estimated again */
+	uint64_t expected_ts;
+};
+
+#define STAT_GET(cap, field) \
+	__atomic_load_n(&(cap)->stats.field, __ATOMIC_RELAXED)
+#define STAT_SET(cap, field, value) \
+	__atomic_store_n(&(cap)->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(cap, field, n) STAT_SET(cap, field, (cap)->stats.field + (n))
+
+/* shared captures, the mutex is recursive since an aggregate opens the
+ * captures of its devices */
+static pthread_once_t captures_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t captures_mutex;
+static DARRAY(struct pulse_capture *) captures;
+
+static void captures_init(void)
+{
+	pthread_mutex_init_recursive(&captures_mutex);
+}
+
+static void pulse_capture_stop(struct pulse_capture *cap);
+static void pulse_capture_update_cork(struct pulse_capture *cap);
+
+static inline uint64_t samples_to_ns(size_t frames, uint_fast32_t rate)
+{
+	return util_mul_div64(frames, NSEC_PER_SEC, rate);
+}
+
+/**
+ * Latency of the stream in nanoseconds, negative until the stream has timing
+ * info
+ */
+static int64_t get_stream_latency(struct pulse_capture *cap)
+{
+	pa_usec_t usec;
+	int negative;
+
+	if (pa_stream_get_latency(cap->stream, &usec, &negative) < 0)
+		return -1;
+
+	return negative ? 0 : (int64_t)usec * 1000;
+}
+
+/**
+ * Time when the first frame of the packet was recorded
+ *
+ * Until the stream has timing info, the frames are assumed to have been
+ * recorded just before the callback.
+ */
+static uint64_t get_sample_time(struct pulse_capture *cap, size_t frames,
+				uint64_t now, int64_t latency)
+{
+	if (latency < 0)
+		return now - samples_to_ns(frames, cap->samples_per_sec);
+
+	STAT_SET(cap, latency_ns, (uint64_t)latency);
+	return now - (uint64_t)latency;
+}
+
+static void capture_trace_event(struct pulse_capture *cap,
+				enum capture_trace_type type, size_t bytes,
+				uint64_t now, int64_t latency,
+				const void *payload)
+{
+	if (!cap->trace)
+		return;
+
+	struct capture_trace_record rec;
+	rec.type = type;
+	rec.bytes = (uint32_t)bytes;
+	rec.time = now;
+	rec.latency = latency;
+	capture_trace_write(cap->trace, &rec, payload);
+}
+
+static void capture_dispatch(void *param,
+			     const struct pulse_capture_packet *packet)
+{
+	struct pulse_capture *cap = param;
+
+	for (size_t i = 0; i < cap->callbacks.num; i++) {
+		struct capture_callback *c = &cap->callbacks.array[i];
+		if (c->active)
+			c->cb(c->param, packet);
+	}
+}
+
+/**
+ * Keep the frames aligned if the server split a frame across packets
+ *
+ * The bytes of the partial frame at the end of a packet are kept and put in
+ * front of the next packet.
+ *
+ * @param bytes size of the packet, set to the size of the whole frames
+ * @return the whole frames
+ */
+static const void *capture_align(struct pulse_capture *cap, const void *frames,
+				 size_t *bytes)
+{
+	const size_t total = cap->partial_bytes + *bytes;
+	const size_t aligned = total - total % cap->bytes_per_frame;
+	const uint8_t *data = frames;
+
+	if (cap->partial_bytes && aligned) {
+		if (cap->align_buffer_size < aligned) {
+			bfree(cap->align_buffer);
+			cap->align_buffer = bmalloc(aligned);
+			cap->align_buffer_size = aligned;
+		}
+		memcpy(cap->align_buffer, cap->partial, cap->partial_bytes);
+		memcpy(cap->align_buffer + cap->partial_bytes, frames,
+		       aligned - cap->partial_bytes);
+		data = cap->align_buffer;
+	}
+
+	const size_t rest = total - aligned;
+	if (rest > *bytes)
+		memcpy(cap->partial + cap->partial_bytes, frames, *bytes);
+	else
+		memcpy(cap->partial, (const uint8_t *)frames + *bytes - rest,
+		       rest);
+
+	if (rest && !cap->partial_bytes)
+		cap->misaligned++;
+	cap->partial_bytes = rest;
+	*bytes = aligned;
+	return data;
+}
+
+/**
+ * Record a callback in the flight recorder and dump the recorder on a glitch
+ */
+static void capture_flight(struct pulse_capture *cap, uint64_t now,
+			   size_t bytes, int64_t latency, uint64_t ts,
+			   uint32_t flags)
+{
+	const struct flight_event ev = {
+		.time = now,
+		.timestamp = ts,
+		.latency = latency,
+		.bytes = (uint32_t)bytes,
+		.flags = flags,
+	};
+	flight_recorder_record(cap->flight, &ev);
+
+	if (flags & FLIGHT_EVENT_HOLE)
+		flight_recorder_dump(cap->flight, "hole", false);
+	else if (flags & FLIGHT_EVENT_OVERFLOW)
+		flight_recorder_dump(cap->flight, "overflow", false);
+	else if (flags & FLIGHT_EVENT_JUMP)
+		flight_recorder_dump(cap->flight, "timestamp jump", false);
+}
+
+/**
+ * Stamp the frames and hand them to the callbacks
+ *
+ * @return the timestamp of the packet, 0 if it was not handed over
+ */
+static uint64_t capture_emit(struct pulse_capture *cap, const void *frames,
+			     size_t bytes, uint64_t now, int64_t latency)
+{
+	if (cap->partial_bytes || bytes % cap->bytes_per_frame)
+		frames = capture_align(cap, frames, &bytes);
+	if (!bytes)
+		return 0;
+
+	// the frames are stale, the timeline is estimated again on resume
+	if (cap->suspended || cap->corked || cap->flushing)
+		return 0;
+
+	struct pulse_capture_packet packet;
+	packet.data = frames;
+	packet.frames = bytes / cap->bytes_per_frame;
+	packet.format = cap->format;
+	packet.samples_per_sec = cap->samples_per_sec;
+	packet.channels = cap->channel_map.channels;
+	packet.bytes_per_frame = cap->bytes_per_frame;
+	packet.timestamp = timeline_cursor_stamp(
+		&cap->cursor, get_sample_time(cap, packet.frames, now, latency),
+		packet.frames);
+
+	if (!cap->first_ts)
+		cap->first_ts = packet.timestamp + STARTUP_TIMEOUT_NS;
+
+	if (packet.timestamp > cap->first_ts)
+		cap->dispatching = true;
+	if (cap->dispatching) {
+		capture_dispatch(cap, &packet);
+
+		/* the packets held back at the start don't count */
+		if (!cap->stats.startup_ns)
+			STAT_SET(cap, startup_ns, now - cap->connect_time);
+	}
+
+	// a timestamp overlapping the previous packet by more than a frame
+	if (packet.timestamp + samples_to_ns(1, cap->samples_per_sec) <
+	    cap->next_ts)
+		STAT_ADD(cap, backwards, 1);
+	cap->next_ts = packet.timestamp +
+		       samples_to_ns(packet.frames, cap->samples_per_sec);
+
+	STAT_ADD(cap, packets, 1);
+	STAT_ADD(cap, frames, packet.frames);
+
+	return packet.timestamp;
+}
+
+/**
+ * Stamp and dispatch the frames read from the stream or from a trace
+ *
+ * @param frames NULL for a hole
+ * @param now arrival of the read callback
+ * @param latency latency of the stream, negative if not known yet
+ */
+static void capture_read(struct pulse_capture *cap, const void *frames,
+			 size_t bytes, uint64_t now, int64_t latency)
+{
+	if (!frames) {
+		const size_t total = cap->partial_bytes + bytes;
+		event_log_post(EVENT_AUDIO_HOLE, cap->device, (int64_t)bytes);
+		STAT_ADD(cap, holes, 1);
+		timeline_cursor_skip(&cap->cursor,
+				     total / cap->bytes_per_frame);
+		if (cap->expected_ts)
+			cap->expected_ts +=
+				samples_to_ns(total / cap->bytes_per_frame,
+					      cap->samples_per_sec);
+		cap->partial_bytes = total % cap->bytes_per_frame;
+		memset(cap->partial, 0, cap->partial_bytes);
+		capture_flight(cap, now, bytes, latency, 0, FLIGHT_EVENT_HOLE);
+		return;
+	}
+
+	const uint64_t ts = capture_emit(cap, frames, bytes, now, latency);
+	uint32_t flags = 0;
+	if (ts > cap->first_ts && cap->expected_ts &&
+	    (ts > cap->expected_ts + JUMP_NS || ts + JUMP_NS < cap->expected_ts))
+		flags |= FLIGHT_EVENT_JUMP;
+	if (ts)
+		cap->expected_ts = cap->next_ts;
+
+	capture_flight(cap, now, bytes, latency, ts, flags);
+}
+
+/**
+ * Callback for pulse which gets executed when new audio data is available
+ *
+ * @warning The function may be called even after disconnecting the stream
+ */
+static void pulse_stream_read(pa_stream *p, size_t nbytes, void *userdata)
+{
+	UNUSED_PARAMETER(p);
+	UNUSED_PARAMETER(nbytes);
+	struct pulse_capture *cap = userdata;
+
+	const void *frames;
+	size_t bytes;
+	const uint64_t start = os_gettime_ns();
+
+	profile_start(cap->profile_read);
+
+	if (!cap->stream)
+		goto exit;
+
+	if (pa_stream_peek(cap->stream, &frames, &bytes) < 0)
+		goto exit;
+
+	// check if we got data
+	if (!bytes)
+		goto exit;
+
+	const uint64_t now = os_gettime_ns();
+	const int64_t latency = get_stream_latency(cap);
+
+	if (!cap->stats.fragsize) {
+		const pa_buffer_attr *attr =
+			pa_stream_get_buffer_attr(cap->stream);
+		if (attr)
+			STAT_SET(cap, fragsize,
+				 (uint32_t)(attr->fragsize /
+					    cap->bytes_per_frame));
+	}
+
+	capture_trace_event(cap,
+			    frames ? CAPTURE_TRACE_PACKET : CAPTURE_TRACE_HOLE,
+			    bytes, now, latency, frames);
+	capture_read(cap, frames, bytes, now, latency);
+
+	pa_stream_drop(cap->stream);
+	histogram_record(&cap->read_time, os_gettime_ns() - start);
+exit:
+	profile_end(cap->profile_read);
+	pulse_signal(0);
+}
+
+static void capture_flushed(struct pulse_capture *cap)
+{
+	capture_trace_event(cap, CAPTURE_TRACE_FLUSHED, 0, os_gettime_ns(),
+			    -1, NULL);
+	cap->flushing = false;
+
+	// the stale frames read during the flush may have left a partial frame
+	cap->partial_bytes = 0;
+}
+
+static void pulse_stream_flushed(pa_stream *p, int success, void *userdata)
+{
+	UNUSED_PARAMETER(p);
+	UNUSED_PARAMETER(success);
+
+	capture_flushed(userdata);
+}
+
+/**
+ * Drop the frames buffered so far and estimate the offset on the device
+ * timeline again from the frames recorded afterwards
+ *
+ * While replaying a trace, the end of the flush is a record of the trace.
+ *
+ * @warning call with the mainloop locked
+ */
+static void pulse_capture_flush(struct pulse_capture *cap)
+{
+	timeline_cursor_reset(&cap->cursor);
+	cap->flushing = true;
+	cap->partial_bytes = 0;
+	cap->expected_ts = 0;
+
+	if (!cap->stream)
+		return;
+
+	pa_operation *op =
+		pa_stream_flush(cap->stream, pulse_stream_flushed, cap);
+	if (op)
+		pa_operation_unref(op);
+	else
+		capture_flushed(cap);
+}
+
+static void capture_suspend(struct pulse_capture *cap)
+{
+	capture_trace_event(cap, CAPTURE_TRACE_SUSPEND, 0, os_gettime_ns(),
+			    -1, NULL);
+	cap->suspended = true;
+	STAT_ADD(cap, suspends, 1);
+	capture_flight(cap, os_gettime_ns(), 0, -1, 0, FLIGHT_EVENT_SUSPEND);
+}
+
+static void capture_resume(struct pulse_capture *cap)
+{
+	capture_trace_event(cap, CAPTURE_TRACE_RESUME, 0, os_gettime_ns(), -1,
+			    NULL);
+	cap->suspended = false;
+	pulse_capture_flush(cap);
+}
+
+/**
+ * Callback for pulse which gets executed when the server dropped frames
+ * because the client did not read them in time
+ */
+static void pulse_stream_overflow(pa_stream *p, void *userdata)
+{
+	UNUSED_PARAMETER(p);
+	struct pulse_capture *cap = userdata;
+
+	STAT_ADD(cap, overflows, 1);
+	capture_flight(cap, os_gettime_ns(), 0, get_stream_latency(cap), 0,
+		       FLIGHT_EVENT_OVERFLOW);
+}
+
+/**
+ * Callback for pulse which gets executed when the device is suspended or
+ * resumed
+ *
+ * The frames buffered before the suspend would be stamped as if they were
+ * recorded just now, so they are flushed.
+ */
+static void pulse_stream_suspended(pa_stream *p, void *userdata)
+{
+	struct pulse_capture *cap = userdata;
+
+	if (!cap->stream)
+		return;
+
+	if (pa_stream_is_suspended(p) == 1) {
+		capture_suspend(cap);
+		blog(LOG_INFO, "Device '%s' suspended", cap->device);
+		return;
+	}
+
+	if (!cap->suspended)
+		return;
+
+	capture_resume(cap);
+	blog(LOG_INFO, "Device '%s' resumed", cap->device);
+}
+
+/**
+ * Callback for pulse when the state of the stream changes
+ *
+ * A source may have been muted before the stream could be corked.
+ */
+static void pulse_stream_state(pa_stream *p, void *userdata)
+{
+	struct pulse_capture *cap = userdata;
+
+	if (pa_stream_get_state(p) == PA_STREAM_READY)
+		pulse_capture_update_cork(cap);
+}
+
+/**
+ * Server info callback
+ */
+static void pulse_server_info(pa_context *c, const pa_server_info *i,
+			      void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	struct pulse_capture *cap = userdata;
+
+	blog(LOG_INFO, "Server name: '%s %s'", i->server_name,
+	     i->server_version);
+
+	if (cap->is_default) {
+		bfree(cap->device);
+		if (cap->input) {
+			cap->device = bstrdup(i->default_source_name);
+
+			blog(LOG_DEBUG, "Default input device: '%s'",
+			     cap->device);
+		} else {
+			char *monitor =
+				bzalloc(strlen(i->default_sink_name) + 9);
+			strcat(monitor, i->default_sink_name);
+			strcat(monitor, ".monitor");
+
+			cap->device = bstrdup(monitor);
+
+			blog(LOG_DEBUG, "Default output device: '%s'",
+			     cap->device);
+			bfree(monitor);
+		}
+	}
+
+	pulse_signal(0);
+}
+
+/**
+ * Source info callback
+ *
+ * We use the default stream settings for recording here unless pulse is
+ * configured to something obs can't deal with.
+ */
+static void pulse_source_info(pa_context *c, const pa_source_info *i, int eol,
+			      void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	struct pulse_capture *cap = userdata;
+	// An error occured
+	if (eol < 0) {
+		cap->format = PA_SAMPLE_INVALID;
+		goto skip;
+	}
+	// Terminating call for multi instance callbacks
+	if (eol > 0)
+		goto skip;
+
+	blog(LOG_INFO,
+	     "Audio format: %s, %" PRIu32 " Hz"
+	     ", %" PRIu8 " channels",
+	     pa_sample_format_to_string(i->sample_spec.format),
+	     i->sample_spec.rate, i->sample_spec.channels);
+
+	pa_sample_format_t format = i->sample_spec.format;
+	if (pulse_to_obs_audio_format(format) == AUDIO_FORMAT_UNKNOWN) {
+		format = PA_SAMPLE_FLOAT32LE;
+
+		blog(LOG_INFO,
+		     "Sample format %s not supported by OBS,"
+		     "using %s instead for recording",
+		     pa_sample_format_to_string(i->sample_spec.format),
+		     pa_sample_format_to_string(format));
+	}
+
+	cap->format = format;
+	cap->samples_per_sec = i->sample_spec.rate;
+
+	if (cap->native_map)
+		cap->channel_map = i->channel_map;
+
+skip:
+	pulse_signal(0);
+}
+
+/**
+ * Trace the stream if OBS_PULSE_MC_TRACE_DIR is set
+ *
+ * The payload is recorded too if OBS_PULSE_MC_TRACE_PAYLOAD is set to other
+ * than 0.
+ */
+static void pulse_capture_start_trace(struct pulse_capture *cap)
+{
+	const char *dir = getenv("OBS_PULSE_MC_TRACE_DIR");
+	if (!dir || !*dir)
+		return;
+
+	const char *payload = getenv("OBS_PULSE_MC_TRACE_PAYLOAD");
+
+	struct capture_trace_header hdr = {0};
+	hdr.format = cap->format;
+	hdr.samples_per_sec = cap->samples_per_sec;
+	hdr.channels = cap->channel_map.channels;
+	hdr.bytes_per_frame = cap->bytes_per_frame;
+	if (payload && *payload && strcmp(payload, "0") != 0)
+		hdr.flags |= CAPTURE_TRACE_PAYLOAD;
+
+	struct dstr path = {0};
+	dstr_printf(&path, "%s/%s-%" PRIu64 ".trace", dir, cap->device,
+		    os_gettime_ns());
+	cap->trace = capture_trace_create(path.array, &hdr);
+	dstr_free(&path);
+}
+
+/**
+ * Start recording
+ *
+ * We request the default format used by pulse here because the data will be
+ * converted and possibly re-sampled by obs anyway.
+ *
+ * For now we request a buffer length of 25ms although pulse seems to ignore
+ * this setting for monitor streams. For "real" input streams this should work
+ * fine though.
+ */
+static int_fast32_t pulse_capture_start(struct pulse_capture *cap)
+{
+	if (pulse_get_server_info(pulse_server_info, (void *)cap) < 0) {
+		blog(LOG_ERROR, "Unable to get server info !");
+		return -1;
+	}
+
+	if (pulse_get_source_info(pulse_source_info, cap->device,
+				  (void *)cap) < 0) {
+		blog(LOG_ERROR, "Unable to get source info !");
+		return -1;
+	}
+	if (cap->format == PA_SAMPLE_INVALID) {
+		blog(LOG_ERROR,
+		     "An error occurred while getting the source info!");
+		return -1;
+	}
+
+	pa_sample_spec spec;
+	spec.format = cap->format;
+	spec.rate = cap->samples_per_sec;
+	spec.channels = cap->channel_map.channels;
+
+	if (!pa_sample_spec_valid(&spec)) {
+		blog(LOG_ERROR, "Sample spec is not valid");
+		return -1;
+	}
+
+	cap->bytes_per_frame = pa_frame_size(&spec);
+
+	cap->timeline = device_timeline_get(cap->device, spec.rate);
+	timeline_cursor_init(&cap->cursor, cap->timeline);
+
+	if (!cap->flight)
+		cap->flight = flight_recorder_create(cap->device);
+
+	cap->stream = pulse_stream_new(cap->name, &spec, &cap->channel_map);
+	if (!cap->stream) {
+		blog(LOG_ERROR, "Unable to create stream");
+		return -1;
+	}
+
+	/* the tools record without starting OBS and have no name store */
+	profiler_name_store_t *names = obs_get_profiler_name_store();
+	cap->profile_read = names ? profile_store_name(names,
+						       "pulse_stream_read(%s)",
+						       cap->device)
+				  : read_name;
+
+	pulse_lock();
+	pa_stream_set_read_callback(cap->stream, pulse_stream_read,
+				    (void *)cap);
+	pa_stream_set_suspended_callback(cap->stream, pulse_stream_suspended,
+					 (void *)cap);
+	pa_stream_set_overflow_callback(cap->stream, pulse_stream_overflow,
+					(void *)cap);
+	pa_stream_set_state_callback(cap->stream, pulse_stream_state,
+				     (void *)cap);
+	pulse_unlock();
+
+	pa_buffer_attr attr;
+	attr.fragsize = pa_usec_to_bytes(
+		(cap->fragsize_ms ? cap->fragsize_ms : 25) * PA_USEC_PER_MSEC,
+		&spec);
+	attr.maxlength = cap->maxlength_ms
+				 ? (uint32_t)pa_usec_to_bytes(
+					   cap->maxlength_ms * PA_USEC_PER_MSEC,
+					   &spec)
+				 : (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.prebuf = (uint32_t)-1;
+	attr.tlength = (uint32_t)-1;
+
+	pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY |
+				  PA_STREAM_INTERPOLATE_TIMING |
+				  PA_STREAM_AUTO_TIMING_UPDATE;
+	if (!cap->is_default)
+		flags |= PA_STREAM_DONT_MOVE;
+
+	char positions[PA_CHANNEL_MAP_SNPRINT_MAX];
+	pa_channel_map_snprint(positions, sizeof(positions), &cap->channel_map);
+	blog(LOG_INFO, "Recording %d channels: %s", (int)spec.channels,
+	     positions);
+
+	pulse_capture_start_trace(cap);
+	cap->connect_time = os_gettime_ns();
+
+	pulse_lock();
+	int_fast32_t ret = pa_stream_connect_record(cap->stream, cap->device,
+						    &attr, flags);
+	pulse_unlock();
+	if (ret < 0) {
+		pulse_capture_stop(cap);
+		blog(LOG_ERROR, "Unable to connect to stream");
+		return -1;
+	}
+
+	if (cap->is_default)
+		blog(LOG_INFO, "Started recording from '%s' (default)",
+		     cap->device);
+	else
+		blog(LOG_INFO, "Started recording from '%s'", cap->device);
+
+	return 0;
+}
+
+/**
+ * stop recording
+ */
+static void pulse_capture_stop(struct pulse_capture *cap)
+{
+	profile_start(stop_name);
+
+	if (cap->stream) {
+		pulse_lock();
+		pa_stream_set_read_callback(cap->stream, NULL, NULL);
+		pa_stream_set_suspended_callback(cap->stream, NULL, NULL);
+		pa_stream_set_overflow_callback(cap->stream, NULL, NULL);
+		pa_stream_set_state_callback(cap->stream, NULL, NULL);
+		pa_stream_disconnect(cap->stream);
+		pa_stream_unref(cap->stream);
+		cap->stream = NULL;
+		pulse_unlock();
+	}
+
+	capture_trace_close(cap->trace);
+	cap->trace = NULL;
+
+	device_timeline_release(cap->timeline);
+	cap->timeline = NULL;
+	timeline_cursor_init(&cap->cursor, NULL);
+
+	blog(LOG_INFO, "Stopped recording from '%s'", cap->device);
+	blog(LOG_INFO,
+	     "Got %" PRIu64 " packets with %" PRIu64 " frames, %" PRIu32
+	     " holes, %" PRIu32 " suspends, %" PRIu32 " overflows",
+	     cap->stats.packets, cap->stats.frames, cap->stats.holes,
+	     cap->stats.suspends, cap->stats.overflows);
+	blog(LOG_INFO, "Latency of '%s' was %.1f ms", cap->device,
+	     (double)cap->stats.latency_ns / NSEC_PER_MSEC);
+	blog(LOG_INFO,
+	     "First packet after %.1f ms, %" PRIu32
+	     " timestamps went backwards",
+	     (double)cap->stats.startup_ns / NSEC_PER_MSEC,
+	     cap->stats.backwards);
+	if (cap->misaligned)
+		blog(LOG_WARNING,
+		     "%" PRIuFAST32 " packets of '%s' ended in a partial frame",
+		     cap->misaligned, cap->device);
+	histogram_reset(&cap->read_time);
+
+	cap->first_ts = 0;
+	cap->dispatching = false;
+	cap->suspended = false;
+	cap->corked = false;
+	cap->flushing = false;
+	cap->misaligned = 0;
+	cap->partial_bytes = 0;
+	cap->next_ts = 0;
+
+	STAT_SET(cap, packets, 0);
+	STAT_SET(cap, frames, 0);
+	STAT_SET(cap, holes, 0);
+	STAT_SET(cap, suspends, 0);
+	STAT_SET(cap, overflows, 0);
+	STAT_SET(cap, backwards, 0);
+	STAT_SET(cap, fragsize, 0);
+	STAT_SET(cap, startup_ns, 0);
+	STAT_SET(cap, latency_ns, 0);
+
+	profile_end(stop_name);
+}
+
+static void pulse_capture_destroy(struct pulse_capture *cap)
+{
+	if (cap->stream)
+		pulse_capture_stop(cap);
+	device_timeline_release(cap->timeline);
+	pulse_aggregate_destroy(cap->aggregate);
+	flight_recorder_destroy(cap->flight);
+	da_free(cap->callbacks);
+	bfree(cap->replay_buffer);
+	bfree(cap->align_buffer);
+	bfree(cap->key);
+	bfree(cap->name);
+	bfree(cap->device);
+	bfree(cap);
+}
+
+static char *capture_key(const struct pulse_capture_info *info)
+{
+	struct dstr key = {0};
+
+	dstr_printf(&key, "%s:%s", info->input ? "in" : "out", info->device);
+	for (size_t i = 0; i < info->num_members; i++) {
+		dstr_cat(&key, "+");
+		dstr_cat(&key, info->members[i]);
+	}
+
+	return key.array;
+}
+
+static struct pulse_capture *find_shared_capture(const char *key)
+{
+	for (size_t i = 0; i < captures.num; i++) {
+		struct pulse_capture *cap = captures.array[i];
+		if (strcmp(cap->key, key) == 0)
+			return cap;
+	}
+	return NULL;
+}
+
+static int_fast32_t
+pulse_capture_start_aggregate(struct pulse_capture *cap,
+			      const struct pulse_capture_info *info)
+{
+	const char *devices[AGGREGATE_MAX_DEVICES];
+	size_t num_devices = info->num_members + 1;
+
+	if (num_devices > AGGREGATE_MAX_DEVICES) {
+		blog(LOG_ERROR, "Too many devices to aggregate");
+		return -1;
+	}
+
+	devices[0] = info->device;
+	for (size_t i = 0; i < info->num_members; i++)
+		devices[i + 1] = info->members[i];
+
+	cap->aggregate = pulse_aggregate_create(devices, num_devices,
+						info->input, capture_dispatch,
+						cap);
+	if (!cap->aggregate)
+		return -1;
+
+	pa_sample_spec spec;
+	pulse_aggregate_get_sample_spec(cap->aggregate, &spec);
+	cap->format = spec.format;
+	cap->samples_per_sec = spec.rate;
+	cap->channel_map.channels = spec.channels;
+	cap->bytes_per_frame = pa_frame_size(&spec);
+
+	return 0;
+}
+
+struct pulse_capture *pulse_capture_open(const struct pulse_capture_info *info,
+					 bool shared)
+{
+	struct pulse_capture *cap = NULL;
+	char *key = NULL;
+
+	if (info->num_members && info->channel_map) {
+		blog(LOG_ERROR, "Aggregate requires the device channels");
+		return NULL;
+	}
+	if (shared && info->channel_map) {
+		blog(LOG_ERROR, "Shared capture requires the device channels");
+		return NULL;
+	}
+
+	pthread_once(&captures_once, captures_init);
+	pthread_mutex_lock(&captures_mutex);
+
+	if (shared) {
+		key = capture_key(info);
+		cap = find_shared_capture(key);
+		if (cap) {
+			cap->refs++;
+			bfree(key);
+			goto unlock;
+		}
+	}
+
+	cap = bzalloc(sizeof(struct pulse_capture));
+	cap->refs = 1;
+	cap->key = key;
+	cap->name = bstrdup(info->name);
+	cap->device = bstrdup(info->device);
+	cap->is_default = strcmp("default", info->device) == 0;
+	cap->input = info->input;
+	cap->native_map = !info->channel_map;
+	cap->fragsize_ms = info->fragsize_ms;
+	cap->maxlength_ms = info->maxlength_ms;
+	if (info->channel_map)
+		cap->channel_map = *info->channel_map;
+
+	profile_start(start_name);
+	int_fast32_t ret = info->num_members
+				   ? pulse_capture_start_aggregate(cap, info)
+				   : pulse_capture_start(cap);
+	profile_end(start_name);
+	if (ret < 0) {
+		pulse_capture_destroy(cap);
+		cap = NULL;
+		goto unlock;
+	}
+
+	if (shared)
+		da_push_back(captures, &cap);
+
+unlock:
+	pthread_mutex_unlock(&captures_mutex);
+	return cap;
+}
+
+void pulse_capture_release(struct pulse_capture *cap)
+{
+	if (!cap)
+		return;
+
+	pthread_once(&captures_once, captures_init);
+	pthread_mutex_lock(&captures_mutex);
+	bool destroy = --cap->refs == 0;
+	if (destroy && cap->key) {
+		da_erase_item(captures, &cap);
+		if (!captures.num)
+			da_free(captures);
+	}
+	pthread_mutex_unlock(&captures_mutex);
+
+	if (destroy)
+		pulse_capture_destroy(cap);
+}
+
+static bool capture_has_active_callback(const struct pulse_capture *cap)
+{
+	for (size_t i = 0; i < cap->callbacks.num; i++) {
+		if (cap->callbacks.array[i].active)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Cork the stream while no callback needs the frames
+ *
+ * The stream stays connected so that uncorking is immediate. Until the stream
+ * is ready, the state is applied by pulse_stream_state() instead. A capture
+ * without any callback is just being opened or released and is left as is.
+ *
+ * @warning call with the mainloop locked
+ */
+static void pulse_capture_update_cork(struct pulse_capture *cap)
+{
+	const bool cork = cap->callbacks.num &&
+			  !capture_has_active_callback(cap);
+
+	if (!cap->stream || cap->corked == cork ||
+	    pa_stream_get_state(cap->stream) != PA_STREAM_READY)
+		return;
+
+	pa_operation *op = pa_stream_cork(cap->stream, cork, NULL, NULL);
+	if (!op) {
+		blog(LOG_WARNING, "Unable to %s '%s'",
+		     cork ? "cork" : "uncork", cap->device);
+		return;
+	}
+	pa_operation_unref(op);
+
+	capture_trace_event(cap,
+			    cork ? CAPTURE_TRACE_CORK : CAPTURE_TRACE_UNCORK,
+			    0, os_gettime_ns(), -1, NULL);
+	cap->corked = cork;
+	if (!cork)
+		pulse_capture_flush(cap);
+
+	blog(LOG_DEBUG, "%s '%s'", cork ? "Corked" : "Uncorked", cap->device);
+}
+
+/**
+ * Apply the activity of the callbacks to the stream or to the aggregate
+ *
+ * @warning call without active locks
+ */
+static void pulse_capture_update_active(struct pulse_capture *cap)
+{
+	pulse_lock();
+	pulse_capture_update_cork(cap);
+	const bool active = capture_has_active_callback(cap);
+	pulse_unlock();
+
+	if (cap->aggregate)
+		pulse_aggregate_set_active(cap->aggregate, active);
+}
+
+void pulse_capture_add_callback(struct pulse_capture *cap, pulse_capture_cb cb,
+				void *param)
+{
+	struct capture_callback c = {cb, param, true};
+
+	pulse_lock();
+	da_push_back(cap->callbacks, &c);
+	pulse_unlock();
+
+	pulse_capture_update_active(cap);
+}
+
+void pulse_capture_remove_callback(struct pulse_capture *cap,
+				   pulse_capture_cb cb, void *param)
+{
+	pulse_lock();
+	for (size_t i = 0; i < cap->callbacks.num; i++) {
+		struct capture_callback *c = &cap->callbacks.array[i];
+		if (c->cb == cb && c->param == param) {
+			da_erase(cap->callbacks, i);
+			break;
+		}
+	}
+	pulse_unlock();
+
+	pulse_capture_update_active(cap);
+}
+
+void pulse_capture_set_callback_active(struct pulse_capture *cap,
+				       pulse_capture_cb cb, void *param,
+				       bool active)
+{
+	pulse_lock();
+	for (size_t i = 0; i < cap->callbacks.num; i++) {
+		struct capture_callback *c = &cap->callbacks.array[i];
+		if (c->cb == cb && c->param == param)
+			c->active = active;
+	}
+	pulse_unlock();
+
+	pulse_capture_update_active(cap);
+}
+
+void pulse_capture_get_sample_spec(const struct pulse_capture *cap,
+				   pa_sample_spec *spec)
+{
+	spec->format = cap->format;
+	spec->rate = cap->samples_per_sec;
+	spec->channels = cap->channel_map.channels;
+}
+
+const char *pulse_capture_get_device(const struct pulse_capture *cap)
+{
+	return cap->device;
+}
+
+uint64_t pulse_capture_get_latency(const struct pulse_capture *cap)
+{
+	if (cap->aggregate)
+		return pulse_aggregate_get_latency(cap->aggregate);
+
+	return STAT_GET(cap, latency_ns);
+}
+
+struct pulse_capture *
+pulse_capture_open_replay(const char *device,
+			  const struct capture_trace_header *hdr)
+{
+	struct pulse_capture *cap = bzalloc(sizeof(struct pulse_capture));
+	cap->refs = 1;
+	cap->name = bstrdup(device);
+	cap->device = bstrdup(device);
+	cap->native_map = true;
+	cap->format = (pa_sample_format_t)hdr->format;
+	cap->samples_per_sec = hdr->samples_per_sec;
+	cap->bytes_per_frame = hdr->bytes_per_frame;
+	pa_channel_map_init_extend(&cap->channel_map, hdr->channels,
+				   PA_CHANNEL_MAP_DEFAULT);
+
+	cap->timeline = device_timeline_get(device, hdr->samples_per_sec);
+	timeline_cursor_init(&cap->cursor, cap->timeline);
+	cap->flight = flight_recorder_create(device);
+
+	return cap;
+}
+
+void pulse_capture_replay(struct pulse_capture *cap,
+			  const struct capture_trace_record *rec,
+			  const void *payload)
+{
+	switch ((enum capture_trace_type)rec->type) {
+	case CAPTURE_TRACE_PACKET:
+		if (!cap->connect_time)
+			cap->connect_time = rec->time;
+		if (!payload) {
+			if (cap->replay_buffer_size < rec->bytes) {
+				bfree(cap->replay_buffer);
+				cap->replay_buffer = bzalloc(rec->bytes);
+				cap->replay_buffer_size = rec->bytes;
+			}
+			payload = cap->replay_buffer;
+		}
+		capture_read(cap, payload, rec->bytes, rec->time, rec->latency);
+		break;
+	case CAPTURE_TRACE_HOLE:
+		capture_read(cap, NULL, rec->bytes, rec->time, rec->latency);
+		break;
+	case CAPTURE_TRACE_SUSPEND:
+		capture_suspend(cap);
+		break;
+	case CAPTURE_TRACE_RESUME:
+		capture_resume(cap);
+		break;
+	case CAPTURE_TRACE_CORK:
+		cap->corked = true;
+		break;
+	case CAPTURE_TRACE_UNCORK:
+		cap->corked = false;
+		pulse_capture_flush(cap);
+		break;
+	case CAPTURE_TRACE_FLUSHED:
+		capture_flushed(cap);
+		break;
+	}
+}
+
+void pulse_capture_get_stats(const struct pulse_capture *cap,
+			     struct pulse_capture_stats *stats)
+{
+	stats->packets = STAT_GET(cap, packets);
+	stats->frames = STAT_GET(cap, frames);
+	stats->holes = STAT_GET(cap, holes);
+	stats->suspends = STAT_GET(cap, suspends);
+	stats->overflows = STAT_GET(cap, overflows);
+	stats->backwards = STAT_GET(cap, backwards);
+	stats->fragsize = STAT_GET(cap, fragsize);
+	stats->startup_ns = STAT_GET(cap, startup_ns);
+	stats->latency_ns = STAT_GET(cap, latency_ns);
+}
+
+const struct histogram *
+pulse_capture_get_read_time(const struct pulse_capture *cap)
+{
+	return &cap->read_time;
+}
+
+void pulse_capture_dump_flight_recorder(struct pulse_capture *cap,
+					const char *reason)
+{
+	pulse_lock();
+	flight_recorder_dump(cap->flight, reason, true);
+	pulse_unlock();
+}
@@ -0,0 +1,223 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pulse/stream.h>
+#include <media-io/audio-io.h>
+#include "capture-trace.h"
+#include "histogram.h"
+
+#pragma once
+
+/**
+ * A recording stream on the server
+ *
+ * A capture owns one pa_stream and hands every packet it reads to the
+ * registered callbacks. A shared capture is looked up by device so that
+ * several sources reading the same device share one stream and one timeline.
+ */
+struct pulse_capture;
+
+struct pulse_capture_info {
+	/* stream name shown on the server */
+	const char *name;
+
+	/* device name or "default" */
+	const char *device;
+	bool input;
+
+	/* channels to request, or NULL to record the device's own channels */
+	const pa_channel_map *channel_map;
+
+	/* other devices aggregated after `device`, see pulse-aggregate.h */
+	const char *const *members;
+	size_t num_members;
+
+	/* buffer attributes requested from the server, 0 for the defaults */
+	uint32_t fragsize_ms;
+	uint32_t maxlength_ms;
+};
+
+struct pulse_capture_stats {
+	uint64_t packets;
+	uint64_t frames;
+	uint32_t holes;
+	uint32_t suspends;
+	uint32_t overflows;
+
+	/* timestamps earlier than the end of the previous packet */
+	uint32_t backwards;
+
+	/* fragment size granted by the server in frames, 0 if not known */
+	uint32_t fragsize;
+
+	/* from connecting the stream to the first packet handed over */
+	uint64_t startup_ns;
+	uint64_t latency_ns;
+};
+
+struct pulse_capture_packet {
+	/* interleaved frames */
+	const uint8_t *data;
+	uint32_t frames;
+	uint64_t timestamp;
+
+	pa_sample_format_t format;
+	uint32_t samples_per_sec;
+	uint32_t channels;
+	uint32_t bytes_per_frame;
+};
+
+typedef void (*pulse_capture_cb)(void *param,
+				 const struct pulse_capture_packet *packet);
+
+/**
+ * get obs from pulse audio format
+ */
+static inline enum audio_format
+pulse_to_obs_audio_format(pa_sample_format_t format)
+{
+	switch (format) {
+	case PA_SAMPLE_U8:
+		return AUDIO_FORMAT_U8BIT;
+	case PA_SAMPLE_S16LE:
+		return AUDIO_FORMAT_16BIT;
+	case PA_SAMPLE_S32LE:
+		return AUDIO_FORMAT_32BIT;
+	case PA_SAMPLE_FLOAT32LE:
+		return AUDIO_FORMAT_FLOAT;
+	default:
+		return AUDIO_FORMAT_UNKNOWN;
+	}
+
+	return AUDIO_FORMAT_UNKNOWN;
+}
+
+/**
+ * Open a capture and start recording
+ *
+ * @param info device and channels to record
+ * @param shared if true, an existing capture recording the device's own
+ *               channels is reused. `info->channel_map` has to be NULL.
+ *
+ * If `info->num_members` is not zero, the capture combines the device's own
+ * channels and those of the members into float frames.
+ *
+ * @return NULL on error
+ *
+ * @note Call between pulse_init() and pulse_unref().
+ *
+ * @warning call without active locks
+ */
+struct pulse_capture *pulse_capture_open(const struct pulse_capture_info *info,
+					 bool shared);
+
+/**
+ * Release the capture, the stream is stopped when the last reference is gone
+ *
+ * @warning call without active locks
+ */
+void pulse_capture_release(struct pulse_capture *cap);
+
+/**
+ * Register a callback to be called from the mainloop for each packet
+ */
+void pulse_capture_add_callback(struct pulse_capture *cap, pulse_capture_cb cb,
+				void *param);
+
+/**
+ * Unregister a callback, the callback won't be called after return
+ */
+void pulse_capture_remove_callback(struct pulse_capture *cap,
+				   pulse_capture_cb cb, void *param);
+
+/**
+ * Pause or resume calling a callback
+ *
+ * The stream is corked while no callback is active, and the timeline is
+ * estimated again when it is uncorked.
+ *
+ * @warning call without active locks
+ */
+void pulse_capture_set_callback_active(struct pulse_capture *cap,
+				       pulse_capture_cb cb, void *param,
+				       bool active);
+
+/**
+ * Sample spec of the recorded stream
+ */
+void pulse_capture_get_sample_spec(const struct pulse_capture *cap,
+				   pa_sample_spec *spec);
+
+/**
+ * Name of the recorded device with the default device resolved
+ */
+const char *pulse_capture_get_device(const struct pulse_capture *cap);
+
+/**
+ * Latency of the frames, already subtracted from the timestamps
+ *
+ * @return nanoseconds from the device to the capture callback
+ */
+uint64_t pulse_capture_get_latency(const struct pulse_capture *cap);
+
+/**
+ * Open a capture fed by the records of a trace instead of a stream
+ *
+ * The capture is not shared and is released by pulse_capture_release().
+ */
+struct pulse_capture *
+pulse_capture_open_replay(const char *device,
+			  const struct capture_trace_header *hdr);
+
+/**
+ * Feed a record of a trace through the read path of the capture
+ *
+ * @param payload frames of a packet, silence is used if NULL
+ */
+void pulse_capture_replay(struct pulse_capture *cap,
+			  const struct capture_trace_record *rec,
+			  const void *payload);
+
+/**
+ * Counters of the stream since it started
+ *
+ * Takes no lock, the counters are read one by one while the stream runs.
+ */
+void pulse_capture_get_stats(const struct pulse_capture *cap,
+			     struct pulse_capture_stats *stats);
+
+/**
+ * Time spent in each read callback of the stream, including the callbacks of
+ * the sources
+ *
+ * The histogram is cleared when the stream stops.
+ */
+const struct histogram *
+pulse_capture_get_read_time(const struct pulse_capture *cap);
+
+/**
+ * Write the latest callbacks of the stream to a file, such as when a
+ * watchdog finds the source stalled
+ *
+ * The stream dumps them by itself on a hole, an overflow or a timestamp jump.
+ *
+ * @warning call without active locks
+ */
+void pulse_capture_dump_flight_recorder(struct pulse_capture *cap,
+					const char *reason);
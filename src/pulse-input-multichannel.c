@@ -16,323 +16,479 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+
 #include <util/platform.h>
 #include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/profiler.h>
 #include <util/util_uint64.h>
+#include <media-io/audio-math.h>
 #include <obs-module.h>
 #include "plugin-macros.generated.h"
 
 #include "pulse-wrapper.h"
-
-#define NSEC_PER_SEC 1000000000LL
-#define NSEC_PER_MSEC 1000000L
+#include "pulse-capture.h"
+#include "shm-tap.h"
+#include "channel-remap.h"
+#include "pulse-aggregate.h"
+#include "remap-source.h"
+#include "histogram.h"
 
 #define PULSE_DATA(voidptr) struct pulse_data *data = voidptr;
 
+#define BANK_CHANNELS 8
+#define BANK_MAX (PA_CHANNELS_MAX / BANK_CHANNELS)
+#define SHM_TAP_LENGTH_SEC 2
+#define AGGREGATE_MAX_MEMBERS (AGGREGATE_MAX_DEVICES - 1)
+
+static const char *extract_bank_name = "extract_bank";
+static const char *remap_name = "channel_remap_process";
+static const char *output_name = "obs_source_output_audio";
+static const char *shm_tap_write_name = "shm_tap_write";
+
+/* a longer interval is a pause of the capture, not a late callback */
+#define STATS_MAX_INTERVAL_NS 1000000000ULL
+
+/**
+ * Counters of the source, written from the mainloop and read by get_stats
+ * without locks
+ */
+struct pulse_source_stats {
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t restarts;
+
+	/* arrival of the previous packet and the end of its timestamps */
+	uint64_t last_arrival;
+	uint64_t next_ts;
+
+	struct histogram interval;
+	struct histogram jitter;
+	struct histogram process;
+
+	/* from the timestamp given to OBS to the arrival of the packet */
+	struct histogram age;
+};
+
 struct pulse_data {
 	obs_source_t *source;
-	pa_stream *stream;
+	struct pulse_capture *capture;
+	/* held by the procedures and signals using the capture, and while the
+	 * capture is replaced. Taken before the mainloop lock, which
+	 * pulse_update_active() and the flight recorder dump take under it;
+	 * the mainloop never takes this mutex. */
+	pthread_mutex_t capture_mutex;
 
 	/* user settings */
 	char *device;
-	bool is_default;
 	bool input;
 	pa_channel_map channel_map;
+	int bank;
+	char *members[AGGREGATE_MAX_MEMBERS];
+	size_t num_members;
+	enum channel_remap_mode layout_adapter;
+	double fold_gain_db;
+	bool server_remap;
+	bool shm_tap_enabled;
+	char *shm_tap_name;
+
+	struct shm_tap *shm_tap;
+	/* name and spec the tap was created with */
+	char *shm_tap_current;
+	pa_sample_spec shm_tap_spec;
+
+	struct channel_remap *remap;
+	struct remap_source *remap_source;
+
+	/* channels of the bank extracted from the shared capture */
+	uint8_t *bank_buffer;
+	size_t bank_buffer_size;
+
+	struct pulse_source_stats stats;
+
+	/* "pulse_capture_audio(source)" in the profiler name store */
+	const char *profile_audio;
+};
 
-	/* server info */
-	enum speaker_layout speakers;
-	pa_sample_format_t format;
-	uint_fast32_t samples_per_sec;
-	uint_fast32_t bytes_per_frame;
-	uint64_t first_ts;
+struct device_entry {
+	char *name;
+	char *description;
+};
 
-	/* statistics */
-	uint_fast32_t packets;
-	uint_fast64_t frames;
+/**
+ * Devices listed by the last properties, reused until the server adds or
+ * removes a device
+ */
+struct device_list {
+	pthread_mutex_t mutex;
+	DARRAY(struct device_entry) devices;
+	/* pulse_get_device_generation() when listed, 0 if not listed */
+	uint64_t generation;
+};
+
+static struct device_list input_devices = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct device_list output_devices = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
 static void pulse_stop_recording(struct pulse_data *data);
 
 /**
- * get obs from pulse audio format
+ * Copy the channels of the bank out of the frames of the shared capture
+ *
+ * Channels beyond the device's channel count are filled with silence.
  */
-static enum audio_format pulse_to_obs_audio_format(pa_sample_format_t format)
+static const uint8_t *
+extract_bank(struct pulse_data *data, const struct pulse_capture_packet *packet)
 {
-	switch (format) {
-	case PA_SAMPLE_U8:
-		return AUDIO_FORMAT_U8BIT;
-	case PA_SAMPLE_S16LE:
-		return AUDIO_FORMAT_16BIT;
-	case PA_SAMPLE_S32LE:
-		return AUDIO_FORMAT_32BIT;
-	case PA_SAMPLE_FLOAT32LE:
-		return AUDIO_FORMAT_FLOAT;
-	default:
-		return AUDIO_FORMAT_UNKNOWN;
+	const size_t sample_size = packet->bytes_per_frame / packet->channels;
+	const size_t out_frame_size = sample_size * BANK_CHANNELS;
+	const size_t size = out_frame_size * packet->frames;
+
+	if (data->bank_buffer_size < size) {
+		data->bank_buffer = brealloc(data->bank_buffer, size);
+		data->bank_buffer_size = size;
 	}
 
-	return AUDIO_FORMAT_UNKNOWN;
-}
+	const uint32_t first = (data->bank - 1) * BANK_CHANNELS;
+	uint32_t n = packet->channels > first ? packet->channels - first : 0;
+	if (n > BANK_CHANNELS)
+		n = BANK_CHANNELS;
 
-/**
- * Get obs speaker layout from number of channels
- *
- * @param channels number of channels reported by pulseaudio
- *
- * @return obs speaker_layout id
- *
- * @note This *might* not work for some rather unusual setups, but should work
- *       fine for the majority of cases.
- */
-static enum speaker_layout
-pulse_channels_to_obs_speakers(uint_fast32_t channels)
-{
-	switch (channels) {
-	case 1:
-		return SPEAKERS_MONO;
-	case 2:
-		return SPEAKERS_STEREO;
-	case 3:
-		return SPEAKERS_2POINT1;
-	case 4:
-		return SPEAKERS_4POINT0;
-	case 5:
-		return SPEAKERS_4POINT1;
-	case 6:
-		return SPEAKERS_5POINT1;
-	case 8:
-		return SPEAKERS_7POINT1;
+	uint8_t *dst = data->bank_buffer;
+	const uint8_t *src = packet->data + first * sample_size;
+
+	if (n < BANK_CHANNELS)
+		memset(dst, packet->format == PA_SAMPLE_U8 ? 0x80 : 0, size);
+
+	if (!n)
+		return data->bank_buffer;
+
+	for (uint32_t i = 0; i < packet->frames; i++) {
+		memcpy(dst, src, n * sample_size);
+		dst += out_frame_size;
+		src += packet->bytes_per_frame;
 	}
 
-	return SPEAKERS_UNKNOWN;
+	return data->bank_buffer;
 }
 
-static inline uint64_t samples_to_ns(size_t frames, uint_fast32_t rate)
+static inline void stats_add(uint64_t *counter, uint64_t n)
 {
-	return util_mul_div64(frames, NSEC_PER_SEC, rate);
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
 }
 
-static inline uint64_t get_sample_time(size_t frames, uint_fast32_t rate)
+static inline uint64_t stats_get(const uint64_t *counter)
 {
-	return os_gettime_ns() - samples_to_ns(frames, rate);
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
 }
 
-#define STARTUP_TIMEOUT_NS (500 * NSEC_PER_MSEC)
-
 /**
- * Callback for pulse which gets executed when new audio data is available
+ * Record the arrival of a packet
  *
- * @warning The function may be called even after disconnecting the stream
+ * The jitter is the distance of the timestamp from the end of the previous
+ * packet.
  */
-static void pulse_stream_read(pa_stream *p, size_t nbytes, void *userdata)
+static void stats_record_packet(struct pulse_source_stats *st,
+				const struct pulse_capture_packet *packet,
+				uint64_t now)
 {
-	UNUSED_PARAMETER(p);
-	UNUSED_PARAMETER(nbytes);
-	PULSE_DATA(userdata);
-
-	const void *frames;
-	size_t bytes;
+	histogram_record(&st->age, now > packet->timestamp
+					   ? now - packet->timestamp
+					   : 0);
+
+	const uint64_t interval = now - st->last_arrival;
+	if (st->last_arrival && interval < STATS_MAX_INTERVAL_NS) {
+		histogram_record(&st->interval, interval);
+		histogram_record(&st->jitter,
+				 packet->timestamp > st->next_ts
+					 ? packet->timestamp - st->next_ts
+					 : st->next_ts - packet->timestamp);
+	}
 
-	if (!data->stream)
-		goto exit;
+	st->last_arrival = now;
+	st->next_ts = packet->timestamp +
+		      util_mul_div64(packet->frames, 1000000000ULL,
+				     packet->samples_per_sec);
+	stats_add(&st->packets, 1);
+	stats_add(&st->frames, packet->frames);
+}
 
-	pa_stream_peek(data->stream, &frames, &bytes);
+/**
+ * Capture callback, called from the mainloop for each packet
+ */
+static void pulse_capture_audio(void *param,
+				const struct pulse_capture_packet *packet)
+{
+	PULSE_DATA(param);
 
-	// check if we got data
-	if (!bytes)
-		goto exit;
+	const uint64_t start = os_gettime_ns();
+	stats_record_packet(&data->stats, packet, start);
 
-	if (!frames) {
-		blog(LOG_ERROR, "Got audio hole of %u bytes",
-		     (unsigned int)bytes);
-		pa_stream_drop(data->stream);
-		goto exit;
-	}
+	profile_start(data->profile_audio);
 
 	struct obs_source_audio out;
-	out.speakers = data->speakers;
-	out.samples_per_sec = data->samples_per_sec;
-	out.format = pulse_to_obs_audio_format(data->format);
-	out.data[0] = (uint8_t *)frames;
-	out.frames = bytes / data->bytes_per_frame;
-	out.timestamp = get_sample_time(out.frames, out.samples_per_sec);
+	out.samples_per_sec = packet->samples_per_sec;
+	out.format = pulse_to_obs_audio_format(packet->format);
+	out.frames = packet->frames;
+	out.timestamp = packet->timestamp;
+
+	const uint8_t *frames = packet->data;
+
+	if (data->bank) {
+		profile_start(extract_bank_name);
+		frames = extract_bank(data, packet);
+		profile_end(extract_bank_name);
+		out.data[0] = frames;
+		out.speakers = SPEAKERS_7POINT1;
+	} else if (data->remap) {
+		profile_start(remap_name);
+		channel_remap_process(data->remap, packet->data, packet->frames,
+				      out.data);
+		profile_end(remap_name);
+		out.format = AUDIO_FORMAT_FLOAT_PLANAR;
+		out.speakers = channel_remap_get_speakers(data->remap);
+	} else {
+		out.data[0] = packet->data;
+		out.speakers =
+			pulse_channels_to_obs_speakers(packet->channels);
+	}
 
-	if (!data->first_ts)
-		data->first_ts = out.timestamp + STARTUP_TIMEOUT_NS;
+	profile_start(output_name);
+	obs_source_output_audio(data->source, &out);
+	profile_end(output_name);
 
-	if (out.timestamp > data->first_ts)
-		obs_source_output_audio(data->source, &out);
+	if (data->shm_tap) {
+		profile_start(shm_tap_write_name);
+		shm_tap_write(data->shm_tap, frames, out.frames,
+			      out.timestamp);
+		profile_end(shm_tap_write_name);
+	}
 
-	data->packets++;
-	data->frames += out.frames;
+	profile_end(data->profile_audio);
 
-	pa_stream_drop(data->stream);
-exit:
-	pulse_signal(0);
+	histogram_record(&data->stats.process, os_gettime_ns() - start);
 }
 
 /**
- * Server info callback
+ * Skip the frames while the source is muted or disabled
  */
-static void pulse_server_info(pa_context *c, const pa_server_info *i,
-			      void *userdata)
+static void pulse_update_active(struct pulse_data *data)
 {
-	UNUSED_PARAMETER(c);
-	PULSE_DATA(userdata);
-
-	blog(LOG_INFO, "Server name: '%s %s'", i->server_name,
-	     i->server_version);
-
-	if (data->is_default) {
-		bfree(data->device);
-		if (data->input) {
-			data->device = bstrdup(i->default_source_name);
+	pthread_mutex_lock(&data->capture_mutex);
+	if (data->capture) {
+		const bool active = !obs_source_muted(data->source) &&
+				    obs_source_enabled(data->source);
+		pulse_capture_set_callback_active(
+			data->capture, pulse_capture_audio, data, active);
+	}
+	pthread_mutex_unlock(&data->capture_mutex);
+}
 
-			blog(LOG_DEBUG, "Default input device: '%s'",
-			     data->device);
-		} else {
-			char *monitor =
-				bzalloc(strlen(i->default_sink_name) + 9);
-			strcat(monitor, i->default_sink_name);
-			strcat(monitor, ".monitor");
+static void pulse_active_changed(void *vptr, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	PULSE_DATA(vptr);
 
-			data->device = bstrdup(monitor);
+	pulse_update_active(data);
+}
 
-			blog(LOG_DEBUG, "Default output device: '%s'",
-			     data->device);
-			bfree(monitor);
-		}
-	}
+/**
+ * Stop publishing to the shared memory tap and unlink it
+ */
+static void pulse_shm_tap_destroy(struct pulse_data *data)
+{
+	pulse_lock();
+	struct shm_tap *shm_tap = data->shm_tap;
+	data->shm_tap = NULL;
+	pulse_unlock();
 
-	pulse_signal(0);
+	if (shm_tap)
+		shm_tap_destroy(shm_tap);
+	bfree(data->shm_tap_current);
+	data->shm_tap_current = NULL;
 }
 
 /**
- * Source info callback
+ * Create the layout adapter and the shared memory tap for the capture
  *
- * We use the default stream settings for recording here unless pulse is
- * configured to something obs can't deal with.
+ * The previous ones are replaced under the mainloop lock so that the settings
+ * of the processing can change without restarting the stream. The tap is kept
+ * as long as its name and sample spec don't change, so that the readers keep
+ * their mapping across reconfigurations and restarts of the stream.
  */
-static void pulse_source_info(pa_context *c, const pa_source_info *i, int eol,
-			      void *userdata)
+static void pulse_setup_processing(struct pulse_data *data)
 {
-	UNUSED_PARAMETER(c);
-	PULSE_DATA(userdata);
-	// An error occured
-	if (eol < 0) {
-		data->format = PA_SAMPLE_INVALID;
-		goto skip;
+	pa_sample_spec spec;
+	pulse_capture_get_sample_spec(data->capture, &spec);
+
+	struct channel_remap *remap = NULL;
+	if (!data->bank)
+		remap = channel_remap_create(
+			spec.format, spec.channels, data->layout_adapter,
+			db_to_mul((float)data->fold_gain_db));
+
+	struct shm_tap *shm_tap = NULL;
+	struct dstr name = {0};
+	if (data->shm_tap_enabled) {
+		pa_sample_spec tap_spec = spec;
+		if (data->bank)
+			tap_spec.channels = BANK_CHANNELS;
+
+		if (data->shm_tap_name && *data->shm_tap_name)
+			dstr_copy(&name, data->shm_tap_name);
+		else
+			dstr_printf(&name, "obs-pulse-mc-%s",
+				    obs_source_get_name(data->source));
+
+		const bool same_name = data->shm_tap &&
+				       strcmp(data->shm_tap_current,
+					      name.array) == 0;
+		if (same_name &&
+		    pa_sample_spec_equal(&data->shm_tap_spec, &tap_spec)) {
+			shm_tap = data->shm_tap;
+		} else {
+			/* the name of the old tap is unlinked when it is
+			 * destroyed */
+			if (same_name)
+				pulse_shm_tap_destroy(data);
+
+			shm_tap = shm_tap_create(name.array, &tap_spec,
+						 tap_spec.rate *
+							 SHM_TAP_LENGTH_SEC);
+			data->shm_tap_spec = tap_spec;
+		}
 	}
-	// Terminating call for multi instance callbacks
-	if (eol > 0)
-		goto skip;
-
-	blog(LOG_INFO,
-	     "Audio format: %s, %" PRIu32 " Hz"
-	     ", %" PRIu8 " channels",
-	     pa_sample_format_to_string(i->sample_spec.format),
-	     i->sample_spec.rate, i->sample_spec.channels);
 
-	pa_sample_format_t format = i->sample_spec.format;
-	if (pulse_to_obs_audio_format(format) == AUDIO_FORMAT_UNKNOWN) {
-		format = PA_SAMPLE_FLOAT32LE;
-
-		blog(LOG_INFO,
-		     "Sample format %s not supported by OBS,"
-		     "using %s instead for recording",
-		     pa_sample_format_to_string(i->sample_spec.format),
-		     pa_sample_format_to_string(format));
-	}
+	pulse_lock();
+	struct channel_remap *old_remap = data->remap;
+	struct shm_tap *old_shm_tap = data->shm_tap;
+	data->remap = remap;
+	data->shm_tap = shm_tap;
+	pulse_unlock();
 
-	data->format = format;
-	data->samples_per_sec = i->sample_spec.rate;
+	channel_remap_destroy(old_remap);
+	if (old_shm_tap && old_shm_tap != shm_tap)
+		shm_tap_destroy(old_shm_tap);
 
-skip:
-	pulse_signal(0);
+	bfree(data->shm_tap_current);
+	data->shm_tap_current = shm_tap ? name.array : NULL;
+	if (!shm_tap)
+		dstr_free(&name);
 }
 
 /**
  * Start recording
  *
- * We request the default format used by pulse here because the data will be
- * converted and possibly re-sampled by obs anyway.
- *
- * For now we request a buffer length of 25ms although pulse seems to ignore
- * this setting for monitor streams. For "real" input streams this should work
- * fine though.
+ * A bank shares one capture of all the device's channels with the other banks
+ * of the same device so that they stay sample aligned.
  */
 static int_fast32_t pulse_start_recording(struct pulse_data *data)
 {
-	if (pulse_get_server_info(pulse_server_info, (void *)data) < 0) {
-		blog(LOG_ERROR, "Unable to get server info !");
-		return -1;
-	}
+	const bool native = data->bank || data->num_members;
+	struct pulse_capture_info info = {
+		.name = data->bank ? data->device
+				   : obs_source_get_name(data->source),
+		.device = data->device,
+		.input = data->input,
+		.channel_map = native ? NULL : &data->channel_map,
+		.members = (const char *const *)data->members,
+		.num_members = data->num_members,
+	};
 
-	if (pulse_get_source_info(pulse_source_info, data->device,
-				  (void *)data) < 0) {
-		blog(LOG_ERROR, "Unable to get source info !");
-		return -1;
+	if (data->server_remap && !native) {
+		data->remap_source = remap_source_acquire(
+			data->device, data->input, &data->channel_map);
+		if (data->remap_source) {
+			info.device = remap_source_get_name(data->remap_source);
+			info.channel_map =
+				remap_source_get_map(data->remap_source);
+		} else {
+			blog(LOG_WARNING,
+			     "Picking the channels of '%s' in the client",
+			     data->device);
+		}
 	}
-	if (data->format == PA_SAMPLE_INVALID) {
-		blog(LOG_ERROR,
-		     "An error occurred while getting the source info!");
+
+	struct pulse_capture *capture =
+		pulse_capture_open(&info, data->bank > 0);
+	if (!capture) {
+		/* pulse_stop_recording() is called only with a capture */
+		remap_source_release(data->remap_source);
+		data->remap_source = NULL;
 		return -1;
 	}
 
-	pa_sample_spec spec;
-	spec.format = data->format;
-	spec.rate = data->samples_per_sec;
-	spec.channels = data->channel_map.channels;
-
-	if (!pa_sample_spec_valid(&spec)) {
-		blog(LOG_ERROR, "Sample spec is not valid");
-		return -1;
+	pthread_mutex_lock(&data->capture_mutex);
+	data->capture = capture;
+	pthread_mutex_unlock(&data->capture_mutex);
+
+	if (data->bank) {
+		pa_sample_spec spec;
+		pulse_capture_get_sample_spec(data->capture, &spec);
+		if ((uint32_t)(data->bank - 1) * BANK_CHANNELS >=
+		    spec.channels)
+			blog(LOG_WARNING,
+			     "Bank %d is beyond the %d channels of '%s'",
+			     data->bank, (int)spec.channels,
+			     pulse_capture_get_device(data->capture));
 	}
 
-	data->speakers =
-		pulse_channels_to_obs_speakers(data->channel_map.channels);
-	data->bytes_per_frame = pa_frame_size(&spec);
+	pulse_setup_processing(data);
 
-	data->stream = pulse_stream_new(obs_source_get_name(data->source),
-					&spec, &data->channel_map);
-	if (!data->stream) {
-		blog(LOG_ERROR, "Unable to create stream");
-		return -1;
-	}
+	data->profile_audio = profile_store_name(
+		obs_get_profiler_name_store(), "pulse_capture_audio(%s)",
+		obs_source_get_name(data->source));
 
-	pulse_lock();
-	pa_stream_set_read_callback(data->stream, pulse_stream_read,
-				    (void *)data);
-	pulse_unlock();
+	pulse_capture_add_callback(data->capture, pulse_capture_audio, data);
+	pulse_update_active(data);
 
-	pa_buffer_attr attr;
-	attr.fragsize = pa_usec_to_bytes(25000, &spec);
-	attr.maxlength = (uint32_t)-1;
-	attr.minreq = (uint32_t)-1;
-	attr.prebuf = (uint32_t)-1;
-	attr.tlength = (uint32_t)-1;
+	return 0;
+}
 
-	pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY;
-	if (!data->is_default)
-		flags |= PA_STREAM_DONT_MOVE;
+/**
+ * Log the distributions of the source and of the read callback of its stream
+ */
+static void pulse_log_histograms(struct pulse_data *data)
+{
+	const char *name = obs_source_get_name(data->source);
+	struct dstr prefix = {0};
+	const struct {
+		const char *label;
+		const struct histogram *h;
+	} list[] = {
+		{"callback interval", &data->stats.interval},
+		{"timestamp jitter", &data->stats.jitter},
+		{"timestamp age", &data->stats.age},
+		{"callback processing", &data->stats.process},
+		{"stream read",
+		 data->capture ? pulse_capture_get_read_time(data->capture)
+			       : NULL},
+	};
 
-	pulse_lock();
-	int_fast32_t ret = pa_stream_connect_record(data->stream, data->device,
-						    &attr, flags);
-	pulse_unlock();
-	if (ret < 0) {
-		pulse_stop_recording(data);
-		blog(LOG_ERROR, "Unable to connect to stream");
-		return -1;
+	for (size_t i = 0; i < sizeof(list) / sizeof(*list); i++) {
+		if (!list[i].h)
+			continue;
+		dstr_printf(&prefix, "'%s' %s", name, list[i].label);
+		histogram_log(list[i].h, LOG_INFO, prefix.array);
 	}
+	dstr_free(&prefix);
+}
 
-	if (data->is_default)
-		blog(LOG_INFO, "Started recording from '%s' (default)",
-		     data->device);
-	else
-		blog(LOG_INFO, "Started recording from '%s'", data->device);
-
-	return 0;
+/**
+ * Start the distributions again, the callback has to be removed
+ */
+static void pulse_reset_histograms(struct pulse_data *data)
+{
+	histogram_reset(&data->stats.interval);
+	histogram_reset(&data->stats.jitter);
+	histogram_reset(&data->stats.age);
+	histogram_reset(&data->stats.process);
+	data->stats.last_arrival = 0;
 }
 
 /**
@@ -340,22 +496,46 @@ static int_fast32_t pulse_start_recording(struct pulse_data *data)
  */
 static void pulse_stop_recording(struct pulse_data *data)
 {
-	if (data->stream) {
-		pulse_lock();
-		pa_stream_disconnect(data->stream);
-		pa_stream_unref(data->stream);
-		data->stream = NULL;
-		pulse_unlock();
+	if (data->capture) {
+		struct pulse_capture *capture = data->capture;
+		pulse_capture_remove_callback(capture, pulse_capture_audio,
+					      data);
+
+		/* no procedure can use the capture once it is released */
+		pthread_mutex_lock(&data->capture_mutex);
+		pulse_log_histograms(data);
+		pulse_reset_histograms(data);
+		data->capture = NULL;
+		pthread_mutex_unlock(&data->capture_mutex);
+
+		pulse_capture_release(capture);
 	}
 
-	blog(LOG_INFO, "Stopped recording from '%s'", data->device);
-	blog(LOG_INFO,
-	     "Got %" PRIuFAST32 " packets with %" PRIuFAST64 " frames",
-	     data->packets, data->frames);
+	remap_source_release(data->remap_source);
+	data->remap_source = NULL;
+
+	/* the tap is kept for the next start, see pulse_setup_processing() */
 
-	data->first_ts = 0;
-	data->packets = 0;
-	data->frames = 0;
+	channel_remap_destroy(data->remap);
+	data->remap = NULL;
+}
+
+static void device_list_add(struct device_list *list, const char *name,
+			    const char *description)
+{
+	struct device_entry *e = da_push_back_new(list->devices);
+	e->name = bstrdup(name);
+	e->description = bstrdup(description);
+}
+
+static void device_list_clear(struct device_list *list)
+{
+	for (size_t i = 0; i < list->devices.num; i++) {
+		bfree(list->devices.array[i].name);
+		bfree(list->devices.array[i].description);
+	}
+	da_free(list->devices);
+	list->generation = 0;
 }
 
 /**
@@ -368,8 +548,7 @@ static void pulse_input_info(pa_context *c, const pa_source_info *i, int eol,
 	if (eol != 0 || i->monitor_of_sink != PA_INVALID_INDEX)
 		goto skip;
 
-	obs_property_list_add_string((obs_property_t *)userdata, i->description,
-				     i->name);
+	device_list_add(userdata, i->name, i->description);
 
 skip:
 	pulse_signal(0);
@@ -385,13 +564,55 @@ static void pulse_output_info(pa_context *c, const pa_sink_info *i, int eol,
 	if (eol != 0 || i->monitor_source == PA_INVALID_INDEX)
 		goto skip;
 
-	obs_property_list_add_string((obs_property_t *)userdata, i->description,
-				     i->monitor_source_name);
+	device_list_add(userdata, i->monitor_source_name, i->description);
 
 skip:
 	pulse_signal(0);
 }
 
+/**
+ * Add the sources or the monitors of the sinks to the property
+ *
+ * The server is queried only if a device came or went since the last query.
+ *
+ * @warning call with a reference to the mainloop, without its lock
+ */
+static void add_device_items(obs_property_t *p, bool input)
+{
+	struct device_list *list = input ? &input_devices : &output_devices;
+
+	pthread_mutex_lock(&list->mutex);
+
+	/* read first, an event during the query makes the next one query */
+	const uint64_t generation = pulse_get_device_generation();
+	if (!generation || generation != list->generation) {
+		device_list_clear(list);
+		if (input)
+			pulse_get_source_info_list(pulse_input_info, list);
+		else
+			pulse_get_sink_info_list(pulse_output_info, list);
+		list->generation = generation;
+	}
+
+	for (size_t i = 0; i < list->devices.num; i++)
+		obs_property_list_add_string(p,
+					     list->devices.array[i].description,
+					     list->devices.array[i].name);
+
+	pthread_mutex_unlock(&list->mutex);
+}
+
+void pulse_free_device_lists(void)
+{
+	pthread_mutex_lock(&input_devices.mutex);
+	device_list_clear(&input_devices);
+	pthread_mutex_unlock(&input_devices.mutex);
+
+	pthread_mutex_lock(&output_devices.mutex);
+	device_list_clear(&output_devices);
+	pthread_mutex_unlock(&output_devices.mutex);
+}
+
 static void init_pa_channels_list(obs_property_t *p)
 {
 	const struct {
@@ -399,15 +620,40 @@ static void init_pa_channels_list(obs_property_t *p)
 		const char *name;
 	} list[] = {
 		{1, "MONO"},    {2, "STEREO"},  {3, "2POINT1"}, {4, "4POINT0"},
-		{5, "4POINT1"}, {6, "5POINT1"}, {8, "7POINT1"},
+		{5, "4POINT1"}, {6, "5POINT1"}, {7, NULL},      {8, "7POINT1"},
 	};
 
 	for (size_t i = 0; i < sizeof(list) / sizeof(*list); i++) {
-		obs_property_list_add_int(p, obs_module_text(list[i].name),
-					  list[i].speakers);
+		char desc[32];
+		const char *name = list[i].name;
+		if (!name) {
+			snprintf(desc, sizeof(desc), "%d %s",
+				 (int)list[i].speakers,
+				 obs_module_text("Channels"));
+			name = desc;
+		} else {
+			name = obs_module_text(name);
+		}
+		obs_property_list_add_int(p, name, list[i].speakers);
+	}
+
+	/* Channel counts without a layout go through the layout adapter. */
+	for (int n = 9; n <= (int)PA_CHANNELS_MAX; n++) {
+		char desc[32];
+		snprintf(desc, sizeof(desc), "%d %s", n,
+			 obs_module_text("Channels"));
+		obs_property_list_add_int(p, desc, n);
 	}
 }
 
+static void init_layout_adapter_list(obs_property_t *p)
+{
+	obs_property_list_add_int(p, obs_module_text("LayoutAdapter.Pad"),
+				  CHANNEL_REMAP_PAD);
+	obs_property_list_add_int(p, obs_module_text("LayoutAdapter.Fold"),
+				  CHANNEL_REMAP_FOLD);
+}
+
 static void init_pa_map_list(obs_property_t *p)
 {
 	const struct {
@@ -482,19 +728,59 @@ static void init_pa_map_list(obs_property_t *p)
 	}
 }
 
+static void init_bank_list(obs_property_t *p)
+{
+	obs_property_list_add_int(p, obs_module_text("Bank.Disabled"), 0);
+
+	for (int i = 1; i <= (int)BANK_MAX; i++) {
+		char desc[64];
+		snprintf(desc, sizeof(desc), "%s %d (ch %d-%d)",
+			 obs_module_text("Bank"), i, (i - 1) * BANK_CHANNELS + 1,
+			 i * BANK_CHANNELS);
+		obs_property_list_add_int(p, desc, i);
+	}
+}
+
 static bool channels_changed(obs_properties_t *props, obs_property_t *p,
 			     obs_data_t *settings)
 {
 	UNUSED_PARAMETER(p);
+	bool bank = obs_data_get_int(settings, "bank") > 0;
+	bool aggregate = obs_data_get_bool(settings, "aggregate");
 	size_t pa_channels = obs_data_get_int(settings, "pa_channels");
 
+	bool adapter = !bank &&
+		       (aggregate || pulse_channels_to_obs_speakers(
+					     pa_channels) == SPEAKERS_UNKNOWN);
+
+	for (int i = 1; i <= AGGREGATE_MAX_MEMBERS; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "aggregate_device_%d", i);
+		obs_property_set_visible(obs_properties_get(props, name),
+					 aggregate);
+	}
+
+	obs_property_set_visible(obs_properties_get(props, "pa_channels"),
+				 !bank && !aggregate);
+	obs_property_set_visible(obs_properties_get(props, "layout_adapter"),
+				 adapter);
+	obs_property_set_visible(obs_properties_get(props, "fold_gain_db"),
+				 adapter);
+
+	/* the positions are listed once the channel is shown */
 	for (size_t i = 0; i < PA_CHANNELS_MAX; i++) {
 		char name[16];
 		sprintf(name, "pa_map_%zu", i);
 		obs_property_t *p = obs_properties_get(props, name);
-		obs_property_set_visible(p, i < pa_channels);
+		bool visible = !bank && !aggregate && i < pa_channels;
+		if (visible && !obs_property_list_item_count(p))
+			init_pa_map_list(p);
+		obs_property_set_visible(p, visible);
 	}
 
+	obs_property_set_visible(obs_properties_get(props, "server_remap"),
+				 !bank && !aggregate);
+
 	return true;
 }
 
@@ -509,10 +795,7 @@ static obs_properties_t *pulse_properties(bool input)
 		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
 
 	pulse_init();
-	if (input)
-		pulse_get_source_info_list(pulse_input_info, (void *)devices);
-	else
-		pulse_get_sink_info_list(pulse_output_info, (void *)devices);
+	add_device_items(devices, input);
 	pulse_unref();
 
 	size_t count = obs_property_list_item_count(devices);
@@ -521,22 +804,62 @@ static obs_properties_t *pulse_properties(bool input)
 		obs_property_list_insert_string(
 			devices, 0, obs_module_text("Default"), "default");
 
+	obs_property_t *aggregate = obs_properties_add_bool(
+		props, "aggregate", obs_module_text("Aggregate"));
+	obs_property_set_modified_callback(aggregate, channels_changed);
+
+	for (int i = 1; i <= AGGREGATE_MAX_MEMBERS; i++) {
+		char name[32], desc[64];
+		snprintf(name, sizeof(name), "aggregate_device_%d", i);
+		snprintf(desc, sizeof(desc), "%s %d",
+			 obs_module_text("AggregateDevice"), i + 1);
+		obs_property_t *p = obs_properties_add_list(
+			props, name, desc, OBS_COMBO_TYPE_LIST,
+			OBS_COMBO_FORMAT_STRING);
+		obs_property_list_add_string(p, obs_module_text("None"), "");
+		for (size_t j = 0; j < count; j++)
+			obs_property_list_add_string(
+				p, obs_property_list_item_name(devices, j + 1),
+				obs_property_list_item_string(devices, j + 1));
+	}
+
+	obs_property_t *bank = obs_properties_add_list(
+		props, "bank", obs_module_text("Bank"), OBS_COMBO_TYPE_LIST,
+		OBS_COMBO_FORMAT_INT);
+	init_bank_list(bank);
+	obs_property_set_modified_callback(bank, channels_changed);
+
 	obs_property_t *pa_channels = obs_properties_add_list(
 		props, "pa_channels", obs_module_text("PAChannels"),
 		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
 	init_pa_channels_list(pa_channels);
 	obs_property_set_modified_callback(pa_channels, channels_changed);
 
+	obs_property_t *adapter = obs_properties_add_list(
+		props, "layout_adapter", obs_module_text("LayoutAdapter"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	init_layout_adapter_list(adapter);
+
+	obs_property_t *fold_gain = obs_properties_add_float(
+		props, "fold_gain_db", obs_module_text("FoldGain"), -60.0, 0.0,
+		0.1);
+	obs_property_float_set_suffix(fold_gain, " dB");
+
 	for (size_t i = 0; i < PA_CHANNELS_MAX; i++) {
 		char name[16], desc[16];
 		sprintf(name, "pa_map_%zu", i);
 		sprintf(desc, "PAMap.%zu", i);
-		obs_property_t *pa_map = obs_properties_add_list(
-			props, name, desc, OBS_COMBO_TYPE_LIST,
-			OBS_COMBO_FORMAT_INT);
-		init_pa_map_list(pa_map);
+		obs_properties_add_list(props, name, desc, OBS_COMBO_TYPE_LIST,
+					OBS_COMBO_FORMAT_INT);
 	}
 
+	obs_properties_add_bool(props, "server_remap",
+				obs_module_text("ServerRemap"));
+
+	obs_properties_add_bool(props, "shm_tap", obs_module_text("ShmTap"));
+	obs_properties_add_text(props, "shm_tap_name",
+				obs_module_text("ShmTapName"), OBS_TEXT_DEFAULT);
+
 	return props;
 }
 
@@ -561,6 +884,8 @@ static void pulse_defaults(obs_data_t *settings)
 {
 	obs_data_set_default_string(settings, "device_id", "default");
 	obs_data_set_default_int(settings, "pa_channels", 2);
+	obs_data_set_default_int(settings, "layout_adapter", CHANNEL_REMAP_PAD);
+	obs_data_set_default_double(settings, "fold_gain_db", -3.0);
 
 	obs_data_set_default_int(settings, "pa_map_0",
 				 PA_CHANNEL_POSITION_FRONT_LEFT);
@@ -604,12 +929,22 @@ static void pulse_destroy(void *vptr)
 	if (!data)
 		return;
 
-	if (data->stream)
+	signal_handler_t *sh = obs_source_get_signal_handler(data->source);
+	signal_handler_disconnect(sh, "mute", pulse_active_changed, data);
+	signal_handler_disconnect(sh, "enable", pulse_active_changed, data);
+
+	if (data->capture)
 		pulse_stop_recording(data);
+	pulse_shm_tap_destroy(data);
 	pulse_unref();
 
 	if (data->device)
 		bfree(data->device);
+	bfree(data->shm_tap_name);
+	bfree(data->bank_buffer);
+	for (size_t i = 0; i < data->num_members; i++)
+		bfree(data->members[i]);
+	pthread_mutex_destroy(&data->capture_mutex);
 	bfree(data);
 }
 
@@ -627,6 +962,20 @@ static bool channel_map_compare(const pa_channel_map *a,
 	return false;
 }
 
+static bool members_compare(const char **members, size_t num_members,
+			    const struct pulse_data *data)
+{
+	if (num_members != data->num_members)
+		return true;
+
+	for (size_t i = 0; i < num_members; i++) {
+		if (strcmp(members[i], data->members[i]) != 0)
+			return true;
+	}
+
+	return false;
+}
+
 /**
  * Update the input settings
  */
@@ -634,6 +983,7 @@ static void pulse_update(void *vptr, obs_data_t *settings)
 {
 	PULSE_DATA(vptr);
 	bool restart = false;
+	bool reconfigure = false;
 	const char *new_device;
 	pa_channel_map new_channel_map;
 
@@ -642,7 +992,12 @@ static void pulse_update(void *vptr, obs_data_t *settings)
 		if (data->device)
 			bfree(data->device);
 		data->device = bstrdup(new_device);
-		data->is_default = strcmp("default", data->device) == 0;
+		restart = true;
+	}
+
+	int bank = (int)obs_data_get_int(settings, "bank");
+	if (bank != data->bank) {
+		data->bank = bank;
 		restart = true;
 	}
 
@@ -657,12 +1012,169 @@ static void pulse_update(void *vptr, obs_data_t *settings)
 		restart = true;
 	}
 
-	if (!restart)
+	const char *members[AGGREGATE_MAX_MEMBERS];
+	size_t num_members = 0;
+	if (obs_data_get_bool(settings, "aggregate")) {
+		for (int i = 1; i <= AGGREGATE_MAX_MEMBERS; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "aggregate_device_%d", i);
+			const char *member = obs_data_get_string(settings, name);
+			if (*member)
+				members[num_members++] = member;
+		}
+	}
+	if (members_compare(members, num_members, data)) {
+		for (size_t i = 0; i < data->num_members; i++)
+			bfree(data->members[i]);
+		for (size_t i = 0; i < num_members; i++)
+			data->members[i] = bstrdup(members[i]);
+		data->num_members = num_members;
+		restart = true;
+	}
+
+	enum channel_remap_mode layout_adapter =
+		(enum channel_remap_mode)obs_data_get_int(settings,
+							  "layout_adapter");
+	double fold_gain_db = obs_data_get_double(settings, "fold_gain_db");
+	if (layout_adapter != data->layout_adapter ||
+	    fold_gain_db != data->fold_gain_db) {
+		data->layout_adapter = layout_adapter;
+		data->fold_gain_db = fold_gain_db;
+		reconfigure = true;
+	}
+
+	bool server_remap = obs_data_get_bool(settings, "server_remap");
+	if (server_remap != data->server_remap) {
+		data->server_remap = server_remap;
+		restart = true;
+	}
+
+	bool shm_tap_enabled = obs_data_get_bool(settings, "shm_tap");
+	const char *shm_tap_name = obs_data_get_string(settings, "shm_tap_name");
+	if (shm_tap_enabled != data->shm_tap_enabled ||
+	    (shm_tap_enabled &&
+	     strcmp(shm_tap_name,
+		    data->shm_tap_name ? data->shm_tap_name : "") != 0)) {
+		data->shm_tap_enabled = shm_tap_enabled;
+		bfree(data->shm_tap_name);
+		data->shm_tap_name = bstrdup(shm_tap_name);
+		reconfigure = true;
+	}
+
+	if (!restart && !(reconfigure && data->capture))
 		return;
 
-	if (data->stream)
-		pulse_stop_recording(data);
-	pulse_start_recording(data);
+	const uint64_t start = os_gettime_ns();
+
+	if (!restart) {
+		pulse_setup_processing(data);
+	} else {
+		if (data->capture) {
+			pulse_stop_recording(data);
+			__atomic_store_n(&data->stats.restarts,
+					 data->stats.restarts + 1,
+					 __ATOMIC_RELAXED);
+		}
+		pulse_start_recording(data);
+	}
+
+	blog(LOG_DEBUG, "%s '%s' in %.1f ms",
+	     restart ? "Restarted" : "Reconfigured",
+	     obs_source_get_name(data->source),
+	     (double)(os_gettime_ns() - start) / 1000000.0);
+}
+
+/**
+ * Latency compensated in the timestamps, 0 while not recording
+ */
+static uint64_t pulse_get_latency(struct pulse_data *data)
+{
+	uint64_t latency = 0;
+
+	pthread_mutex_lock(&data->capture_mutex);
+	if (data->capture)
+		latency = pulse_capture_get_latency(data->capture);
+	pthread_mutex_unlock(&data->capture_mutex);
+
+	return latency;
+}
+
+/**
+ * Procedure returning the latency compensated in the timestamps
+ */
+static void pulse_get_latency_proc(void *vptr, calldata_t *cd)
+{
+	PULSE_DATA(vptr);
+
+	calldata_set_float(cd, "latency_ms",
+			   (double)pulse_get_latency(data) / 1000000.0);
+}
+
+/**
+ * Procedure returning the counters of the source and of its stream
+ *
+ * Takes no lock of the mainloop so that it can be polled while the audio is
+ * running.
+ */
+static void pulse_get_stats_proc(void *vptr, calldata_t *cd)
+{
+	PULSE_DATA(vptr);
+	const struct pulse_source_stats *st = &data->stats;
+
+	struct pulse_capture_stats cs = {0};
+	pthread_mutex_lock(&data->capture_mutex);
+	if (data->capture)
+		pulse_capture_get_stats(data->capture, &cs);
+	pthread_mutex_unlock(&data->capture_mutex);
+
+	calldata_set_int(cd, "packets", (long long)stats_get(&st->packets));
+	calldata_set_int(cd, "frames", (long long)stats_get(&st->frames));
+	calldata_set_int(cd, "holes", cs.holes);
+	calldata_set_int(cd, "overflows", cs.overflows);
+	calldata_set_int(cd, "restarts", (long long)stats_get(&st->restarts));
+	/* the same latency as get_latency, that of the aggregate if any */
+	calldata_set_float(cd, "latency_ms",
+			   (double)pulse_get_latency(data) / 1000000.0);
+	calldata_set_int(cd, "fragsize", cs.fragsize);
+	calldata_set_float(
+		cd, "interval_p50_ms",
+		(double)histogram_percentile(&st->interval, 0.5) / 1000000.0);
+	calldata_set_float(
+		cd, "interval_p99_ms",
+		(double)histogram_percentile(&st->interval, 0.99) / 1000000.0);
+	calldata_set_float(
+		cd, "jitter_p99_ms",
+		(double)histogram_percentile(&st->jitter, 0.99) / 1000000.0);
+	calldata_set_float(cd, "process_us",
+			   (double)histogram_mean(&st->process) / 1000.0);
+}
+
+/**
+ * Procedure logging the distributions without stopping the source
+ */
+static void pulse_dump_histograms_proc(void *vptr, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	PULSE_DATA(vptr);
+
+	pthread_mutex_lock(&data->capture_mutex);
+	pulse_log_histograms(data);
+	pthread_mutex_unlock(&data->capture_mutex);
+}
+
+/**
+ * Procedure writing the latest callbacks of the stream to a file
+ */
+static void pulse_dump_flight_recorder_proc(void *vptr, calldata_t *cd)
+{
+	PULSE_DATA(vptr);
+
+	const char *reason = calldata_string(cd, "reason");
+	pthread_mutex_lock(&data->capture_mutex);
+	if (data->capture)
+		pulse_capture_dump_flight_recorder(
+			data->capture, reason && *reason ? reason : "request");
+	pthread_mutex_unlock(&data->capture_mutex);
 }
 
 /**
@@ -675,6 +1187,27 @@ static void *pulse_create(obs_data_t *settings, obs_source_t *source,
 
 	data->input = input;
 	data->source = source;
+	pthread_mutex_init(&data->capture_mutex, NULL);
+
+	signal_handler_t *sh = obs_source_get_signal_handler(source);
+	signal_handler_connect(sh, "mute", pulse_active_changed, data);
+	signal_handler_connect(sh, "enable", pulse_active_changed, data);
+
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(ph, "void get_latency(out float latency_ms)",
+			 pulse_get_latency_proc, data);
+	proc_handler_add(
+		ph,
+		"void get_stats(out int packets, out int frames, out int holes,"
+		" out int overflows, out int restarts, out float latency_ms,"
+		" out int fragsize, out float interval_p50_ms,"
+		" out float interval_p99_ms, out float jitter_p99_ms,"
+		" out float process_us)",
+		pulse_get_stats_proc, data);
+	proc_handler_add(ph, "void dump_histograms()",
+			 pulse_dump_histograms_proc, data);
+	proc_handler_add(ph, "void dump_flight_recorder(in string reason)",
+			 pulse_dump_flight_recorder_proc, data);
 
 	pulse_init();
 	pulse_update(data, settings);
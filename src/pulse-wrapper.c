@@ -17,9 +17,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <pthread.h>
 
+#include <pulse/subscribe.h>
 #include <pulse/thread-mainloop.h>
 
 #include <util/base.h>
+#include <util/profiler.h>
 #include <obs.h>
 
 #include "pulse-wrapper.h"
@@ -30,16 +32,63 @@ static pthread_mutex_t pulse_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pa_threaded_mainloop *pulse_mainloop = NULL;
 static pa_context *pulse_context = NULL;
 
+/* bumped when a source or a sink comes or goes, valid while subscribed */
+static uint64_t device_generation = 0;
+static bool device_subscribed = false;
+
+static void pulse_devices_changed(bool subscribed)
+{
+	__atomic_add_fetch(&device_generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&device_subscribed, subscribed, __ATOMIC_RELEASE);
+}
+
+static void pulse_device_event(pa_context *c, pa_subscription_event_type_t t,
+			       uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(idx);
+	UNUSED_PARAMETER(userdata);
+
+	/* a change is a volume or a port more often than not */
+	if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) !=
+	    PA_SUBSCRIPTION_EVENT_CHANGE)
+		pulse_devices_changed(true);
+}
+
+static void pulse_device_subscribed(pa_context *c, int success,
+				    void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(userdata);
+
+	if (success)
+		pulse_devices_changed(true);
+}
+
 /**
  * context status change callback
  *
- * @todo this is currently a noop, we want to reconnect here if the connection
- *       is lost ...
+ * Once the context is ready, the sources and the sinks are followed so that
+ * a device list can be reused until one of them comes or goes.
+ *
+ * @todo we want to reconnect here if the connection is lost ...
  */
 static void pulse_context_state_changed(pa_context *c, void *userdata)
 {
 	UNUSED_PARAMETER(userdata);
-	UNUSED_PARAMETER(c);
+
+	const pa_context_state_t state = pa_context_get_state(c);
+	if (state == PA_CONTEXT_READY) {
+		const pa_subscription_mask_t mask =
+			PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE;
+		pa_context_set_subscribe_callback(c, pulse_device_event, NULL);
+		pa_operation *op = pa_context_subscribe(
+			c, mask, pulse_device_subscribed, NULL);
+		if (op)
+			pa_operation_unref(op);
+	} else if (!PA_CONTEXT_IS_GOOD(state)) {
+		pulse_devices_changed(false);
+	}
 
 	pulse_signal(0);
 }
@@ -85,13 +134,16 @@ static int_fast32_t pulse_context_ready()
 {
 	pulse_lock();
 
-	if (!PA_CONTEXT_IS_GOOD(pa_context_get_state(pulse_context))) {
-		pulse_unlock();
-		return -1;
-	}
-
-	while (pa_context_get_state(pulse_context) != PA_CONTEXT_READY)
+	pa_context_state_t state;
+	while ((state = pa_context_get_state(pulse_context)) !=
+	       PA_CONTEXT_READY) {
+		/* no server, the wait would never end */
+		if (!PA_CONTEXT_IS_GOOD(state)) {
+			pulse_unlock();
+			return -1;
+		}
 		pulse_wait();
+	}
 
 	pulse_unlock();
 	return 0;
@@ -122,6 +174,7 @@ void pulse_unref()
 	if (--pulse_refs == 0) {
 		pulse_lock();
 		if (pulse_context != NULL) {
+			pulse_devices_changed(false);
 			pa_context_disconnect(pulse_context);
 			pa_context_unref(pulse_context);
 			pulse_context = NULL;
@@ -163,26 +216,44 @@ void pulse_accept()
 	pa_threaded_mainloop_accept(pulse_mainloop);
 }
 
+uint64_t pulse_get_device_generation()
+{
+	if (!__atomic_load_n(&device_subscribed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return __atomic_load_n(&device_generation, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait for a query and release the lock taken by the caller
+ *
+ * @param name passed to profile_start() by the caller
+ */
+static int_fast32_t pulse_wait_operation(pa_operation *op, const char *name)
+{
+	if (op) {
+		while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+			pulse_wait();
+		pa_operation_unref(op);
+	}
+
+	pulse_unlock();
+	profile_end(name);
+
+	return op ? 0 : -1;
+}
+
 int_fast32_t pulse_get_source_info_list(pa_source_info_cb_t cb, void *userdata)
 {
 	if (pulse_context_ready() < 0)
 		return -1;
 
+	profile_start(__func__);
 	pulse_lock();
 
 	pa_operation *op =
 		pa_context_get_source_info_list(pulse_context, cb, userdata);
-	if (!op) {
-		pulse_unlock();
-		return -1;
-	}
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pulse_wait();
-	pa_operation_unref(op);
-
-	pulse_unlock();
-
-	return 0;
+	return pulse_wait_operation(op, __func__);
 }
 
 int_fast32_t pulse_get_sink_info_list(pa_sink_info_cb_t cb, void *userdata)
@@ -190,21 +261,12 @@ int_fast32_t pulse_get_sink_info_list(pa_sink_info_cb_t cb, void *userdata)
 	if (pulse_context_ready() < 0)
 		return -1;
 
+	profile_start(__func__);
 	pulse_lock();
 
 	pa_operation *op =
 		pa_context_get_sink_info_list(pulse_context, cb, userdata);
-	if (!op) {
-		pulse_unlock();
-		return -1;
-	}
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pulse_wait();
-	pa_operation_unref(op);
-
-	pulse_unlock();
-
-	return 0;
+	return pulse_wait_operation(op, __func__);
 }
 
 int_fast32_t pulse_get_source_info(pa_source_info_cb_t cb, const char *name,
@@ -213,21 +275,26 @@ int_fast32_t pulse_get_source_info(pa_source_info_cb_t cb, const char *name,
 	if (pulse_context_ready() < 0)
 		return -1;
 
+	profile_start(__func__);
 	pulse_lock();
 
 	pa_operation *op = pa_context_get_source_info_by_name(
 		pulse_context, name, cb, userdata);
-	if (!op) {
-		pulse_unlock();
+	return pulse_wait_operation(op, __func__);
+}
+
+int_fast32_t pulse_get_source_output_info_list(pa_source_output_info_cb_t cb,
+					       void *userdata)
+{
+	if (pulse_context_ready() < 0)
 		return -1;
-	}
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pulse_wait();
-	pa_operation_unref(op);
 
-	pulse_unlock();
+	profile_start(__func__);
+	pulse_lock();
 
-	return 0;
+	pa_operation *op = pa_context_get_source_output_info_list(
+		pulse_context, cb, userdata);
+	return pulse_wait_operation(op, __func__);
 }
 
 int_fast32_t pulse_get_server_info(pa_server_info_cb_t cb, void *userdata)
@@ -235,20 +302,40 @@ int_fast32_t pulse_get_server_info(pa_server_info_cb_t cb, void *userdata)
 	if (pulse_context_ready() < 0)
 		return -1;
 
+	profile_start(__func__);
 	pulse_lock();
 
 	pa_operation *op =
 		pa_context_get_server_info(pulse_context, cb, userdata);
-	if (!op) {
-		pulse_unlock();
+	return pulse_wait_operation(op, __func__);
+}
+
+int_fast32_t pulse_load_module(const char *name, const char *argument,
+			       pa_context_index_cb_t cb, void *userdata)
+{
+	if (pulse_context_ready() < 0)
 		return -1;
-	}
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pulse_wait();
-	pa_operation_unref(op);
 
-	pulse_unlock();
-	return 0;
+	profile_start(__func__);
+	pulse_lock();
+
+	pa_operation *op = pa_context_load_module(pulse_context, name,
+						  argument, cb, userdata);
+	return pulse_wait_operation(op, __func__);
+}
+
+int_fast32_t pulse_unload_module(uint32_t idx, pa_context_success_cb_t cb,
+				 void *userdata)
+{
+	if (pulse_context_ready() < 0)
+		return -1;
+
+	profile_start(__func__);
+	pulse_lock();
+
+	pa_operation *op =
+		pa_context_unload_module(pulse_context, idx, cb, userdata);
+	return pulse_wait_operation(op, __func__);
 }
 
 pa_stream *pulse_stream_new(const char *name, const pa_sample_spec *ss,
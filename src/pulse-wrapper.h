@@ -79,6 +79,17 @@ void pulse_signal(int wait_for_accept);
  */
 void pulse_accept();
 
+/**
+ * Generation of the sources and sinks of the server
+ *
+ * The number changes whenever a source or a sink is added or removed and
+ * when the connection to the server is lost, so a device list queried under
+ * the same generation is still complete.
+ *
+ * @return 0 while the devices are not followed, until the context is ready
+ */
+uint64_t pulse_get_device_generation();
+
 /**
  * Request source information
  *
@@ -126,6 +137,21 @@ int_fast32_t pulse_get_sink_info_list(pa_sink_info_cb_t cb, void *userdata);
 int_fast32_t pulse_get_source_info(pa_source_info_cb_t cb, const char *name,
 				   void *userdata);
 
+/**
+ * Request information of all source outputs
+ *
+ * The function will block until the operation was executed and the mainloop
+ * called the provided callback function.
+ *
+ * @return negative on error
+ *
+ * @note The function will block until the server context is ready.
+ *
+ * @warning call without active locks
+ */
+int_fast32_t pulse_get_source_output_info_list(pa_source_output_info_cb_t cb,
+					       void *userdata);
+
 /**
  * Request server information
  *
@@ -140,6 +166,36 @@ int_fast32_t pulse_get_source_info(pa_source_info_cb_t cb, const char *name,
  */
 int_fast32_t pulse_get_server_info(pa_server_info_cb_t cb, void *userdata);
 
+/**
+ * Load a module into the server
+ *
+ * The function will block until the operation was executed and the mainloop
+ * called the provided callback function with the index of the module.
+ *
+ * @return negative on error
+ *
+ * @note The function will block until the server context is ready.
+ *
+ * @warning call without active locks
+ */
+int_fast32_t pulse_load_module(const char *name, const char *argument,
+			       pa_context_index_cb_t cb, void *userdata);
+
+/**
+ * Unload a module from the server
+ *
+ * The function will block until the operation was executed and the mainloop
+ * called the provided callback function.
+ *
+ * @return negative on error
+ *
+ * @note The function will block until the server context is ready.
+ *
+ * @warning call without active locks
+ */
+int_fast32_t pulse_unload_module(uint32_t idx, pa_context_success_cb_t cb,
+				 void *userdata);
+
 /**
  * Create a new stream with the default properties
  *
@@ -0,0 +1,298 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "pulse-wrapper.h"
+#include "remap-source.h"
+
+#define REMAP_MODULE "module-remap-source"
+#define REMAP_PREFIX "obs_mc_remap_"
+
+struct remap_source {
+	char *name;
+	pa_channel_map map;
+	long refs;
+
+	/* module owning the source, whichever client loaded it */
+	uint32_t module;
+};
+
+struct source_lookup {
+	bool exists;
+	uint32_t index;
+	uint32_t module;
+};
+
+struct output_lookup {
+	uint32_t source;
+	uint32_t outputs;
+};
+
+struct master_lookup {
+	bool input;
+	char *device;
+};
+
+static pthread_mutex_t remaps_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DARRAY(struct remap_source *) remaps;
+
+static void master_server_info(pa_context *c, const pa_server_info *i,
+			       void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	struct master_lookup *lookup = userdata;
+
+	struct dstr device = {0};
+	if (lookup->input)
+		dstr_copy(&device, i->default_source_name);
+	else
+		dstr_printf(&device, "%s.monitor", i->default_sink_name);
+	lookup->device = device.array;
+
+	pulse_signal(0);
+}
+
+static void source_lookup_info(pa_context *c, const pa_source_info *i,
+			       int eol, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	struct source_lookup *lookup = userdata;
+
+	if (eol == 0) {
+		lookup->exists = true;
+		lookup->index = i->index;
+		lookup->module = i->owner_module;
+	}
+
+	pulse_signal(0);
+}
+
+static void output_lookup_info(pa_context *c, const pa_source_output_info *i,
+			       int eol, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	struct output_lookup *lookup = userdata;
+
+	if (eol == 0 && i->source == lookup->source)
+		lookup->outputs++;
+
+	pulse_signal(0);
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	uint32_t *module = userdata;
+
+	*module = idx;
+
+	pulse_signal(0);
+}
+
+static void module_unloaded(pa_context *c, int success, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(success);
+	UNUSED_PARAMETER(userdata);
+
+	pulse_signal(0);
+}
+
+/**
+ * Name of the source, identical for the same device and selection in every
+ * client
+ */
+static char *remap_name(const char *master, const char *positions)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = master; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	hash = (hash ^ '|') * 16777619u;
+	for (const char *p = positions; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+
+	struct dstr name = {0};
+	dstr_printf(&name, REMAP_PREFIX "%08" PRIx32, hash);
+	return name.array;
+}
+
+static struct remap_source *remap_source_create(const char *master,
+						 const pa_channel_map *map)
+{
+	char positions[PA_CHANNEL_MAP_SNPRINT_MAX];
+	char out_positions[PA_CHANNEL_MAP_SNPRINT_MAX];
+
+	struct remap_source *rs = bzalloc(sizeof(struct remap_source));
+	rs->refs = 1;
+	rs->module = PA_INVALID_INDEX;
+	pa_channel_map_init_extend(&rs->map, map->channels,
+				   PA_CHANNEL_MAP_DEFAULT);
+
+	pa_channel_map_snprint(positions, sizeof(positions), map);
+	pa_channel_map_snprint(out_positions, sizeof(out_positions), &rs->map);
+	rs->name = remap_name(master, positions);
+
+	struct source_lookup lookup = {false, PA_INVALID_INDEX,
+				       PA_INVALID_INDEX};
+	pulse_get_source_info(source_lookup_info, rs->name, &lookup);
+	if (lookup.exists) {
+		blog(LOG_INFO, "Reusing '%s' picking %s from '%s'", rs->name,
+		     positions, master);
+		rs->module = lookup.module;
+		return rs;
+	}
+
+	struct dstr args = {0};
+	dstr_printf(&args,
+		    "source_name=%s master=%s channels=%d channel_map=%s"
+		    " master_channel_map=%s remix=no",
+		    rs->name, master, (int)map->channels, out_positions,
+		    positions);
+
+	if (pulse_load_module(REMAP_MODULE, args.array, module_loaded,
+			      &rs->module) < 0 ||
+	    rs->module == PA_INVALID_INDEX) {
+		blog(LOG_ERROR, "Unable to load " REMAP_MODULE " %s",
+		     args.array);
+		dstr_free(&args);
+		bfree(rs->name);
+		bfree(rs);
+		return NULL;
+	}
+
+	blog(LOG_INFO, "Loaded " REMAP_MODULE " #%" PRIu32 " %s", rs->module,
+	     args.array);
+	dstr_free(&args);
+
+	return rs;
+}
+
+struct remap_source *remap_source_acquire(const char *master, bool input,
+					  const pa_channel_map *map)
+{
+	struct master_lookup lookup = {input, NULL};
+	struct remap_source *rs = NULL;
+
+	if (strcmp(master, "default") == 0) {
+		if (pulse_get_server_info(master_server_info, &lookup) < 0 ||
+		    !lookup.device)
+			return NULL;
+		master = lookup.device;
+	}
+
+	char positions[PA_CHANNEL_MAP_SNPRINT_MAX];
+	pa_channel_map_snprint(positions, sizeof(positions), map);
+	char *name = remap_name(master, positions);
+
+	pthread_mutex_lock(&remaps_mutex);
+
+	for (size_t i = 0; i < remaps.num; i++) {
+		if (strcmp(remaps.array[i]->name, name) == 0) {
+			rs = remaps.array[i];
+			rs->refs++;
+			goto unlock;
+		}
+	}
+
+	rs = remap_source_create(master, map);
+	if (rs)
+		da_push_back(remaps, &rs);
+
+unlock:
+	pthread_mutex_unlock(&remaps_mutex);
+	bfree(name);
+	bfree(lookup.device);
+	return rs;
+}
+
+/**
+ * Whether another client still records the source
+ *
+ * Our own streams are disconnected before the last reference is released, and
+ * the server handles the requests of a context in order, so any output left
+ * belongs to another client, which would be killed by unloading the module.
+ */
+static bool remap_source_recorded(const struct remap_source *rs)
+{
+	struct source_lookup source = {false, PA_INVALID_INDEX,
+				       PA_INVALID_INDEX};
+	if (pulse_get_source_info(source_lookup_info, rs->name, &source) < 0 ||
+	    !source.exists)
+		return false;
+
+	/* a module reloaded by another client with the same name */
+	if (source.module != rs->module)
+		return true;
+
+	struct output_lookup lookup = {source.index, 0};
+	if (pulse_get_source_output_info_list(output_lookup_info, &lookup) < 0)
+		return true;
+
+	if (!lookup.outputs)
+		return false;
+
+	blog(LOG_INFO,
+	     "Leaving " REMAP_MODULE " #%" PRIu32 " loaded for %" PRIu32
+	     " other recording streams",
+	     rs->module, lookup.outputs);
+	return true;
+}
+
+void remap_source_release(struct remap_source *rs)
+{
+	if (!rs)
+		return;
+
+	pthread_mutex_lock(&remaps_mutex);
+	bool destroy = --rs->refs == 0;
+	if (destroy) {
+		da_erase_item(remaps, &rs);
+		if (!remaps.num)
+			da_free(remaps);
+	}
+	pthread_mutex_unlock(&remaps_mutex);
+
+	if (!destroy)
+		return;
+
+	if (rs->module != PA_INVALID_INDEX && !remap_source_recorded(rs)) {
+		pulse_unload_module(rs->module, module_unloaded, NULL);
+		blog(LOG_INFO, "Unloaded " REMAP_MODULE " #%" PRIu32,
+		     rs->module);
+	}
+
+	bfree(rs->name);
+	bfree(rs);
+}
+
+const char *remap_source_get_name(const struct remap_source *rs)
+{
+	return rs->name;
+}
+
+const pa_channel_map *remap_source_get_map(const struct remap_source *rs)
+{
+	return &rs->map;
+}
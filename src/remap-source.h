@@ -0,0 +1,64 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <pulse/channelmap.h>
+
+#pragma once
+
+/**
+ * Source picking channels of a device in the server
+ *
+ * A `module-remap-source` is loaded for each pair of a device and a channel
+ * selection so that the channels are picked once for all the clients. The
+ * name of the source is derived from the device and the selection, so that a
+ * source already loaded by another client is reused as is. Whichever client
+ * releases it last unloads the module.
+ */
+struct remap_source;
+
+/**
+ * Get the source picking the channels, loading the module if needed
+ *
+ * @param master device to pick the channels from
+ * @param input whether the device is an input or the monitor of an output
+ * @param map positions of the device to pick
+ *
+ * @return NULL on error
+ *
+ * @warning call without active locks
+ */
+struct remap_source *remap_source_acquire(const char *master, bool input,
+					  const pa_channel_map *map);
+
+/**
+ * Release the source, unloading the module unless another client still
+ * records it
+ *
+ * @warning call without active locks
+ */
+void remap_source_release(struct remap_source *rs);
+
+/**
+ * Name of the source to record
+ */
+const char *remap_source_get_name(const struct remap_source *rs);
+
+/**
+ * Channel map of the source to record
+ */
+const pa_channel_map *remap_source_get_map(const struct remap_source *rs);
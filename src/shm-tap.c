@@ -0,0 +1,237 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <util/bmem.h>
+#include <util/dstr.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+#include "plugin-macros.generated.h"
+
+#include "shm-tap.h"
+
+/* names tried after the requested one is taken */
+#define FALLBACK_NAMES 16
+
+struct shm_tap {
+	char *path;
+	struct shm_tap_header *header;
+	uint8_t *ring;
+	size_t size;
+};
+
+static char *shm_tap_path(const char *name)
+{
+	size_t len = strlen(name);
+	char *path = bzalloc(len + 2);
+
+	path[0] = '/';
+	for (size_t i = 0; i < len; i++)
+		path[i + 1] = name[i] == '/' ? '_' : name[i];
+
+	return path;
+}
+
+/**
+ * Whether the object is a ring left behind by a publisher that died
+ *
+ * A publisher that is still alive, or whose pid was reused, keeps its ring.
+ */
+static bool shm_tap_stale(const char *path)
+{
+	int fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	bool stale = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size >= sizeof(struct shm_tap_header)) {
+		struct shm_tap_header *h =
+			mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+		if (h != MAP_FAILED) {
+			const bool valid = __atomic_load_n(&h->magic,
+							   __ATOMIC_ACQUIRE) ==
+					   SHM_TAP_MAGIC;
+			const pid_t pid = (pid_t)h->publisher_pid;
+			stale = valid && pid > 0 && kill(pid, 0) < 0 &&
+				errno == ESRCH;
+			munmap(h, sizeof(*h));
+		}
+	}
+	close(fd);
+
+	return stale;
+}
+
+/**
+ * Create the object exclusively, as `/<name>`, then `/<name>-<pid>`, then
+ * `/<name>-<pid>-<n>`, removing stale rings in the way
+ */
+static int shm_tap_open(char **path)
+{
+	char *base = *path;
+	struct dstr candidate = {0};
+	int fd = -1;
+
+	for (int i = 0; i <= FALLBACK_NAMES; i++) {
+		if (i == 0)
+			dstr_copy(&candidate, base);
+		else if (i == 1)
+			dstr_printf(&candidate, "%s-%d", base, (int)getpid());
+		else
+			dstr_printf(&candidate, "%s-%d-%d", base,
+				    (int)getpid(), i);
+
+		fd = shm_open(candidate.array, O_RDWR | O_CREAT | O_EXCL,
+			      0600);
+		if (fd < 0 && errno == EEXIST &&
+		    shm_tap_stale(candidate.array)) {
+			blog(LOG_INFO, "Removing the stale ring '%s'",
+			     candidate.array);
+			shm_unlink(candidate.array);
+			fd = shm_open(candidate.array,
+				      O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+
+		/* another source or a live process owns the name, don't
+		 * truncate a ring that may still be read */
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+
+	if (fd >= 0 && strcmp(candidate.array, base) != 0)
+		blog(LOG_WARNING, "'%s' already exists, publishing to '%s'",
+		     base, candidate.array);
+
+	*path = candidate.array;
+	bfree(base);
+	return fd;
+}
+
+struct shm_tap *shm_tap_create(const char *name, const pa_sample_spec *spec,
+			       uint32_t capacity)
+{
+	if (!name || !*name || !capacity)
+		return NULL;
+
+	const uint32_t header_size = (sizeof(struct shm_tap_header) + 63) & ~63;
+	const uint32_t bytes_per_frame = (uint32_t)pa_frame_size(spec);
+	const size_t size = header_size + (size_t)capacity * bytes_per_frame;
+
+	char *path = shm_tap_path(name);
+	int fd = shm_tap_open(&path);
+	if (fd < 0) {
+		blog(LOG_ERROR, "shm_open '%s' failed: %s", path,
+		     strerror(errno));
+		bfree(path);
+		return NULL;
+	}
+
+	if (ftruncate(fd, (off_t)size) < 0) {
+		blog(LOG_ERROR, "ftruncate '%s' failed: %s", path,
+		     strerror(errno));
+		close(fd);
+		shm_unlink(path);
+		bfree(path);
+		return NULL;
+	}
+
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		blog(LOG_ERROR, "mmap '%s' failed: %s", path, strerror(errno));
+		shm_unlink(path);
+		bfree(path);
+		return NULL;
+	}
+
+	struct shm_tap *tap = bzalloc(sizeof(struct shm_tap));
+	tap->path = path;
+	tap->header = ptr;
+	tap->ring = (uint8_t *)ptr + header_size;
+	tap->size = size;
+
+	struct shm_tap_header *h = tap->header;
+	h->header_size = header_size;
+	h->format = (uint32_t)spec->format;
+	h->samples_per_sec = spec->rate;
+	h->channels = spec->channels;
+	h->bytes_per_frame = bytes_per_frame;
+	h->capacity = capacity;
+	h->publisher_pid = (uint32_t)getpid();
+	h->version = SHM_TAP_VERSION;
+	__atomic_store_n(&h->magic, SHM_TAP_MAGIC, __ATOMIC_RELEASE);
+
+	blog(LOG_INFO, "Publishing audio to shared memory '%s'", path);
+
+	return tap;
+}
+
+void shm_tap_destroy(struct shm_tap *tap)
+{
+	if (!tap)
+		return;
+
+	munmap(tap->header, tap->size);
+	shm_unlink(tap->path);
+	bfree(tap->path);
+	bfree(tap);
+}
+
+void shm_tap_write(struct shm_tap *tap, const void *frames, size_t n_frames,
+		   uint64_t timestamp)
+{
+	struct shm_tap_header *h = tap->header;
+	const uint8_t *src = frames;
+
+	__atomic_add_fetch(&h->sequence, 1, __ATOMIC_ACQ_REL);
+
+	/* Only the latest `capacity` frames can be kept. */
+	if (n_frames > h->capacity) {
+		size_t skip = n_frames - h->capacity;
+		src += skip * h->bytes_per_frame;
+		timestamp += util_mul_div64(skip, 1000000000ULL,
+					    h->samples_per_sec);
+		h->write_index += skip;
+		n_frames = h->capacity;
+	}
+
+	size_t pos = (size_t)(h->write_index % h->capacity);
+	size_t n1 = h->capacity - pos;
+	if (n1 > n_frames)
+		n1 = n_frames;
+	memcpy(tap->ring + pos * h->bytes_per_frame, src,
+	       n1 * h->bytes_per_frame);
+	if (n1 < n_frames)
+		memcpy(tap->ring, src + n1 * h->bytes_per_frame,
+		       (n_frames - n1) * h->bytes_per_frame);
+
+	h->timestamp_index = h->write_index;
+	h->timestamp = timestamp;
+	__atomic_store_n(&h->write_index, h->write_index + n_frames,
+			 __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&h->sequence, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,115 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pulse/sample.h>
+
+#pragma once
+
+/**
+ * Shared memory tap of the captured audio
+ *
+ * The captured frames are published to a POSIX shared memory object so that
+ * other local processes can read the same audio without opening another
+ * stream on the sound server.
+ *
+ * The object is named `/dev/shm/<name>` and laid out as a `struct
+ * shm_tap_header` followed by the ring of interleaved frames, starting at
+ * offset `header_size`. All fields are in host byte order.
+ *
+ * A reader should
+ *  1. mmap the object read-only and check `magic` and `version`,
+ *  2. load `sequence`, retry if it is odd,
+ *  3. read `write_index`, `timestamp_index`, `timestamp` and the frames,
+ *  4. load `sequence` again and retry if it has changed.
+ *
+ * Frame `i` (counted since the publisher started) is stored at ring offset
+ * `(i % capacity) * bytes_per_frame`, and is valid while
+ * `write_index - capacity <= i < write_index`.
+ * Its timestamp is `timestamp + (i - timestamp_index) * 1e9 / samples_per_sec`
+ * nanoseconds on CLOCK_MONOTONIC, the same clock the frames are sent to OBS
+ * with.
+ */
+
+#define SHM_TAP_MAGIC 0x4d43504fU /* "OPCM" */
+#define SHM_TAP_VERSION 1
+
+struct shm_tap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+
+	/* pa_sample_format_t of the frames */
+	uint32_t format;
+	uint32_t samples_per_sec;
+	uint32_t channels;
+	uint32_t bytes_per_frame;
+
+	/* number of frames the ring can hold */
+	uint32_t capacity;
+
+	/* odd while the publisher is updating the ring */
+	uint32_t sequence;
+
+	/* process ID of the publisher, a ring whose publisher died is removed
+	 * by the next publisher of the same name */
+	uint32_t publisher_pid;
+
+	/* number of frames written since the publisher started */
+	uint64_t write_index;
+
+	/* timestamp of the frame at `timestamp_index` */
+	uint64_t timestamp_index;
+	uint64_t timestamp;
+};
+
+struct shm_tap;
+
+/**
+ * Create a shared memory object and initialize the header
+ *
+ * @param name name of the shared memory object without the leading slash.
+ *             An object left by a publisher that died is replaced. If the
+ *             object is in use, it is left intact and the process ID is
+ *             appended to the name, as `<name>-<pid>`, then a counter, as
+ *             `<name>-<pid>-<n>`. The final name is logged.
+ * @param spec sample spec of the frames to be published
+ * @param capacity number of frames the ring can hold
+ *
+ * @return NULL on error
+ */
+struct shm_tap *shm_tap_create(const char *name, const pa_sample_spec *spec,
+			       uint32_t capacity);
+
+/**
+ * Unmap and unlink the shared memory object
+ */
+void shm_tap_destroy(struct shm_tap *tap);
+
+/**
+ * Publish frames
+ *
+ * @param frames interleaved frames in the format given at creation
+ * @param n_frames number of frames
+ * @param timestamp timestamp of the first frame in nanoseconds
+ *
+ * @note The function does not block and is safe to call from the audio
+ *       callback.
+ */
+void shm_tap_write(struct shm_tap *tap, const void *frames, size_t n_frames,
+		   uint64_t timestamp);
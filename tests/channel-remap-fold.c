@@ -0,0 +1,127 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Destination of every input channel of the layout adapter
+ *
+ * For each channel count the adapter handles, in both modes, a frame with a
+ * single input channel set is remapped. The input has to land on exactly one
+ * output, at unity gain if it fits and at the fold gain otherwise, and only
+ * the input at the position of the LFE may reach the LFE output.
+ *
+ * Prints a line per failed check and exits with non-zero if any check failed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <obs.h>
+
+#include "channel-remap.h"
+
+#define FOLD_GAIN 0.5f
+
+static int failures = 0;
+
+static uint32_t expected_lfe(enum speaker_layout speakers)
+{
+	switch (speakers) {
+	case SPEAKERS_2POINT1:
+		return 2;
+	case SPEAKERS_4POINT1:
+	case SPEAKERS_5POINT1:
+	case SPEAKERS_7POINT1:
+		return 3;
+	default:
+		return UINT32_MAX;
+	}
+}
+
+static void check_input(struct channel_remap *remap, uint32_t channels,
+			enum channel_remap_mode mode, uint32_t input)
+{
+	float frame[PA_CHANNELS_MAX] = {0};
+	const uint8_t *planes[MAX_AUDIO_CHANNELS];
+	frame[input] = 1.0f;
+
+	const uint32_t n = channel_remap_process(remap, (const uint8_t *)frame,
+						 1, planes);
+	const uint32_t lfe = expected_lfe(channel_remap_get_speakers(remap));
+
+	uint32_t hits = 0;
+	for (uint32_t o = 0; o < n; o++) {
+		const float v = ((const float *)planes[o])[0];
+		if (v == 0.0f)
+			continue;
+		hits++;
+
+		const float gain = input < n ? 1.0f : FOLD_GAIN;
+		if (fabsf(v - gain) > 1e-6f || (input < n && o != input)) {
+			printf("FAIL %" PRIu32 " channels, mode %d: input %" PRIu32
+			       " at %g on output %" PRIu32 "\n",
+			       channels, (int)mode, input, v, o);
+			failures++;
+		}
+		if (o == lfe && input != lfe) {
+			printf("FAIL %" PRIu32 " channels, mode %d: input %" PRIu32
+			       " folded into the LFE\n",
+			       channels, (int)mode, input);
+			failures++;
+		}
+	}
+
+	if (hits != 1) {
+		printf("FAIL %" PRIu32 " channels, mode %d: input %" PRIu32
+		       " on %" PRIu32 " outputs\n",
+		       channels, (int)mode, input, hits);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	const enum channel_remap_mode modes[] = {
+		CHANNEL_REMAP_PAD,
+		CHANNEL_REMAP_FOLD,
+	};
+	const long allocs = bnum_allocs();
+	int checked = 0;
+
+	for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+		for (uint32_t ch = 1; ch <= PA_CHANNELS_MAX; ch++) {
+			struct channel_remap *remap = channel_remap_create(
+				PA_SAMPLE_FLOAT32LE, ch, modes[m], FOLD_GAIN);
+			if (!remap)
+				continue;
+
+			for (uint32_t i = 0; i < ch; i++)
+				check_input(remap, ch, modes[m], i);
+			channel_remap_destroy(remap);
+			checked++;
+		}
+	}
+
+	if (bnum_allocs() != allocs) {
+		printf("FAIL %ld allocations left\n", bnum_allocs() - allocs);
+		failures++;
+	}
+
+	printf("%d layouts checked, %d checks failed\n", checked, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/platform.h>
+#include <util/profiler.h>
+#include <obs-module.h>
+
+#include "obs-stub.h"
+
+struct obs_source {
+	char *name;
+	signal_handler_t *signals;
+	proc_handler_t *procs;
+
+	pthread_mutex_t mutex;
+	DARRAY(struct stub_audio_packet) packets;
+	bool muted;
+	bool enabled;
+};
+
+static profiler_name_store_t *name_store;
+
+void stub_obs_init(void)
+{
+	name_store = profiler_name_store_create();
+}
+
+void stub_obs_shutdown(void)
+{
+	profiler_name_store_free(name_store);
+	name_store = NULL;
+}
+
+obs_source_t *stub_source_create(const char *name)
+{
+	obs_source_t *source = bzalloc(sizeof(obs_source_t));
+	source->name = bstrdup(name);
+	source->signals = signal_handler_create();
+	source->procs = proc_handler_create();
+	pthread_mutex_init(&source->mutex, NULL);
+	source->enabled = true;
+
+	signal_handler_add(source->signals, "void mute(ptr source, bool muted)");
+	signal_handler_add(source->signals,
+			   "void enable(ptr source, bool enabled)");
+
+	return source;
+}
+
+void stub_source_destroy(obs_source_t *source)
+{
+	if (!source)
+		return;
+
+	proc_handler_destroy(source->procs);
+	signal_handler_destroy(source->signals);
+	pthread_mutex_destroy(&source->mutex);
+	da_free(source->packets);
+	bfree(source->name);
+	bfree(source);
+}
+
+static void set_state(obs_source_t *source, bool *state, bool value,
+		      const char *signal, const char *param)
+{
+	pthread_mutex_lock(&source->mutex);
+	*state = value;
+	pthread_mutex_unlock(&source->mutex);
+
+	calldata_t cd;
+	calldata_init(&cd);
+	calldata_set_ptr(&cd, "source", source);
+	calldata_set_bool(&cd, param, value);
+	signal_handler_signal(source->signals, signal, &cd);
+	calldata_free(&cd);
+}
+
+void stub_source_set_muted(obs_source_t *source, bool muted)
+{
+	set_state(source, &source->muted, muted, "mute", "muted");
+}
+
+void stub_source_set_enabled(obs_source_t *source, bool enabled)
+{
+	set_state(source, &source->enabled, enabled, "enable", "enabled");
+}
+
+size_t stub_source_take_packets(obs_source_t *source,
+				struct stub_audio_packet **packets)
+{
+	pthread_mutex_lock(&source->mutex);
+	size_t num = source->packets.num;
+	*packets = source->packets.array;
+	da_init(source->packets);
+	pthread_mutex_unlock(&source->mutex);
+
+	return num;
+}
+
+/* called by the plugin */
+
+void obs_source_output_audio(obs_source_t *source,
+			     const struct obs_source_audio *audio)
+{
+	const struct stub_audio_packet packet = {
+		.arrival = os_gettime_ns(),
+		.timestamp = audio->timestamp,
+		.frames = audio->frames,
+		.samples_per_sec = audio->samples_per_sec,
+		.speakers = audio->speakers,
+		.format = audio->format,
+	};
+
+	pthread_mutex_lock(&source->mutex);
+	da_push_back(source->packets, &packet);
+	pthread_mutex_unlock(&source->mutex);
+}
+
+const char *obs_source_get_name(const obs_source_t *source)
+{
+	return source->name;
+}
+
+signal_handler_t *obs_source_get_signal_handler(const obs_source_t *source)
+{
+	return source->signals;
+}
+
+proc_handler_t *obs_source_get_proc_handler(const obs_source_t *source)
+{
+	return source->procs;
+}
+
+bool obs_source_muted(const obs_source_t *source)
+{
+	obs_source_t *s = (obs_source_t *)source;
+
+	pthread_mutex_lock(&s->mutex);
+	const bool muted = s->muted;
+	pthread_mutex_unlock(&s->mutex);
+	return muted;
+}
+
+bool obs_source_enabled(const obs_source_t *source)
+{
+	obs_source_t *s = (obs_source_t *)source;
+
+	pthread_mutex_lock(&s->mutex);
+	const bool enabled = s->enabled;
+	pthread_mutex_unlock(&s->mutex);
+	return enabled;
+}
+
+profiler_name_store_t *obs_get_profiler_name_store(void)
+{
+	return name_store;
+}
+
+const char *obs_module_text(const char *lookup)
+{
+	return lookup;
+}
@@ -0,0 +1,78 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <obs.h>
+
+#pragma once
+
+/**
+ * Stand-in for the parts of libobs that need a running OBS
+ *
+ * The sources of the plugin are linked with libobs without calling
+ * obs_startup(). The data, properties, callbacks and utilities of libobs work
+ * as they are, and this file provides the source functions the plugin calls
+ * on its `obs_source_t`, the module locale and the profiler name store.
+ * Every packet given to obs_source_output_audio() is kept with its arrival
+ * time for the timing checks.
+ */
+
+struct stub_audio_packet {
+	/* os_gettime_ns() when the plugin emitted the packet */
+	uint64_t arrival;
+
+	uint64_t timestamp;
+	uint32_t frames;
+	uint32_t samples_per_sec;
+	enum speaker_layout speakers;
+	enum audio_format format;
+};
+
+/**
+ * Create the profiler name store, call before creating any source
+ */
+void stub_obs_init(void);
+
+void stub_obs_shutdown(void);
+
+/**
+ * Create a source with the signals and procedures of an OBS source
+ */
+obs_source_t *stub_source_create(const char *name);
+
+void stub_source_destroy(obs_source_t *source);
+
+/**
+ * Set what obs_source_muted() returns and emit the `mute` signal
+ */
+void stub_source_set_muted(obs_source_t *source, bool muted);
+
+/**
+ * Set what obs_source_enabled() returns and emit the `enable` signal
+ */
+void stub_source_set_enabled(obs_source_t *source, bool enabled);
+
+/**
+ * Take the packets emitted since the previous call
+ *
+ * @param packets set to the packets, to be freed by bfree()
+ *
+ * @return number of packets
+ */
+size_t stub_source_take_packets(obs_source_t *source,
+				struct stub_audio_packet **packets);
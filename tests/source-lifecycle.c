@@ -0,0 +1,428 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Lifecycle of the source against the libobs stand-in
+ *
+ * A 4-channel null sink is loaded and an output source recording its monitor
+ * is created, reconfigured, restarted with other channels and destroyed a few
+ * times. Each step is timed against a limit, the packets emitted to OBS are
+ * checked for their layout and the order of their timestamps, and the memory
+ * allocated through bmem has to be freed once everything is torn down. Muting
+ * and disabling the source has to stop its packets, and they have to resume
+ * after the timestamps emitted before.
+ *
+ * pulse_capture_open() is wrapped by the linker so that a start can be made
+ * to fail, which must not leave the remapping module of the server loaded.
+ *
+ * Prints a line per check and exits with non-zero if any check failed.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include <obs-module.h>
+
+#include "obs-stub.h"
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define TEST_SINK "obs_mc_lifecycle"
+#define TEST_CHANNELS 4
+#define CYCLES 5
+
+/* the capture holds back the first 500 ms of a stream */
+#define STARTUP_LIMIT_MS 2000
+#define RUN_MS 500
+
+#define CREATE_LIMIT_MS 250
+#define RECONFIGURE_LIMIT_MS 50
+#define RESTART_LIMIT_MS 250
+#define DESTROY_LIMIT_MS 250
+
+/* for the packets read before the stream was corked */
+#define INACTIVE_SETTLE_MS 100
+
+extern struct obs_source_info pulse_output_capture;
+
+static int failures = 0;
+
+/* set to make the next opens fail, the device asked is kept */
+static bool fail_open = false;
+static char *failed_device = NULL;
+
+struct pulse_capture *
+__real_pulse_capture_open(const struct pulse_capture_info *info, bool shared);
+struct pulse_capture *
+__wrap_pulse_capture_open(const struct pulse_capture_info *info, bool shared);
+
+struct pulse_capture *
+__wrap_pulse_capture_open(const struct pulse_capture_info *info, bool shared)
+{
+	if (!fail_open)
+		return __real_pulse_capture_open(info, shared);
+
+	bfree(failed_device);
+	failed_device = bstrdup(info->device);
+	return NULL;
+}
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	*(uint32_t *)userdata = idx;
+	pulse_signal(0);
+}
+
+static void module_unloaded(pa_context *c, int success, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(success);
+	UNUSED_PARAMETER(userdata);
+	pulse_signal(0);
+}
+
+static void check_result(const char *step, const char *what, bool ok,
+			 const char *format, ...)
+{
+	va_list args;
+
+	printf("%s %s %s: ", ok ? "PASS" : "FAIL", step, what);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	putchar('\n');
+	fflush(stdout);
+
+	if (!ok)
+		failures++;
+}
+
+static void check_time(const char *step, uint64_t start, uint64_t limit_ms)
+{
+	const double ms = (double)(os_gettime_ns() - start) / NSEC_PER_MSEC;
+
+	check_result(step, "time", ms <= (double)limit_ms,
+		     "%.2f ms, limit %" PRIu64 " ms", ms, limit_ms);
+}
+
+/**
+ * Wait for the packets of the source and check them
+ */
+static void check_packets(const char *step, obs_source_t *source,
+			  enum speaker_layout speakers)
+{
+	struct stub_audio_packet *packets;
+	const uint64_t start = os_gettime_ns();
+
+	/* drop what was emitted before the step */
+	stub_source_take_packets(source, &packets);
+	bfree(packets);
+
+	size_t num = 0;
+	while (os_gettime_ns() < start + STARTUP_LIMIT_MS * NSEC_PER_MSEC) {
+		os_sleep_ms(10);
+		num = stub_source_take_packets(source, &packets);
+		bfree(packets);
+		if (num)
+			break;
+	}
+	check_result(step, "startup", num > 0, "%.1f ms",
+		     (double)(os_gettime_ns() - start) / NSEC_PER_MSEC);
+	if (!num)
+		return;
+
+	os_sleep_ms(RUN_MS);
+	num = stub_source_take_packets(source, &packets);
+
+	size_t wrong_layout = 0, backwards = 0;
+	uint64_t frames = 0, next_ts = 0;
+	for (size_t i = 0; i < num; i++) {
+		const struct stub_audio_packet *p = &packets[i];
+		const uint64_t frame_ns =
+			util_mul_div64(1, NSEC_PER_SEC, p->samples_per_sec);
+
+		if (p->speakers != speakers)
+			wrong_layout++;
+		if (next_ts && p->timestamp + frame_ns < next_ts)
+			backwards++;
+		next_ts = p->timestamp + util_mul_div64(p->frames,
+							NSEC_PER_SEC,
+							p->samples_per_sec);
+		frames += p->frames;
+	}
+	bfree(packets);
+
+	check_result(step, "packets", num > 0,
+		     "%zu packets of %" PRIu64 " frames in %d ms", num, frames,
+		     RUN_MS);
+	check_result(step, "layout", !wrong_layout,
+		     "%zu packets with another layout", wrong_layout);
+	check_result(step, "monotonic", !backwards,
+		     "%zu packets went backwards", backwards);
+}
+
+/**
+ * Take the packets emitted so far
+ *
+ * @return end of the timestamps of the last packet, 0 without a packet
+ */
+static uint64_t take_packets_end(obs_source_t *source, size_t *num)
+{
+	struct stub_audio_packet *packets;
+	uint64_t end = 0;
+
+	*num = stub_source_take_packets(source, &packets);
+	if (*num) {
+		const struct stub_audio_packet *p = &packets[*num - 1];
+		end = p->timestamp + util_mul_div64(p->frames, NSEC_PER_SEC,
+						    p->samples_per_sec);
+	}
+	bfree(packets);
+	return end;
+}
+
+/**
+ * Deactivate the source, check that its packets stop, reactivate it and
+ * check that they resume after the previous ones
+ */
+static void check_inactive(const char *step, obs_source_t *source,
+			   void (*set_active)(obs_source_t *, bool),
+			   bool active, enum speaker_layout speakers)
+{
+	size_t num;
+
+	set_active(source, !active);
+	os_sleep_ms(INACTIVE_SETTLE_MS);
+	const uint64_t end = take_packets_end(source, &num);
+	os_sleep_ms(RUN_MS);
+	take_packets_end(source, &num);
+	check_result(step, "stopped", num == 0, "%zu packets in %d ms", num,
+		     RUN_MS);
+
+	const uint64_t start = os_gettime_ns();
+	set_active(source, active);
+
+	struct stub_audio_packet *packets = NULL;
+	num = 0;
+	while (!num &&
+	       os_gettime_ns() < start + STARTUP_LIMIT_MS * NSEC_PER_MSEC) {
+		os_sleep_ms(10);
+		bfree(packets);
+		num = stub_source_take_packets(source, &packets);
+	}
+	check_result(step, "resume", num > 0, "%.1f ms",
+		     (double)(os_gettime_ns() - start) / NSEC_PER_MSEC);
+	if (num) {
+		const uint64_t frame_ns = util_mul_div64(
+			1, NSEC_PER_SEC, packets[0].samples_per_sec);
+		check_result(step, "resume monotonic",
+			     packets[0].timestamp + frame_ns >= end,
+			     "%" PRId64 " ns after the last packet",
+			     (int64_t)(packets[0].timestamp - end));
+	}
+	bfree(packets);
+
+	check_packets(step, source, speakers);
+}
+
+static void source_found(pa_context *c, const pa_source_info *i, int eol,
+			 void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(i);
+	if (eol == 0)
+		*(bool *)userdata = true;
+	pulse_signal(0);
+}
+
+static long get_restarts(obs_source_t *source)
+{
+	calldata_t cd = {0};
+	proc_handler_call(obs_source_get_proc_handler(source), "get_stats",
+			  &cd);
+	long long restarts = calldata_int(&cd, "restarts");
+	calldata_free(&cd);
+	return (long)restarts;
+}
+
+static void set_channels(obs_data_t *settings, uint32_t channels)
+{
+	static const enum pa_channel_position positions[] = {
+		PA_CHANNEL_POSITION_FRONT_LEFT,
+		PA_CHANNEL_POSITION_FRONT_RIGHT,
+		PA_CHANNEL_POSITION_REAR_LEFT,
+		PA_CHANNEL_POSITION_REAR_RIGHT,
+	};
+
+	obs_data_set_int(settings, "pa_channels", channels);
+	for (uint32_t i = 0; i < channels; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "pa_map_%" PRIu32, i);
+		obs_data_set_int(settings, name, positions[i]);
+	}
+}
+
+/**
+ * Start a source picking channels on the server with the open failing
+ */
+static void run_failed_start(void)
+{
+	obs_source_t *source = stub_source_create("failed-start");
+	obs_data_t *settings = obs_data_create();
+	pulse_output_capture.get_defaults(settings);
+	obs_data_set_string(settings, "device_id", TEST_SINK ".monitor");
+	obs_data_set_bool(settings, "server_remap", true);
+	set_channels(settings, 2);
+
+	fail_open = true;
+	void *data = pulse_output_capture.create(settings, source);
+	fail_open = false;
+
+	check_result("failed start", "open", !!failed_device, "%s",
+		     failed_device ? failed_device : "not attempted");
+
+	/* the remapping source is gone with its module */
+	bool found = false;
+	if (failed_device)
+		pulse_get_source_info(source_found, failed_device, &found);
+	check_result("failed start", "remap released", !found, "%s",
+		     found ? "still loaded" : "unloaded");
+
+	pulse_output_capture.destroy(data);
+	obs_data_release(settings);
+	stub_source_destroy(source);
+
+	bfree(failed_device);
+	failed_device = NULL;
+}
+
+static void run_cycle(int cycle)
+{
+	obs_source_t *source = stub_source_create("lifecycle");
+	obs_data_t *settings = obs_data_create();
+	pulse_output_capture.get_defaults(settings);
+	obs_data_set_string(settings, "device_id", TEST_SINK ".monitor");
+	set_channels(settings, 2);
+
+	char step[32];
+	uint64_t start;
+
+	snprintf(step, sizeof(step), "%d create", cycle);
+	start = os_gettime_ns();
+	void *data = pulse_output_capture.create(settings, source);
+	check_time(step, start, CREATE_LIMIT_MS);
+	check_packets(step, source, SPEAKERS_STEREO);
+
+	/* processing settings apply without restarting the stream */
+	snprintf(step, sizeof(step), "%d reconfigure", cycle);
+	obs_data_set_bool(settings, "shm_tap", true);
+	obs_data_set_int(settings, "layout_adapter", 1);
+	start = os_gettime_ns();
+	pulse_output_capture.update(data, settings);
+	check_time(step, start, RECONFIGURE_LIMIT_MS);
+	check_result(step, "restarts", get_restarts(source) == 0, "%ld",
+		     get_restarts(source));
+	check_packets(step, source, SPEAKERS_STEREO);
+
+	snprintf(step, sizeof(step), "%d restart", cycle);
+	set_channels(settings, TEST_CHANNELS);
+	start = os_gettime_ns();
+	pulse_output_capture.update(data, settings);
+	check_time(step, start, RESTART_LIMIT_MS);
+	check_result(step, "restarts", get_restarts(source) == 1, "%ld",
+		     get_restarts(source));
+	check_packets(step, source, SPEAKERS_4POINT0);
+
+	/* the stream is corked and uncorked */
+	snprintf(step, sizeof(step), "%d mute", cycle);
+	check_inactive(step, source, stub_source_set_muted, false,
+		       SPEAKERS_4POINT0);
+
+	snprintf(step, sizeof(step), "%d disable", cycle);
+	check_inactive(step, source, stub_source_set_enabled, true,
+		       SPEAKERS_4POINT0);
+
+	snprintf(step, sizeof(step), "%d destroy", cycle);
+	start = os_gettime_ns();
+	pulse_output_capture.destroy(data);
+	check_time(step, start, DESTROY_LIMIT_MS);
+
+	obs_data_release(settings);
+	stub_source_destroy(source);
+}
+
+int main(void)
+{
+	base_set_log_handler(log_to_stderr, NULL);
+
+	/* anything allocated from here has to be freed at the end */
+	const long allocs = bnum_allocs();
+
+	stub_obs_init();
+	pulse_init();
+	event_log_start();
+
+	char arg[128];
+	snprintf(arg, sizeof(arg),
+		 "sink_name=" TEST_SINK " format=float32le rate=48000 "
+		 "channels=%d",
+		 TEST_CHANNELS);
+
+	uint32_t module = PA_INVALID_INDEX;
+	pulse_load_module("module-null-sink", arg, module_loaded, &module);
+	check_result("sink", "load", module != PA_INVALID_INDEX, "%s", arg);
+
+	for (int i = 1; module != PA_INVALID_INDEX && i <= CYCLES; i++)
+		run_cycle(i);
+
+	if (module != PA_INVALID_INDEX)
+		run_failed_start();
+
+	if (module != PA_INVALID_INDEX)
+		pulse_unload_module(module, module_unloaded, NULL);
+
+	event_log_stop();
+	pulse_unref();
+	stub_obs_shutdown();
+
+	check_result("all", "leaks", bnum_allocs() == allocs,
+		     "%ld allocations left", bnum_allocs() - allocs);
+
+	printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * End-to-end check of the capture against a server without hardware
+ *
+ * A 6-channel null sink is loaded and a playback stream writes a constant
+ * level to each of its channels, channel k getting (k + 1) / 8. The monitor
+ * is recorded with its own channels and with a few channel selections, and
+ * each capture is checked for the channel count and the routing of the
+ * levels, the time until the first packet, the frames delivered and the
+ * order of the timestamps.
+ *
+ * Prints a line per check and exits with non-zero if any check failed.
+ *
+ * usage: capture-check [seconds-per-case]
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define CHECK_SINK "obs_mc_check"
+#define CHECK_RATE 48000
+#define CHECK_CHANNELS 6
+
+/* the capture holds back the first 500 ms of a stream */
+#define STARTUP_LIMIT_MS 2000
+
+#define LEVEL_TOLERANCE 1e-3f
+
+struct check_case {
+	const char *name;
+
+	/* channels to record, NULL for those of the device */
+	const char *positions;
+};
+
+static const struct check_case cases[] = {
+	{"native", NULL},
+	{"pick", "aux5,aux1"},
+	{"single", "aux3"},
+};
+
+struct check {
+	float expected[PA_CHANNELS_MAX];
+	uint32_t channels;
+
+	/* accessed from the mainloop */
+	uint64_t first_arrival;
+	uint64_t next_ts;
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t level_frames;
+	uint64_t wrong_frames;
+	uint64_t wrong_format;
+	uint64_t backwards;
+};
+
+static int failures = 0;
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	*(uint32_t *)userdata = idx;
+	pulse_signal(0);
+}
+
+static void module_unloaded(pa_context *c, int success, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(success);
+	UNUSED_PARAMETER(userdata);
+	pulse_signal(0);
+}
+
+static inline float sink_level(uint32_t channel)
+{
+	return (float)(channel + 1) / 8.0f;
+}
+
+static void check_result(const char *name, const char *what, bool ok,
+			 const char *format, ...)
+{
+	va_list args;
+
+	printf("%s %s %s: ", ok ? "PASS" : "FAIL", name, what);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	putchar('\n');
+	fflush(stdout);
+
+	if (!ok)
+		failures++;
+}
+
+/**
+ * Write the level of each channel to the sink
+ */
+static void player_write(pa_stream *s, size_t nbytes, void *userdata)
+{
+	UNUSED_PARAMETER(userdata);
+	const size_t frames = nbytes / (sizeof(float) * CHECK_CHANNELS);
+	float *buf = bmalloc(frames * sizeof(float) * CHECK_CHANNELS);
+
+	for (size_t i = 0; i < frames; i++) {
+		for (uint32_t c = 0; c < CHECK_CHANNELS; c++)
+			buf[i * CHECK_CHANNELS + c] = sink_level(c);
+	}
+
+	pa_stream_write(s, buf, frames * sizeof(float) * CHECK_CHANNELS, NULL,
+			0, PA_SEEK_RELATIVE);
+	bfree(buf);
+}
+
+static void check_packet(void *param,
+			 const struct pulse_capture_packet *packet)
+{
+	struct check *ck = param;
+	const uint64_t frame_ns = util_mul_div64(1, NSEC_PER_SEC,
+						 packet->samples_per_sec);
+
+	if (!ck->first_arrival)
+		ck->first_arrival = os_gettime_ns();
+
+	if (ck->next_ts && packet->timestamp + frame_ns < ck->next_ts)
+		ck->backwards++;
+	ck->next_ts = packet->timestamp +
+		      util_mul_div64(packet->frames, NSEC_PER_SEC,
+				     packet->samples_per_sec);
+
+	ck->packets++;
+	ck->frames += packet->frames;
+
+	if (packet->format != PA_SAMPLE_FLOAT32LE ||
+	    packet->channels != ck->channels) {
+		ck->wrong_format++;
+		return;
+	}
+
+	/* silence until the playback stream started */
+	const float *f = (const float *)packet->data;
+	for (uint32_t i = 0; i < packet->frames; i++, f += ck->channels) {
+		bool silent = true, match = true;
+		for (uint32_t c = 0; c < ck->channels; c++) {
+			if (f[c] != 0.0f)
+				silent = false;
+			if (fabsf(f[c] - ck->expected[c]) > LEVEL_TOLERANCE)
+				match = false;
+		}
+		if (match)
+			ck->level_frames++;
+		else if (!silent)
+			ck->wrong_frames++;
+	}
+}
+
+static void run_case(const struct check_case *cc, uint64_t seconds)
+{
+	struct check ck = {0};
+	pa_channel_map map;
+
+	if (cc->positions) {
+		pa_channel_map_parse(&map, cc->positions);
+		ck.channels = map.channels;
+		for (uint32_t c = 0; c < map.channels; c++)
+			ck.expected[c] =
+				sink_level(map.map[c] - PA_CHANNEL_POSITION_AUX0);
+	} else {
+		ck.channels = CHECK_CHANNELS;
+		for (uint32_t c = 0; c < CHECK_CHANNELS; c++)
+			ck.expected[c] = sink_level(c);
+	}
+
+	struct pulse_capture_info info = {
+		.name = "capture-check",
+		.device = CHECK_SINK ".monitor",
+		.input = false,
+		.channel_map = cc->positions ? &map : NULL,
+	};
+
+	const uint64_t start = os_gettime_ns();
+	struct pulse_capture *cap = pulse_capture_open(&info, false);
+	check_result(cc->name, "open", !!cap, "%s",
+		     cc->positions ? cc->positions : "device channels");
+	if (!cap)
+		return;
+
+	pa_sample_spec spec;
+	pulse_capture_get_sample_spec(cap, &spec);
+	check_result(cc->name, "channels", spec.channels == ck.channels,
+		     "%d, expected %" PRIu32, (int)spec.channels, ck.channels);
+
+	pulse_capture_add_callback(cap, check_packet, &ck);
+
+	uint64_t first_arrival = 0;
+	while (!first_arrival &&
+	       os_gettime_ns() < start + STARTUP_LIMIT_MS * NSEC_PER_MSEC) {
+		os_sleep_ms(10);
+		pulse_lock();
+		first_arrival = ck.first_arrival;
+		pulse_unlock();
+	}
+	check_result(cc->name, "startup", !!first_arrival, "%.1f ms",
+		     first_arrival
+			     ? (double)(first_arrival - start) / NSEC_PER_MSEC
+			     : -1.0);
+
+	os_sleep_ms((uint32_t)(seconds * 1000));
+
+	pulse_capture_remove_callback(cap, check_packet, &ck);
+	const uint64_t end = os_gettime_ns();
+
+	struct pulse_capture_stats stats;
+	pulse_capture_get_stats(cap, &stats);
+	pulse_capture_release(cap);
+
+	/* the callback is removed, the counters are ours again */
+	const uint64_t expected_frames =
+		first_arrival ? util_mul_div64(end - first_arrival, CHECK_RATE,
+					       NSEC_PER_SEC)
+			      : 0;
+	check_result(cc->name, "frames",
+		     ck.frames * 10 >= expected_frames * 9 &&
+			     ck.frames <= expected_frames * 11 / 10 +
+						  CHECK_RATE / 10,
+		     "%" PRIu64 " in %" PRIu64 " packets, about %" PRIu64
+		     " expected",
+		     ck.frames, ck.packets, expected_frames);
+	check_result(cc->name, "format", !ck.wrong_format,
+		     "%" PRIu64 " packets not float with %" PRIu32 " channels",
+		     ck.wrong_format, ck.channels);
+	check_result(cc->name, "routing", ck.level_frames && !ck.wrong_frames,
+		     "%" PRIu64 " frames with the expected levels, %" PRIu64
+		     " wrong",
+		     ck.level_frames, ck.wrong_frames);
+	check_result(cc->name, "monotonic", !ck.backwards && !stats.backwards,
+		     "%" PRIu64 " packets went backwards, %" PRIu32
+		     " in the capture",
+		     ck.backwards, stats.backwards);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seconds = argc > 1 ? strtoull(argv[1], NULL, 10) : 3;
+	if (!seconds)
+		seconds = 3;
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	pulse_init();
+	event_log_start();
+
+	char arg[256];
+	snprintf(arg, sizeof(arg),
+		 "sink_name=" CHECK_SINK " format=float32le rate=%d "
+		 "channels=%d channel_map=aux0,aux1,aux2,aux3,aux4,aux5",
+		 CHECK_RATE, CHECK_CHANNELS);
+
+	uint32_t module = PA_INVALID_INDEX;
+	pulse_load_module("module-null-sink", arg, module_loaded, &module);
+	check_result("sink", "load", module != PA_INVALID_INDEX, "%s", arg);
+	if (module == PA_INVALID_INDEX)
+		goto unref;
+
+	pa_sample_spec spec = {PA_SAMPLE_FLOAT32LE, CHECK_RATE,
+			       CHECK_CHANNELS};
+	pa_channel_map map;
+	pa_channel_map_init_extend(&map, CHECK_CHANNELS, PA_CHANNEL_MAP_AUX);
+
+	pa_stream *player = pulse_stream_new("capture-check", &spec, &map);
+	if (player) {
+		pulse_lock();
+		pa_stream_set_write_callback(player, player_write, NULL);
+		int ret = pa_stream_connect_playback(player, CHECK_SINK, NULL,
+						     0, NULL, NULL);
+		pulse_unlock();
+		check_result("sink", "playback", ret == 0, "connected");
+	} else {
+		check_result("sink", "playback", false, "no stream");
+	}
+
+	for (size_t i = 0; player && i < sizeof(cases) / sizeof(*cases); i++)
+		run_case(&cases[i], seconds);
+
+	if (player) {
+		pulse_lock();
+		pa_stream_set_write_callback(player, NULL, NULL);
+		pa_stream_disconnect(player);
+		pa_stream_unref(player);
+		pulse_unlock();
+	}
+
+	pulse_unload_module(module, module_unloaded, NULL);
+
+unref:
+	event_log_stop();
+	pulse_unref();
+
+	printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Fuzz target of the read path of the capture
+ *
+ * The input is a list of 4-byte operations fed to pulse_capture_replay():
+ * packets of any size including partial frames and zero-length peeks, holes,
+ * suspends, corks and flushes, with a jitter of the arrival time. The frames
+ * of the mock stream carry their own index, so the callback checks that
+ * every frame it gets is whole and aligned, that the frames follow each
+ * other until a hole, a suspend or a flush, that no frame is lost at the end
+ * and that the timestamps go backwards by no more than the jitter and the
+ * latency. No callback may come after the callback was removed. A failed
+ * check aborts.
+ *
+ * Built with libFuzzer when the compiler is clang. Otherwise, or with
+ * CAPTURE_FUZZ_STANDALONE, `capture-fuzz [iterations] [seed]` runs random
+ * inputs and `capture-fuzz file...` runs the given inputs.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+
+#include "pulse-capture.h"
+#include "pulse-wrapper.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define FUZZ_RATE 48000
+#define FUZZ_CHANNELS 3
+#define FUZZ_BPF (FUZZ_CHANNELS * sizeof(int32_t))
+
+/* large enough for the biggest packet of an operation */
+#define STREAM_FRAMES (1 << 20)
+
+#define OP_SIZE 4
+
+#define JITTER_MAX_MS 15
+#define LATENCY_MS 20
+
+/* The timeline takes the least delayed packets as the truth, so a timestamp
+ * may step back by the jitter of the arrival, and by the latency when the
+ * stream gets its timing info after a flush. */
+#define BACKWARDS_MAX_NS ((JITTER_MAX_MS + LATENCY_MS) * NSEC_PER_MSEC)
+
+#define CHECK(cond)                                                       \
+	do {                                                              \
+		if (!(cond)) {                                            \
+			fprintf(stderr, "%s:%d: check failed: %s\n",      \
+				__FILE__, __LINE__, #cond);               \
+			abort();                                          \
+		}                                                         \
+	} while (0)
+
+struct fuzz_state {
+	/* set by the operations, cleared by the callback */
+	bool discontinuity;
+	bool hole;
+	bool removed;
+
+	uint64_t next_frame;
+	uint64_t last_ts;
+	uint64_t frames;
+	bool started;
+};
+
+static int32_t *stream;
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_ERROR)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void fuzz_init(void)
+{
+	base_set_log_handler(log_to_stderr, NULL);
+
+	/* the read path runs with the mainloop locked */
+	pulse_init();
+	event_log_start();
+
+	stream = bmalloc(STREAM_FRAMES * FUZZ_BPF);
+	for (size_t i = 0; i < STREAM_FRAMES * FUZZ_CHANNELS; i++)
+		stream[i] = (int32_t)i;
+}
+
+static void fuzz_packet(void *param,
+			const struct pulse_capture_packet *packet)
+{
+	struct fuzz_state *st = param;
+	const int32_t *s = (const int32_t *)packet->data;
+
+	CHECK(!st->removed);
+	CHECK(packet->frames > 0);
+	CHECK(packet->bytes_per_frame == FUZZ_BPF);
+
+	if (st->started)
+		CHECK(packet->timestamp + BACKWARDS_MAX_NS >= st->last_ts);
+	st->last_ts = packet->timestamp;
+	st->frames += packet->frames;
+
+	/* the frame across the end of a hole is partly silence */
+	const uint32_t skip = st->hole ? 1 : 0;
+	st->hole = false;
+	if (skip >= packet->frames)
+		return;
+
+	/* whole frames starting on a frame boundary of the stream */
+	for (uint32_t i = skip; i < packet->frames; i++) {
+		const int32_t *frame = s + (size_t)i * FUZZ_CHANNELS;
+		CHECK(frame[0] % FUZZ_CHANNELS == 0);
+		for (uint32_t c = 1; c < FUZZ_CHANNELS; c++)
+			CHECK(frame[c] == frame[0] + (int32_t)c);
+		if (i > skip)
+			CHECK(frame[0] == frame[-FUZZ_CHANNELS] + FUZZ_CHANNELS);
+	}
+
+	const uint64_t first =
+		(uint64_t)s[skip * FUZZ_CHANNELS] / FUZZ_CHANNELS - skip;
+	if (st->started && !st->discontinuity)
+		CHECK(first == st->next_frame);
+	if (st->started)
+		CHECK(first >= st->next_frame);
+
+	st->next_frame = first + packet->frames;
+	st->discontinuity = false;
+	st->started = true;
+}
+
+static void fuzz_run(const uint8_t *data, size_t size)
+{
+	const struct capture_trace_header hdr = {
+		.magic = CAPTURE_TRACE_MAGIC,
+		.version = CAPTURE_TRACE_VERSION,
+		.format = PA_SAMPLE_S32LE,
+		.samples_per_sec = FUZZ_RATE,
+		.channels = FUZZ_CHANNELS,
+		.bytes_per_frame = FUZZ_BPF,
+	};
+	const uint64_t t0 = 1000 * NSEC_PER_SEC;
+	const size_t stream_bytes = STREAM_FRAMES * FUZZ_BPF;
+
+	struct fuzz_state st = {0};
+	struct pulse_capture *cap = pulse_capture_open_replay("fuzz", &hdr);
+	pulse_capture_add_callback(cap, fuzz_packet, &st);
+
+	/* position of the mock stream in bytes */
+	size_t pos = 0;
+	bool flushing = false;
+	uint64_t time = t0;
+
+	/* the latency is unknown until the first timing update of the stream
+	 * and again after a flush, it does not come and go in between */
+	bool latency_known = false;
+
+	pulse_lock();
+	for (size_t i = 0; i + OP_SIZE <= size; i += OP_SIZE) {
+		const uint8_t *op = data + i;
+		const size_t bytes = (size_t)op[1] | (size_t)(op[2] & 0x3f)
+							     << 8;
+		const uint64_t jitter =
+			(uint64_t)op[3] % (JITTER_MAX_MS + 1) * NSEC_PER_MSEC;
+
+		/* the callbacks are late by up to the jitter, never early */
+		const uint64_t arrival =
+			t0 +
+			util_mul_div64(pos / FUZZ_BPF, NSEC_PER_SEC,
+				       FUZZ_RATE) +
+			jitter;
+		if (arrival > time)
+			time = arrival;
+		if (op[3] & 0x80)
+			latency_known = true;
+
+		struct capture_trace_record rec = {
+			.time = time,
+			.latency = latency_known ? LATENCY_MS * NSEC_PER_MSEC : -1,
+			.bytes = (uint32_t)bytes,
+		};
+
+		switch (op[0] % 8) {
+		default:
+			if (pos + bytes > stream_bytes)
+				goto done;
+			rec.type = CAPTURE_TRACE_PACKET;
+			pulse_capture_replay(cap, &rec,
+					     (const uint8_t *)stream + pos);
+			pos += bytes;
+			break;
+		case 3:
+			if (pos + bytes > stream_bytes)
+				goto done;
+			rec.type = CAPTURE_TRACE_HOLE;
+			pulse_capture_replay(cap, &rec, NULL);
+			pos += bytes;
+			st.discontinuity = true;
+			st.hole = true;
+			break;
+		case 4:
+			rec.type = op[1] & 1 ? CAPTURE_TRACE_RESUME
+					     : CAPTURE_TRACE_SUSPEND;
+			pulse_capture_replay(cap, &rec, NULL);
+			st.discontinuity = true;
+			break;
+		case 5:
+			rec.type = op[1] & 1 ? CAPTURE_TRACE_UNCORK
+					     : CAPTURE_TRACE_CORK;
+			pulse_capture_replay(cap, &rec, NULL);
+			st.discontinuity = true;
+			break;
+		case 6:
+			/* the server completes only the flush it was asked */
+			if (!flushing)
+				continue;
+			rec.type = CAPTURE_TRACE_FLUSHED;
+			pulse_capture_replay(cap, &rec, NULL);
+			st.discontinuity = true;
+			break;
+		}
+
+		/* the frames after a flush start on a frame boundary */
+		if (rec.type == CAPTURE_TRACE_RESUME ||
+		    rec.type == CAPTURE_TRACE_UNCORK) {
+			flushing = true;
+			latency_known = false;
+		} else if (rec.type == CAPTURE_TRACE_FLUSHED) {
+			pos += (FUZZ_BPF - pos % FUZZ_BPF) % FUZZ_BPF;
+			flushing = false;
+		}
+	}
+done:
+	pulse_unlock();
+
+	/* no frame is lost at the end of a continuous run */
+	if (st.started && !st.discontinuity && !flushing)
+		CHECK(st.next_frame == pos / FUZZ_BPF);
+
+	pulse_capture_remove_callback(cap, fuzz_packet, &st);
+	st.removed = true;
+
+	/* the callback must not be called after it was removed */
+	if (pos + FUZZ_BPF * 64 <= stream_bytes) {
+		const struct capture_trace_record rec = {
+			.type = CAPTURE_TRACE_PACKET,
+			.bytes = FUZZ_BPF * 64,
+			.time = time + NSEC_PER_SEC,
+			.latency = 0,
+		};
+		pulse_lock();
+		pulse_capture_replay(cap, &rec, (const uint8_t *)stream + pos);
+		pulse_unlock();
+	}
+
+	pulse_capture_release(cap);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (!stream)
+		fuzz_init();
+
+	fuzz_run(data, size);
+	return 0;
+}
+
+#ifdef CAPTURE_FUZZ_STANDALONE
+static void run_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Unable to open '%s'\n", path);
+		exit(1);
+	}
+
+	uint8_t *data = NULL;
+	size_t size = 0, capacity = 0, n;
+	do {
+		if (size == capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			data = brealloc(data, capacity);
+		}
+		n = fread(data + size, 1, capacity - size, file);
+		size += n;
+	} while (n);
+	fclose(file);
+
+	LLVMFuzzerTestOneInput(data, size);
+	bfree(data);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strtoul(argv[1], NULL, 10)) {
+		for (int i = 1; i < argc; i++)
+			run_file(argv[i]);
+		return 0;
+	}
+
+	const unsigned long iterations =
+		argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	srand(argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1);
+
+	uint8_t data[OP_SIZE * 512];
+	for (unsigned long it = 0; it < iterations; it++) {
+		const size_t size = (size_t)rand() % sizeof(data);
+		for (size_t i = 0; i < size; i++)
+			data[i] = (uint8_t)rand();
+		LLVMFuzzerTestOneInput(data, size);
+	}
+
+	printf("%lu inputs passed\n", iterations);
+	return 0;
+}
+#endif
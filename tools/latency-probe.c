@@ -0,0 +1,327 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Loopback measurement of the timestamps given to OBS
+ *
+ * Impulses are played into a null sink and its monitor is recorded through
+ * the plugin's capture. The time each impulse is played is computed from the
+ * latency of the playback stream, and compared with the timestamp the capture
+ * gives to the impulse. A perfect capture would give an error of zero.
+ *
+ * usage: latency-probe [impulses-per-profile]
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define PROBE_SINK "obs_mc_latency_probe"
+#define PROBE_RATE 48000
+#define IMPULSE_INTERVAL (PROBE_RATE / 4)
+#define IMPULSE_LEVEL 0.9f
+#define IMPULSE_THRESHOLD 0.5f
+#define MAX_IMPULSES 4096
+
+/* target latencies of the playback stream in milliseconds */
+static const uint32_t profiles[] = {5, 10, 25, 50, 100, 200};
+
+struct probe {
+	pa_stream *stream;
+	size_t n_impulses;
+
+	/* playback, accessed from the mainloop */
+	uint64_t written;
+	uint64_t next_impulse;
+	uint64_t played[MAX_IMPULSES];
+	size_t n_played;
+
+	/* capture, accessed from the mainloop */
+	uint64_t captured[MAX_IMPULSES];
+	size_t n_captured;
+};
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	*(uint32_t *)userdata = idx;
+	pulse_signal(0);
+}
+
+static void module_unloaded(pa_context *c, int success, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(success);
+	UNUSED_PARAMETER(userdata);
+	pulse_signal(0);
+}
+
+/**
+ * Write silence with impulses, remembering when each impulse will be played
+ *
+ * The latency of a playback stream is the time until the frame at the write
+ * index is played.
+ */
+static void probe_write(pa_stream *s, size_t nbytes, void *userdata)
+{
+	struct probe *pr = userdata;
+	const size_t frames = nbytes / sizeof(float);
+	float *buf = bzalloc(frames * sizeof(float));
+
+	pa_usec_t usec;
+	int negative;
+	const bool timed = pa_stream_get_latency(s, &usec, &negative) == 0;
+	const uint64_t play_time =
+		os_gettime_ns() + (timed && !negative ? usec * 1000 : 0);
+
+	while (pr->next_impulse < pr->written + frames) {
+		const uint64_t offset = pr->next_impulse - pr->written;
+		if (timed && pr->n_played < pr->n_impulses) {
+			buf[offset] = IMPULSE_LEVEL;
+			pr->played[pr->n_played++] =
+				play_time +
+				util_mul_div64(offset, NSEC_PER_SEC, PROBE_RATE);
+		}
+		pr->next_impulse += IMPULSE_INTERVAL;
+	}
+
+	pa_stream_write(s, buf, frames * sizeof(float), NULL, 0,
+			PA_SEEK_RELATIVE);
+	pr->written += frames;
+	bfree(buf);
+}
+
+static float sample_value(const struct pulse_capture_packet *packet,
+			  uint32_t frame)
+{
+	const uint8_t *p = packet->data + frame * packet->bytes_per_frame;
+
+	switch (packet->format) {
+	case PA_SAMPLE_FLOAT32LE:
+		return *(const float *)p;
+	case PA_SAMPLE_S16LE:
+		return (float)*(const int16_t *)p / 32768.0f;
+	case PA_SAMPLE_S32LE:
+		return (float)*(const int32_t *)p / 2147483648.0f;
+	case PA_SAMPLE_U8:
+		return ((float)*p - 128.0f) / 128.0f;
+	default:
+		return 0.0f;
+	}
+}
+
+static void probe_capture(void *param,
+			  const struct pulse_capture_packet *packet)
+{
+	struct probe *pr = param;
+
+	for (uint32_t i = 0; i < packet->frames; i++) {
+		if (sample_value(packet, i) < IMPULSE_THRESHOLD)
+			continue;
+		if (pr->n_captured >= MAX_IMPULSES)
+			return;
+		pr->captured[pr->n_captured++] =
+			packet->timestamp +
+			util_mul_div64(i, NSEC_PER_SEC,
+				       packet->samples_per_sec);
+	}
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *sorted, size_t n, double p)
+{
+	size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+	return (double)sorted[i] / NSEC_PER_MSEC;
+}
+
+/**
+ * Pair each captured impulse with the nearest played one and print the
+ * distribution of the errors
+ */
+static void probe_report(struct probe *pr, uint32_t profile_ms)
+{
+	int64_t *errors = bzalloc(sizeof(int64_t) * (pr->n_captured + 1));
+	size_t n = 0;
+	const int64_t max_distance =
+		IMPULSE_INTERVAL * (NSEC_PER_SEC / PROBE_RATE) / 2;
+
+	for (size_t i = 0; i < pr->n_captured; i++) {
+		int64_t best = INT64_MAX;
+		for (size_t j = 0; j < pr->n_played; j++) {
+			int64_t e = (int64_t)pr->captured[i] -
+				    (int64_t)pr->played[j];
+			if (llabs(e) < llabs(best))
+				best = e;
+		}
+		if (llabs(best) < max_distance)
+			errors[n++] = best;
+	}
+
+	if (!n) {
+		printf("%7" PRIu32 " ms %9s\n", profile_ms, "no impulse");
+		bfree(errors);
+		return;
+	}
+
+	qsort(errors, n, sizeof(int64_t), compare_int64);
+	printf("%7" PRIu32 " ms %4zu/%-4zu %9.3f %9.3f %9.3f %9.3f\n",
+	       profile_ms, n, pr->n_played, (double)errors[0] / NSEC_PER_MSEC,
+	       percentile_ms(errors, n, 0.5), percentile_ms(errors, n, 0.99),
+	       (double)errors[n - 1] / NSEC_PER_MSEC);
+	bfree(errors);
+}
+
+static void run_profile(uint32_t profile_ms, size_t impulses)
+{
+	struct probe *pr = bzalloc(sizeof(struct probe));
+	pr->n_impulses = impulses;
+	pr->next_impulse = PROBE_RATE / 2;
+
+	struct pulse_capture_info info = {
+		.name = "latency-probe",
+		.device = PROBE_SINK ".monitor",
+		.input = false,
+	};
+	struct pulse_capture *cap = pulse_capture_open(&info, false);
+	if (!cap) {
+		bfree(pr);
+		return;
+	}
+	pulse_capture_add_callback(cap, probe_capture, pr);
+
+	/* let the capture pass its startup period before playing */
+	os_sleep_ms(1000);
+
+	pa_sample_spec spec = {PA_SAMPLE_FLOAT32LE, PROBE_RATE, 1};
+	pa_buffer_attr attr = {
+		.maxlength = (uint32_t)-1,
+		.tlength = (uint32_t)pa_usec_to_bytes(
+			profile_ms * PA_USEC_PER_MSEC, &spec),
+		.prebuf = (uint32_t)-1,
+		.minreq = (uint32_t)-1,
+		.fragsize = (uint32_t)-1,
+	};
+
+	pr->stream = pulse_stream_new("latency-probe", &spec, NULL);
+	if (!pr->stream)
+		goto release;
+
+	pulse_lock();
+	pa_stream_set_write_callback(pr->stream, probe_write, pr);
+	int ret = pa_stream_connect_playback(
+		pr->stream, PROBE_SINK, &attr,
+		PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+			PA_STREAM_AUTO_TIMING_UPDATE,
+		NULL, NULL);
+	pulse_unlock();
+
+	if (ret == 0) {
+		const uint64_t timeout =
+			os_gettime_ns() +
+			impulses * IMPULSE_INTERVAL * (NSEC_PER_SEC / PROBE_RATE) +
+			5 * NSEC_PER_SEC;
+		for (;;) {
+			pulse_lock();
+			bool done = pr->n_played >= impulses &&
+				    pr->n_captured >= pr->n_played;
+			pulse_unlock();
+			if (done || os_gettime_ns() > timeout)
+				break;
+			os_sleep_ms(100);
+		}
+	}
+
+	pulse_lock();
+	pa_stream_set_write_callback(pr->stream, NULL, NULL);
+	pa_stream_disconnect(pr->stream);
+	pa_stream_unref(pr->stream);
+	pulse_unlock();
+
+release:
+	pulse_capture_remove_callback(cap, probe_capture, pr);
+	pulse_capture_release(cap);
+
+	probe_report(pr, profile_ms);
+	bfree(pr);
+}
+
+int main(int argc, char **argv)
+{
+	size_t impulses = argc > 1 ? strtoul(argv[1], NULL, 10) : 40;
+	if (!impulses || impulses > MAX_IMPULSES)
+		impulses = 40;
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	pulse_init();
+	event_log_start();
+
+	uint32_t module = PA_INVALID_INDEX;
+	pulse_load_module("module-null-sink",
+			  "sink_name=" PROBE_SINK
+			  " format=float32le rate=48000 channels=1",
+			  module_loaded, &module);
+	if (module == PA_INVALID_INDEX) {
+		fprintf(stderr, "Unable to load module-null-sink\n");
+		event_log_stop();
+		pulse_unref();
+		return 1;
+	}
+
+	printf("timestamp error of the captured impulses in ms\n");
+	printf("%10s %9s %9s %9s %9s %9s\n", "playback", "impulses", "min",
+	       "p50", "p99", "max");
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(*profiles); i++)
+		run_profile(profiles[i], impulses);
+
+	pulse_unload_module(module, module_unloaded, NULL);
+	event_log_stop();
+	pulse_unref();
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Run a command against a private PulseAudio server without any device
+#
+# usage: private-pulse.sh command [args...]
+
+set -e
+
+dir=$(mktemp -d)
+pid=
+cleanup() {
+	if [ -n "$pid" ]; then
+		kill "$pid" 2>/dev/null || :
+		wait "$pid" 2>/dev/null || :
+	fi
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+HOME="$dir" XDG_RUNTIME_DIR="$dir" XDG_CONFIG_HOME="$dir" \
+	pulseaudio -n --daemonize=no --exit-idle-time=-1 --use-pid-file=no \
+	--log-target=stderr --log-level=warning \
+	--load="module-native-protocol-unix socket=$dir/native auth-anonymous=1" &
+pid=$!
+
+i=0
+while [ ! -S "$dir/native" ]; do
+	i=$((i + 1))
+	if [ $i -gt 100 ] || ! kill -0 "$pid" 2>/dev/null; then
+		echo "Unable to start pulseaudio" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+PULSE_SERVER="unix:$dir/native" "$@"
@@ -0,0 +1,327 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Probe of the devices and of a capture before OBS is involved
+ *
+ * usage: pulse-mc-probe list
+ *        pulse-mc-probe capture [options] device
+ *
+ * options of capture:
+ *   --output          record the monitor of a sink, device is the sink
+ *   --seconds N       duration of the capture, default 10
+ *   --fragsize MS     fragment size requested from the server, default 25
+ *   --maxlength MS    maximum length of the server buffer
+ *   --channels MAP    channels to request, e.g. "aux0,aux1"
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+struct probe_capture {
+	/* accessed from the mainloop */
+	uint64_t last_arrival;
+	uint64_t last_duration;
+	uint32_t min_frames;
+	uint32_t max_frames;
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t mainloop_cpu;
+	DARRAY(int64_t) jitter;
+};
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void print_device(const char *name, const char *description,
+			 const pa_sample_spec *spec, const pa_channel_map *map)
+{
+	char s[PA_SAMPLE_SPEC_SNPRINT_MAX];
+	char m[PA_CHANNEL_MAP_SNPRINT_MAX];
+
+	pa_sample_spec_snprint(s, sizeof(s), spec);
+	pa_channel_map_snprint(m, sizeof(m), map);
+	printf("%s\n  %s\n  %s\n  %s\n", name, description, s, m);
+}
+
+static void list_source(pa_context *c, const pa_source_info *i, int eol,
+			void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(userdata);
+	if (eol != 0 || i->monitor_of_sink != PA_INVALID_INDEX)
+		goto skip;
+
+	print_device(i->name, i->description, &i->sample_spec,
+		     &i->channel_map);
+
+skip:
+	pulse_signal(0);
+}
+
+static void list_sink(pa_context *c, const pa_sink_info *i, int eol,
+		      void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(userdata);
+	if (eol != 0)
+		goto skip;
+
+	print_device(i->name, i->description, &i->sample_spec,
+		     &i->channel_map);
+
+skip:
+	pulse_signal(0);
+}
+
+static int list_devices(void)
+{
+	printf("# sources\n");
+	if (pulse_get_source_info_list(list_source, NULL) < 0)
+		return 1;
+
+	printf("# sinks, recorded with --output\n");
+	if (pulse_get_sink_info_list(list_sink, NULL) < 0)
+		return 1;
+
+	return 0;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t process_cpu_ns(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		       NSEC_PER_SEC +
+	       (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+/**
+ * Record the size of each packet and how far its arrival deviates from the
+ * length of the previous packet
+ */
+static void probe_packet(void *param, const struct pulse_capture_packet *packet)
+{
+	struct probe_capture *pc = param;
+	const uint64_t now = os_gettime_ns();
+
+	pc->mainloop_cpu = thread_cpu_ns();
+
+	if (pc->last_arrival) {
+		int64_t jitter = (int64_t)(now - pc->last_arrival) -
+				 (int64_t)pc->last_duration;
+		da_push_back(pc->jitter, &jitter);
+	}
+
+	if (!pc->packets || packet->frames < pc->min_frames)
+		pc->min_frames = packet->frames;
+	if (packet->frames > pc->max_frames)
+		pc->max_frames = packet->frames;
+
+	pc->packets++;
+	pc->frames += packet->frames;
+	pc->last_arrival = now;
+	pc->last_duration = util_mul_div64(packet->frames, NSEC_PER_SEC,
+					   packet->samples_per_sec);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *sorted, size_t n, double p)
+{
+	if (!n)
+		return 0.0;
+	size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+	return (double)sorted[i] / NSEC_PER_MSEC;
+}
+
+static int run_capture(int argc, char **argv)
+{
+	struct pulse_capture_info info = {.name = "pulse-mc-probe",
+					  .input = true};
+	uint64_t seconds = 10;
+	pa_channel_map map;
+	const char *device = NULL;
+
+	for (int i = 0; i < argc; i++) {
+		const char *opt = argv[i];
+		const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(opt, "--output") == 0) {
+			info.input = false;
+		} else if (strcmp(opt, "--seconds") == 0 && arg) {
+			seconds = strtoull(arg, NULL, 10);
+			i++;
+		} else if (strcmp(opt, "--fragsize") == 0 && arg) {
+			info.fragsize_ms = (uint32_t)strtoul(arg, NULL, 10);
+			i++;
+		} else if (strcmp(opt, "--maxlength") == 0 && arg) {
+			info.maxlength_ms = (uint32_t)strtoul(arg, NULL, 10);
+			i++;
+		} else if (strcmp(opt, "--channels") == 0 && arg) {
+			if (!pa_channel_map_parse(&map, arg)) {
+				fprintf(stderr, "Invalid channels '%s'\n", arg);
+				return 1;
+			}
+			info.channel_map = &map;
+			i++;
+		} else {
+			device = opt;
+		}
+	}
+	if (!device) {
+		fprintf(stderr, "No device given\n");
+		return 1;
+	}
+
+	struct dstr name = {0};
+	dstr_copy(&name, device);
+	if (!info.input && strcmp(device, "default") != 0)
+		dstr_cat(&name, ".monitor");
+	info.device = name.array;
+
+	struct probe_capture pc = {0};
+
+	struct pulse_capture *cap = pulse_capture_open(&info, false);
+	if (!cap) {
+		dstr_free(&name);
+		return 1;
+	}
+	pulse_capture_add_callback(cap, probe_packet, &pc);
+
+	/* let the capture pass its startup period before measuring the CPU */
+	os_sleep_ms(1000);
+	pulse_lock();
+	const uint64_t mainloop_cpu_start = pc.mainloop_cpu;
+	const uint64_t cpu_start = process_cpu_ns();
+	const uint64_t start = os_gettime_ns();
+	pulse_unlock();
+
+	os_sleep_ms((uint32_t)(seconds * 1000));
+
+	struct pulse_capture_stats stats;
+	pulse_capture_get_stats(cap, &stats);
+
+	pulse_lock();
+	const uint64_t wall = os_gettime_ns() - start;
+	const uint64_t mainloop_cpu = pc.mainloop_cpu - mainloop_cpu_start;
+	const uint64_t cpu = process_cpu_ns() - cpu_start;
+	pulse_unlock();
+
+	pa_sample_spec spec;
+	pulse_capture_get_sample_spec(cap, &spec);
+	pulse_capture_remove_callback(cap, probe_packet, &pc);
+	pulse_capture_release(cap);
+
+	char s[PA_SAMPLE_SPEC_SNPRINT_MAX];
+	pa_sample_spec_snprint(s, sizeof(s), &spec);
+	printf("device: %s\n", info.device);
+	printf("spec: %s\n", s);
+	printf("fragsize: %" PRIu32 " frames (%.1f ms)\n", stats.fragsize,
+	       spec.rate ? 1000.0 * stats.fragsize / spec.rate : 0.0);
+	printf("latency: %.1f ms\n", (double)stats.latency_ns / NSEC_PER_MSEC);
+	printf("startup: %.1f ms\n", (double)stats.startup_ns / NSEC_PER_MSEC);
+	printf("packets: %" PRIu64 ", %" PRIu32 "-%" PRIu32
+	       " frames, %.1f frames on average\n",
+	       pc.packets, pc.min_frames, pc.max_frames,
+	       pc.packets ? (double)pc.frames / (double)pc.packets : 0.0);
+
+	qsort(pc.jitter.array, pc.jitter.num, sizeof(int64_t), compare_int64);
+	printf("callback jitter: min %.3f ms, p50 %.3f ms, p99 %.3f ms, "
+	       "max %.3f ms\n",
+	       percentile_ms(pc.jitter.array, pc.jitter.num, 0.0),
+	       percentile_ms(pc.jitter.array, pc.jitter.num, 0.5),
+	       percentile_ms(pc.jitter.array, pc.jitter.num, 0.99),
+	       percentile_ms(pc.jitter.array, pc.jitter.num, 1.0));
+	printf("overflows: %" PRIu32 ", suspends: %" PRIu32
+	       ", backwards: %" PRIu32 "\n",
+	       stats.overflows, stats.suspends, stats.backwards);
+	printf("cpu: mainloop %.2f%%, process %.2f%%\n",
+	       100.0 * (double)mainloop_cpu / (double)wall,
+	       100.0 * (double)cpu / (double)wall);
+
+	da_free(pc.jitter);
+	dstr_free(&name);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || (strcmp(argv[1], "list") != 0 &&
+			 strcmp(argv[1], "capture") != 0)) {
+		fprintf(stderr, "usage: %s list\n"
+				"       %s capture [--output] [--seconds N] "
+				"[--fragsize MS] [--maxlength MS] "
+				"[--channels MAP] device\n",
+			argv[0], argv[0]);
+		return 1;
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	pulse_init();
+	event_log_start();
+
+	int ret = strcmp(argv[1], "list") == 0
+			  ? list_devices()
+			  : run_capture(argc - 2, argv + 2);
+
+	event_log_stop();
+	pulse_unref();
+
+	return ret;
+}
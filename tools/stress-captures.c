@@ -0,0 +1,307 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Scaling of the shared mainloop with the number of capture streams
+ *
+ * Eight multichannel null sinks are loaded and N captures, each with its own
+ * stream, record their monitors in turn. For each N, the CPU time of the
+ * mainloop thread, the delay from the timestamp of a packet to its callback,
+ * the packets that came late or were lost, and the time until every capture
+ * delivered its first packet are written to stdout as a JSON array, with the
+ * maximum resident set size of the process so far.
+ *
+ * usage: stress-captures [seconds-per-step]
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+
+#define STRESS_SINK "obs_mc_stress_"
+#define STRESS_SINKS 8
+#define STRESS_CHANNELS 8
+#define STARTUP_TIMEOUT_SEC 30
+
+/* number of captures of each step */
+static const size_t steps[] = {1, 8, 32, 128};
+
+struct stress_source {
+	struct stress *st;
+	struct pulse_capture *cap;
+
+	/* accessed from the mainloop */
+	uint64_t first_arrival;
+	uint64_t last_arrival;
+	uint64_t next_ts;
+	uint64_t packets;
+	uint64_t late;
+	uint64_t lost_frames;
+};
+
+struct stress {
+	/* accessed from the mainloop */
+	bool measuring;
+	uint64_t mainloop_cpu;
+	DARRAY(int64_t) delays;
+};
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	*(uint32_t *)userdata = idx;
+	pulse_signal(0);
+}
+
+static void module_unloaded(pa_context *c, int success, void *userdata)
+{
+	UNUSED_PARAMETER(c);
+	UNUSED_PARAMETER(success);
+	UNUSED_PARAMETER(userdata);
+	pulse_signal(0);
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void stress_packet(void *param,
+			  const struct pulse_capture_packet *packet)
+{
+	struct stress_source *src = param;
+	struct stress *st = src->st;
+	const uint64_t now = os_gettime_ns();
+	const uint64_t duration = util_mul_div64(packet->frames, NSEC_PER_SEC,
+						 packet->samples_per_sec);
+
+	/* the callbacks run on the mainloop thread */
+	st->mainloop_cpu = thread_cpu_ns();
+
+	if (!src->first_arrival)
+		src->first_arrival = now;
+
+	if (st->measuring) {
+		int64_t delay = (int64_t)(now - packet->timestamp);
+		da_push_back(st->delays, &delay);
+
+		if (src->last_arrival &&
+		    now - src->last_arrival > 2 * duration + 5 * NSEC_PER_MSEC)
+			src->late++;
+
+		if (src->next_ts && packet->timestamp > src->next_ts +
+								NSEC_PER_MSEC)
+			src->lost_frames += util_mul_div64(
+				packet->timestamp - src->next_ts,
+				packet->samples_per_sec, NSEC_PER_SEC);
+
+		src->packets++;
+	}
+
+	src->last_arrival = now;
+	src->next_ts = packet->timestamp + duration;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *sorted, size_t n, double p)
+{
+	if (!n)
+		return 0.0;
+	size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+	return (double)sorted[i] / NSEC_PER_MSEC;
+}
+
+static void run_step(size_t n, uint64_t seconds, bool first)
+{
+	struct stress st = {0};
+	struct stress_source *sources = bzalloc(sizeof(*sources) * n);
+
+	const uint64_t start = os_gettime_ns();
+	for (size_t i = 0; i < n; i++) {
+		char device[64];
+		snprintf(device, sizeof(device), STRESS_SINK "%zu.monitor",
+			 i % STRESS_SINKS);
+		struct pulse_capture_info info = {
+			.name = "stress-captures",
+			.device = device,
+			.input = false,
+		};
+
+		sources[i].st = &st;
+		sources[i].cap = pulse_capture_open(&info, false);
+		if (sources[i].cap)
+			pulse_capture_add_callback(sources[i].cap,
+						   stress_packet, &sources[i]);
+	}
+	const uint64_t opened = os_gettime_ns();
+
+	/* wait until every capture passed its startup period */
+	uint64_t started = 0;
+	while (!started &&
+	       os_gettime_ns() < start + STARTUP_TIMEOUT_SEC * NSEC_PER_SEC) {
+		os_sleep_ms(10);
+		pulse_lock();
+		uint64_t last = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (!sources[i].cap)
+				continue;
+			if (!sources[i].first_arrival) {
+				last = 0;
+				break;
+			}
+			if (sources[i].first_arrival > last)
+				last = sources[i].first_arrival;
+		}
+		started = last;
+		pulse_unlock();
+	}
+
+	pulse_lock();
+	st.measuring = true;
+	const uint64_t cpu_start = st.mainloop_cpu;
+	const uint64_t measure_start = os_gettime_ns();
+	pulse_unlock();
+
+	os_sleep_ms((uint32_t)(seconds * 1000));
+
+	pulse_lock();
+	st.measuring = false;
+	const uint64_t cpu = st.mainloop_cpu - cpu_start;
+	const uint64_t wall = os_gettime_ns() - measure_start;
+	pulse_unlock();
+
+	uint64_t packets = 0, late = 0, lost_frames = 0;
+	size_t opened_captures = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (sources[i].cap) {
+			pulse_capture_remove_callback(sources[i].cap,
+						      stress_packet,
+						      &sources[i]);
+			pulse_capture_release(sources[i].cap);
+			opened_captures++;
+		}
+		packets += sources[i].packets;
+		late += sources[i].late;
+		lost_frames += sources[i].lost_frames;
+	}
+
+	qsort(st.delays.array, st.delays.num, sizeof(int64_t), compare_int64);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%s\n  {\"captures\": %zu, \"opened\": %zu, "
+	       "\"open_ms\": %.1f, \"startup_ms\": %.1f, ",
+	       first ? "" : ",", n, opened_captures,
+	       (double)(opened - start) / NSEC_PER_MSEC,
+	       started ? (double)(started - start) / NSEC_PER_MSEC : -1.0);
+	printf("\"mainloop_cpu_percent\": %.2f, \"packets\": %" PRIu64
+	       ", \"late\": %" PRIu64 ", \"lost_frames\": %" PRIu64 ", ",
+	       100.0 * (double)cpu / (double)wall, packets, late, lost_frames);
+	printf("\"max_rss_kb\": %ld, ", ru.ru_maxrss);
+	printf("\"delay_ms\": {\"p50\": %.3f, \"p99\": %.3f, "
+	       "\"p999\": %.3f, \"max\": %.3f}}",
+	       percentile_ms(st.delays.array, st.delays.num, 0.5),
+	       percentile_ms(st.delays.array, st.delays.num, 0.99),
+	       percentile_ms(st.delays.array, st.delays.num, 0.999),
+	       percentile_ms(st.delays.array, st.delays.num, 1.0));
+	fflush(stdout);
+
+	da_free(st.delays);
+	bfree(sources);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seconds = argc > 1 ? strtoull(argv[1], NULL, 10) : 10;
+	if (!seconds)
+		seconds = 10;
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	pulse_init();
+	event_log_start();
+
+	uint32_t modules[STRESS_SINKS];
+	size_t n_modules = 0;
+	for (size_t i = 0; i < STRESS_SINKS; i++) {
+		char arg[128];
+		snprintf(arg, sizeof(arg),
+			 "sink_name=" STRESS_SINK "%zu format=float32le "
+			 "rate=48000 channels=%d",
+			 i, STRESS_CHANNELS);
+
+		uint32_t module = PA_INVALID_INDEX;
+		pulse_load_module("module-null-sink", arg, module_loaded,
+				  &module);
+		if (module == PA_INVALID_INDEX) {
+			fprintf(stderr, "Unable to load module-null-sink\n");
+			break;
+		}
+		modules[n_modules++] = module;
+	}
+
+	if (n_modules == STRESS_SINKS) {
+		printf("[");
+		for (size_t i = 0; i < sizeof(steps) / sizeof(*steps); i++)
+			run_step(steps[i], seconds, i == 0);
+		printf("\n]\n");
+	}
+
+	for (size_t i = 0; i < n_modules; i++)
+		pulse_unload_module(modules[i], module_unloaded, NULL);
+	event_log_stop();
+	pulse_unref();
+
+	return n_modules == STRESS_SINKS ? 0 : 1;
+}
@@ -0,0 +1,477 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Simulation of a device clock fed through the timestamp logic
+ *
+ * A simulated device records frames at a rate off by a given error, and the
+ * packets arrive with scheduling jitter in a given fragment pattern,
+ * optionally with periodic suspends. The packets are fed through the read
+ * path of the capture with the simulated clock as records of a trace. Each
+ * frame carries its index on the device so that the timestamp of every
+ * emitted packet is compared with the time the device recorded it.
+ *
+ * The scores are written to stdout as JSON, the log goes to stderr. The same
+ * options and seed give the same scores.
+ *
+ * usage: timestamp-sim [options]
+ *   --seconds N         simulated duration, default 60
+ *   --rate HZ           nominal rate of the device, default 48000
+ *   --ppm E             error of the device rate, default 0
+ *   --jitter-us J       mean scheduling delay of the callbacks, default 0
+ *   --latency-ms L      latency from recording to the callback, default 25
+ *   --latency-noise-us N  error of the latency reported by the server
+ *   --fragment-ms F     fragment size, default 25
+ *   --pattern P         fixed, random or split, default fixed
+ *   --suspend-every S   suspend the device every S seconds
+ *   --suspend-ms D      duration of each suspend, default 500
+ *   --seed N            seed of the random numbers, default 1
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
+
+#define BYTES_PER_FRAME 4
+
+/* arbitrary origin of the simulated clock */
+#define SIM_EPOCH (1000 * NSEC_PER_SEC)
+
+/* an error changing more than this between packets is a discontinuity */
+#define DISCONTINUITY_NS NSEC_PER_MSEC
+
+enum sim_pattern {
+	PATTERN_FIXED,
+	PATTERN_RANDOM,
+	PATTERN_SPLIT,
+};
+
+struct sim_params {
+	double seconds;
+	uint32_t rate;
+	double ppm;
+	double jitter_us;
+	double latency_ms;
+	double latency_noise_us;
+	double fragment_ms;
+	enum sim_pattern pattern;
+	double suspend_every;
+	double suspend_ms;
+	uint64_t seed;
+};
+
+/* frames from `frame` on were recorded from `time` on */
+struct sim_segment {
+	uint64_t frame;
+	double time;
+};
+
+struct sim_score {
+	double period;
+	DARRAY(struct sim_segment) segments;
+
+	/* emitted packets */
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t lost_frames;
+	uint64_t backwards;
+	uint64_t discontinuities;
+	uint64_t next_frame;
+	uint64_t next_ts;
+	bool have_prev;
+	double prev_err;
+
+	/* true time and error of each packet */
+	DARRAY(double) times;
+	DARRAY(double) errors;
+	DARRAY(double) steps;
+};
+
+static uint64_t rng_state;
+
+static double rng_uniform(void)
+{
+	/* xorshift64*, deterministic across platforms */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (double)((rng_state * 0x2545f4914f6cdd1dULL) >> 11) /
+	       (double)(1ULL << 53);
+}
+
+static double rng_exponential(double mean)
+{
+	return mean > 0.0 ? -mean * log(1.0 - rng_uniform()) : 0.0;
+}
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static double frame_time(const struct sim_score *sc, uint64_t frame)
+{
+	const struct sim_segment *seg = &sc->segments.array[0];
+	for (size_t i = 1; i < sc->segments.num; i++) {
+		if (sc->segments.array[i].frame > frame)
+			break;
+		seg = &sc->segments.array[i];
+	}
+
+	return seg->time + (double)(frame - seg->frame) * sc->period;
+}
+
+static void score_packet(void *param, const struct pulse_capture_packet *packet)
+{
+	struct sim_score *sc = param;
+	const int32_t index = *(const int32_t *)packet->data;
+	const uint64_t frame = (uint32_t)index;
+	const double t = frame_time(sc, frame);
+	const double err = (double)packet->timestamp - t;
+
+	if (sc->packets && frame > sc->next_frame)
+		sc->lost_frames += frame - sc->next_frame;
+
+	const uint64_t frame_ns = NSEC_PER_SEC / packet->samples_per_sec;
+	if (sc->packets && packet->timestamp + frame_ns < sc->next_ts)
+		sc->backwards++;
+
+	if (sc->have_prev) {
+		const double step = fabs(err - sc->prev_err);
+		da_push_back(sc->steps, &step);
+		if (step > DISCONTINUITY_NS)
+			sc->discontinuities++;
+	}
+	sc->prev_err = err;
+	sc->have_prev = true;
+
+	da_push_back(sc->times, &t);
+	da_push_back(sc->errors, &err);
+
+	sc->packets++;
+	sc->frames += packet->frames;
+	sc->next_frame = frame + packet->frames;
+	sc->next_ts = packet->timestamp +
+		      (uint64_t)packet->frames * NSEC_PER_SEC /
+			      packet->samples_per_sec;
+}
+
+static size_t next_fragment(const struct sim_params *p, size_t fragment)
+{
+	switch (p->pattern) {
+	case PATTERN_RANDOM:
+		return (1 + (size_t)(rng_uniform() * (double)(2 * fragment))) *
+		       BYTES_PER_FRAME;
+	case PATTERN_SPLIT:
+		return 1 + (size_t)(rng_uniform() *
+				    (double)(2 * fragment * BYTES_PER_FRAME));
+	case PATTERN_FIXED:
+	default:
+		return fragment * BYTES_PER_FRAME;
+	}
+}
+
+static void replay(struct pulse_capture *cap, uint32_t type, size_t bytes,
+		   double time, int64_t latency, const void *payload)
+{
+	struct capture_trace_record rec;
+	rec.type = type;
+	rec.bytes = (uint32_t)bytes;
+	rec.time = (uint64_t)llround(time);
+	rec.latency = latency;
+	pulse_capture_replay(cap, &rec, payload);
+}
+
+/**
+ * Produce the packets of the simulated device and feed them to the capture
+ *
+ * The byte stream of the device is cut into packets by the fragment pattern.
+ * A packet arrives once its last frame is recorded, after the latency and a
+ * scheduling delay.
+ */
+static void simulate(const struct sim_params *p, struct pulse_capture *cap,
+		     struct sim_score *sc)
+{
+	const size_t fragment =
+		(size_t)(p->fragment_ms * (double)p->rate / 1000.0);
+	const double end = SIM_EPOCH + p->seconds * NSEC_PER_SEC;
+	const double suspend_every = p->suspend_every * NSEC_PER_SEC;
+
+	uint8_t *buf = bmalloc(4 * fragment * BYTES_PER_FRAME + 8);
+	uint64_t byte_pos = 0;
+	double last_arrival = 0.0;
+	double next_suspend = suspend_every > 0.0 ? SIM_EPOCH + suspend_every
+						   : INFINITY;
+
+	struct sim_segment seg = {0, SIM_EPOCH};
+	da_push_back(sc->segments, &seg);
+
+	for (;;) {
+		const size_t bytes = next_fragment(p, fragment);
+		const uint64_t first = byte_pos / BYTES_PER_FRAME;
+		const uint64_t last =
+			(byte_pos + bytes + BYTES_PER_FRAME - 1) /
+			BYTES_PER_FRAME;
+		const double recorded = frame_time(sc, last);
+		if (recorded > end)
+			break;
+
+		if (recorded > next_suspend) {
+			/* the device stops after the frames read so far */
+			const double suspend_ns = p->suspend_ms * NSEC_PER_MSEC;
+			const uint64_t frame =
+				(byte_pos + BYTES_PER_FRAME - 1) /
+				BYTES_PER_FRAME;
+			const double t = frame_time(sc, frame);
+			replay(cap, CAPTURE_TRACE_SUSPEND, 0, t, -1, NULL);
+			replay(cap, CAPTURE_TRACE_RESUME, 0, t + suspend_ns,
+			       -1, NULL);
+			replay(cap, CAPTURE_TRACE_FLUSHED, 0,
+			       t + suspend_ns + NSEC_PER_MSEC, -1, NULL);
+
+			/* the partial frame is dropped by the flush */
+			byte_pos = frame * BYTES_PER_FRAME;
+			seg.frame = frame;
+			seg.time = t + suspend_ns;
+			da_push_back(sc->segments, &seg);
+			last_arrival = seg.time;
+			next_suspend = seg.time + suspend_every;
+			continue;
+		}
+
+		const double arrival_raw =
+			recorded + p->latency_ms * NSEC_PER_MSEC +
+			rng_exponential(p->jitter_us * NSEC_PER_USEC);
+		const double arrival = fmax(arrival_raw, last_arrival);
+		last_arrival = arrival;
+
+		const double noise = (rng_uniform() * 2.0 - 1.0) *
+				     p->latency_noise_us * NSEC_PER_USEC;
+		const int64_t latency = (int64_t)llround(
+			fmax(arrival - frame_time(sc, first) + noise, 0.0));
+
+		/* each frame holds its index on the device */
+		const size_t offset = byte_pos % BYTES_PER_FRAME;
+		int32_t *frames = (int32_t *)buf;
+		for (uint64_t f = first; f <= last; f++)
+			frames[f - first] = (int32_t)(uint32_t)f;
+
+		replay(cap, CAPTURE_TRACE_PACKET, bytes, arrival, latency,
+		       buf + offset);
+		byte_pos += bytes;
+	}
+
+	bfree(buf);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, size_t n, double p)
+{
+	if (!n)
+		return 0.0;
+	qsort(v, n, sizeof(double), compare_double);
+	return v[(size_t)(p * (double)(n - 1) + 0.5)];
+}
+
+static void report(const struct sim_params *p, struct sim_score *sc)
+{
+	static const char *patterns[] = {"fixed", "random", "split"};
+	const size_t n = sc->errors.num;
+
+	/* least squares fit of the error over the true time */
+	double st = 0.0, se = 0.0, stt = 0.0, ste = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		const double t = (sc->times.array[i] - SIM_EPOCH) / NSEC_PER_SEC;
+		const double e = sc->errors.array[i];
+		st += t;
+		se += e;
+		stt += t * t;
+		ste += t * e;
+	}
+	const double den = (double)n * stt - st * st;
+	const double slope = n > 1 && den != 0.0
+				     ? ((double)n * ste - st * se) / den
+				     : 0.0;
+	const double intercept = n ? (se - slope * st) / (double)n : 0.0;
+
+	double var = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		const double t = (sc->times.array[i] - SIM_EPOCH) / NSEC_PER_SEC;
+		const double r = sc->errors.array[i] - (intercept + slope * t);
+		var += r * r;
+	}
+	const double jitter = n ? sqrt(var / (double)n) : 0.0;
+
+	const double p50 = percentile(sc->errors.array, n, 0.5);
+	const double p01 = percentile(sc->errors.array, n, 0.01);
+	const double p99 = percentile(sc->errors.array, n, 0.99);
+	const double step99 =
+		percentile(sc->steps.array, sc->steps.num, 0.99);
+
+	printf("{\"seconds\": %g, \"rate\": %" PRIu32 ", \"ppm\": %g, "
+	       "\"jitter_us\": %g, \"latency_ms\": %g, "
+	       "\"latency_noise_us\": %g, \"fragment_ms\": %g, "
+	       "\"pattern\": \"%s\", \"suspend_every\": %g, "
+	       "\"suspend_ms\": %g, \"seed\": %" PRIu64 ",\n",
+	       p->seconds, p->rate, p->ppm, p->jitter_us, p->latency_ms,
+	       p->latency_noise_us, p->fragment_ms, patterns[p->pattern],
+	       p->suspend_every, p->suspend_ms, p->seed);
+	printf(" \"packets\": %" PRIu64 ", \"frames\": %" PRIu64
+	       ", \"lost_frames\": %" PRIu64 ", \"backwards\": %" PRIu64
+	       ", \"discontinuities\": %" PRIu64 ",\n",
+	       sc->packets, sc->frames, sc->lost_frames, sc->backwards,
+	       sc->discontinuities);
+	printf(" \"error_ms\": {\"p1\": %.4f, \"p50\": %.4f, \"p99\": %.4f}, "
+	       "\"jitter_ms\": %.4f, \"step_p99_ms\": %.4f, "
+	       "\"drift_ppm\": %.3f}\n",
+	       p01 / NSEC_PER_MSEC, p50 / NSEC_PER_MSEC, p99 / NSEC_PER_MSEC,
+	       jitter / NSEC_PER_MSEC, step99 / NSEC_PER_MSEC,
+	       slope / 1000.0);
+}
+
+static bool parse_args(int argc, char **argv, struct sim_params *p)
+{
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+		const char *arg = i + 1 < argc ? argv[++i] : NULL;
+		if (!arg)
+			return false;
+
+		if (strcmp(opt, "--seconds") == 0)
+			p->seconds = atof(arg);
+		else if (strcmp(opt, "--rate") == 0)
+			p->rate = (uint32_t)strtoul(arg, NULL, 10);
+		else if (strcmp(opt, "--ppm") == 0)
+			p->ppm = atof(arg);
+		else if (strcmp(opt, "--jitter-us") == 0)
+			p->jitter_us = atof(arg);
+		else if (strcmp(opt, "--latency-ms") == 0)
+			p->latency_ms = atof(arg);
+		else if (strcmp(opt, "--latency-noise-us") == 0)
+			p->latency_noise_us = atof(arg);
+		else if (strcmp(opt, "--fragment-ms") == 0)
+			p->fragment_ms = atof(arg);
+		else if (strcmp(opt, "--suspend-every") == 0)
+			p->suspend_every = atof(arg);
+		else if (strcmp(opt, "--suspend-ms") == 0)
+			p->suspend_ms = atof(arg);
+		else if (strcmp(opt, "--seed") == 0)
+			p->seed = strtoull(arg, NULL, 10);
+		else if (strcmp(opt, "--pattern") == 0 &&
+			 strcmp(arg, "fixed") == 0)
+			p->pattern = PATTERN_FIXED;
+		else if (strcmp(opt, "--pattern") == 0 &&
+			 strcmp(arg, "random") == 0)
+			p->pattern = PATTERN_RANDOM;
+		else if (strcmp(opt, "--pattern") == 0 &&
+			 strcmp(arg, "split") == 0)
+			p->pattern = PATTERN_SPLIT;
+		else
+			return false;
+	}
+
+	return p->rate > 0 && p->fragment_ms > 0.0 && p->seconds > 0.0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_params p = {
+		.seconds = 60.0,
+		.rate = 48000,
+		.latency_ms = 25.0,
+		.fragment_ms = 25.0,
+		.pattern = PATTERN_FIXED,
+		.suspend_ms = 500.0,
+		.seed = 1,
+	};
+	if (!parse_args(argc, argv, &p)) {
+		fprintf(stderr, "usage: %s [--seconds N] [--rate HZ] "
+				"[--ppm E] [--jitter-us J] [--latency-ms L] "
+				"[--latency-noise-us N] [--fragment-ms F] "
+				"[--pattern fixed|random|split] "
+				"[--suspend-every S] [--suspend-ms D] "
+				"[--seed N]\n",
+			argv[0]);
+		return 1;
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+	rng_state = p.seed ? p.seed : 1;
+
+	/* the read path runs with the mainloop locked */
+	pulse_init();
+	event_log_start();
+
+	struct capture_trace_header hdr = {0};
+	hdr.format = PA_SAMPLE_S32LE;
+	hdr.samples_per_sec = p.rate;
+	hdr.channels = 1;
+	hdr.bytes_per_frame = BYTES_PER_FRAME;
+
+	struct sim_score sc = {0};
+	sc.period = (double)NSEC_PER_SEC / (p.rate * (1.0 + p.ppm * 1e-6));
+
+	struct pulse_capture *cap =
+		pulse_capture_open_replay("timestamp-sim", &hdr);
+	pulse_capture_add_callback(cap, score_packet, &sc);
+
+	pulse_lock();
+	simulate(&p, cap, &sc);
+	pulse_unlock();
+
+	pulse_capture_remove_callback(cap, score_packet, &sc);
+	pulse_capture_release(cap);
+	event_log_stop();
+	pulse_unref();
+
+	report(&p, &sc);
+
+	da_free(sc.segments);
+	da_free(sc.times);
+	da_free(sc.errors);
+	da_free(sc.steps);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+Copyright (C) 2023 by Norihiro Kamae <norihiro@nagater.net>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replay of a capture trace through the read path of the capture
+ *
+ * The trace is recorded by setting OBS_PULSE_MC_TRACE_DIR before starting
+ * OBS. The records are fed as fast as possible, or at the recorded pace with
+ * --realtime, and the timestamps given to the callbacks are summarized. Two
+ * replays of the same trace print the same hash unless the read path changed
+ * its timestamps.
+ *
+ * usage: trace-replay [--realtime] file
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <obs.h>
+
+#include "pulse-wrapper.h"
+#include "pulse-capture.h"
+#include "event-log.h"
+
+struct replay_stats {
+	uint64_t packets;
+	uint64_t frames;
+	uint64_t backwards;
+	uint64_t last_ts;
+	uint64_t hash;
+};
+
+static void log_to_stderr(int level, const char *format, va_list args,
+			  void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING)
+		return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void replay_packet(void *param,
+			  const struct pulse_capture_packet *packet)
+{
+	struct replay_stats *st = param;
+
+	if (packet->timestamp < st->last_ts)
+		st->backwards++;
+	st->last_ts = packet->timestamp;
+
+	/* FNV-1a over the timestamps and the frame counts */
+	const uint64_t v[2] = {packet->timestamp, packet->frames};
+	const uint8_t *p = (const uint8_t *)v;
+	for (size_t i = 0; i < sizeof(v); i++) {
+		st->hash ^= p[i];
+		st->hash *= 0x100000001b3ULL;
+	}
+
+	st->packets++;
+	st->frames += packet->frames;
+}
+
+int main(int argc, char **argv)
+{
+	bool realtime = false;
+	const char *path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--realtime") == 0)
+			realtime = true;
+		else
+			path = argv[i];
+	}
+	if (!path) {
+		fprintf(stderr, "usage: %s [--realtime] file\n", argv[0]);
+		return 1;
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	struct capture_trace_header hdr;
+	struct capture_trace *trace = capture_trace_open(path, &hdr);
+	if (!trace)
+		return 1;
+
+	/* the read path runs with the mainloop locked */
+	pulse_init();
+	event_log_start();
+
+	struct replay_stats st = {.hash = 0xcbf29ce484222325ULL};
+	struct pulse_capture *cap = pulse_capture_open_replay("replay", &hdr);
+	pulse_capture_add_callback(cap, replay_packet, &st);
+
+	struct capture_trace_record rec;
+	const void *payload;
+	uint64_t records = 0;
+	uint64_t first_time = 0;
+	const uint64_t start = os_gettime_ns();
+
+	pulse_lock();
+	while (capture_trace_read(trace, &rec, &payload)) {
+		if (!records)
+			first_time = rec.time;
+
+		if (realtime) {
+			pulse_unlock();
+			os_sleepto_ns(start + (rec.time - first_time));
+			pulse_lock();
+		}
+
+		pulse_capture_replay(cap, &rec, payload);
+		records++;
+	}
+	pulse_unlock();
+
+	const double sec = (double)(os_gettime_ns() - start) / 1e9;
+
+	pulse_capture_remove_callback(cap, replay_packet, &st);
+	pulse_capture_release(cap);
+	capture_trace_close(trace);
+	event_log_stop();
+	pulse_unref();
+
+	printf("records: %" PRIu64 "\n", records);
+	printf("packets: %" PRIu64 "\n", st.packets);
+	printf("frames: %" PRIu64 "\n", st.frames);
+	printf("backwards: %" PRIu64 "\n", st.backwards);
+	printf("hash: %016" PRIx64 "\n", st.hash);
+	printf("records/s: %.0f\n", sec > 0.0 ? (double)records / sec : 0.0);
+	printf("frames/s: %.0f\n", sec > 0.0 ? (double)st.frames / sec : 0.0);
+
+	return 0;
+}